@@ -0,0 +1,229 @@
+
+#ifndef POINTCLOUD_PAINTER_DEPTH_KERNEL_H
+#define POINTCLOUD_PAINTER_DEPTH_KERNEL_H
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pointcloud_painter/octahedral_sphere.h"
+#include "pointcloud_painter/region_of_interest.h"
+
+/* Fused Depth Preprocessing
+ 	Preparing the depth cloud used to take four sweeps over it (transform the message, convert it to PCL, then find
+ 	each point's range and direction for the spheres). painterFusedDepthKernel does it all in one: it reads x, y, z
+ 	(and intensity) straight out of the raw message buffer, applies the rigid transform, finds range and direction,
+ 	drops NaN and zero-range points (and any outside the region of interest, if one is given), and writes each of the outputs it is given into preallocated arrays.
+ 	Four points are processed at a time with SSE2 where available; the octahedral encoding is bit-identical to
+ 	painterOctEncode either way.
+*/
+
+// Where to find each point's fields in a raw (little-endian, FLOAT32 fields) point buffer
+struct PainterDepthInput
+{
+	const uint8_t *data;
+	size_t point_count;
+	size_t point_step;
+	int x_offset, y_offset, z_offset;
+	int intensity_offset; 				// -1 -> no intensity field (written as 0)
+};
+
+// Outputs, each sized for point_count points - NULL for any that aren't wanted
+struct PainterDepthOutput
+{
+	pcl::PointXYZI *points; 			// Transformed points
+	PainterSphereDepth *sphere; 		// Octahedral-encoded direction and range
+	pcl::PointXYZI *directions; 		// Unit direction, with intensity
+};
+
+// Layout of a PointCloud2 for the kernel - false unless x, y, z (and intensity, if present) are little-endian FLOAT32
+//   and the rows are packed. The points are read from data where given (held outside the message, e.g. mapped from a
+//   file - it must hold all of them), otherwise from cloud.data
+inline bool painterDepthLayout(const sensor_msgs::PointCloud2 &cloud, PainterDepthInput &in, const uint8_t *data = NULL)
+{
+	in.x_offset = in.y_offset = in.z_offset = in.intensity_offset = -1;
+	for(size_t f=0; f<cloud.fields.size(); f++)
+	{
+		const sensor_msgs::PointField &field = cloud.fields[f];
+		if(field.datatype != sensor_msgs::PointField::FLOAT32 || field.offset + sizeof(float) > cloud.point_step)
+			continue;
+		if(field.name == "x") 					in.x_offset = field.offset;
+		else if(field.name == "y") 				in.y_offset = field.offset;
+		else if(field.name == "z") 				in.z_offset = field.offset;
+		else if(field.name == "intensity") 		in.intensity_offset = field.offset;
+	}
+	size_t point_count = size_t(cloud.width) * cloud.height;
+	if(cloud.is_bigendian || in.x_offset < 0 || in.y_offset < 0 || in.z_offset < 0)
+		return false;
+	if(cloud.height > 1 && cloud.row_step != cloud.width * cloud.point_step)
+		return false;
+	if(data == NULL && cloud.data.size() < point_count * cloud.point_step)
+		return false;
+	in.data = (data != NULL) ? data : cloud.data.data();
+	in.point_count = point_count;
+	in.point_step = cloud.point_step;
+	return true;
+}
+
+// Layout of a PCL XYZI cloud for the kernel
+inline PainterDepthInput painterDepthLayout(const pcl::PointCloud<pcl::PointXYZI> &cloud)
+{
+	PainterDepthInput in;
+	pcl::PointXYZI sample;
+	const uint8_t *base = reinterpret_cast<const uint8_t*>(&sample);
+	in.data = reinterpret_cast<const uint8_t*>(cloud.points.data());
+	in.point_count = cloud.points.size();
+	in.point_step = sizeof(pcl::PointXYZI);
+	in.x_offset = reinterpret_cast<const uint8_t*>(&sample.x) - base;
+	in.y_offset = reinterpret_cast<const uint8_t*>(&sample.y) - base;
+	in.z_offset = reinterpret_cast<const uint8_t*>(&sample.z) - base;
+	in.intensity_offset = reinterpret_cast<const uint8_t*>(&sample.intensity) - base;
+	return in;
+}
+
+inline float painterReadFloat(const uint8_t *point, int offset)
+{
+	float value;
+	memcpy(&value, point + offset, sizeof(float));
+	return value;
+}
+
+// Writes one kept point (tx, ty, tz, at range, with unit direction dx, dy, dz) to the outputs at index n
+inline void painterWriteDepthPoint(const PainterDepthOutput &out, size_t n, float tx, float ty, float tz, float intensity, float range, float dx, float dy, float dz, uint16_t u, uint16_t v)
+{
+	if(out.points != NULL)
+	{
+		pcl::PointXYZI &point = out.points[n];
+		point.x = tx; 	point.y = ty; 	point.z = tz;
+		point.intensity = intensity;
+	}
+	if(out.sphere != NULL)
+	{
+		out.sphere[n].u = u;
+		out.sphere[n].v = v;
+		out.sphere[n].range = range;
+	}
+	if(out.directions != NULL)
+	{
+		pcl::PointXYZI &direction = out.directions[n];
+		direction.x = dx; 	direction.y = dy; 	direction.z = dz;
+		direction.intensity = intensity;
+	}
+}
+
+/* painterFusedDepthKernel - transform (row-major 3x4 [R|t]), filter and project a raw depth cloud in one pass
+ 	Returns the number of points kept; the first that many entries of each output are filled, in input order.
+ 	out.points may be the input cloud itself (compacting it in place), since point n is never written before it is read.
+ 	roi - if not NULL, only points within it (in the transformed frame) are kept
+*/
+inline size_t painterFusedDepthKernel(const PainterDepthInput &in, const float transform[12], const PainterDepthOutput &out, const PainterRegionOfInterest *roi = NULL)
+{
+	size_t kept = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128 r00 = _mm_set1_ps(transform[0]), r01 = _mm_set1_ps(transform[1]), r02 = _mm_set1_ps(transform[2]), t0 = _mm_set1_ps(transform[3]);
+	const __m128 r10 = _mm_set1_ps(transform[4]), r11 = _mm_set1_ps(transform[5]), r12 = _mm_set1_ps(transform[6]), t1 = _mm_set1_ps(transform[7]);
+	const __m128 r20 = _mm_set1_ps(transform[8]), r21 = _mm_set1_ps(transform[9]), r22 = _mm_set1_ps(transform[10]), t2 = _mm_set1_ps(transform[11]);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 scale = _mm_set1_ps(65535.0f);
+	const __m128 max_sqr = _mm_set1_ps(FLT_MAX);
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	for(; i+4<=in.point_count; i+=4)
+	{
+		const uint8_t *p0 = in.data + i*in.point_step;
+		const uint8_t *p1 = p0 + in.point_step;
+		const uint8_t *p2 = p1 + in.point_step;
+		const uint8_t *p3 = p2 + in.point_step;
+		__m128 x = _mm_setr_ps(painterReadFloat(p0, in.x_offset), painterReadFloat(p1, in.x_offset), painterReadFloat(p2, in.x_offset), painterReadFloat(p3, in.x_offset));
+		__m128 y = _mm_setr_ps(painterReadFloat(p0, in.y_offset), painterReadFloat(p1, in.y_offset), painterReadFloat(p2, in.y_offset), painterReadFloat(p3, in.y_offset));
+		__m128 z = _mm_setr_ps(painterReadFloat(p0, in.z_offset), painterReadFloat(p1, in.z_offset), painterReadFloat(p2, in.z_offset), painterReadFloat(p3, in.z_offset));
+
+		// ------ Rigid Transform ------
+		__m128 tx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r00, x), _mm_mul_ps(r01, y)), _mm_add_ps(_mm_mul_ps(r02, z), t0));
+		__m128 ty = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r10, x), _mm_mul_ps(r11, y)), _mm_add_ps(_mm_mul_ps(r12, z), t1));
+		__m128 tz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r20, x), _mm_mul_ps(r21, y)), _mm_add_ps(_mm_mul_ps(r22, z), t2));
+
+		// ------ Range, Validity ------
+		//   Comparisons are false for NaN, so this also drops NaN and infinite points
+		__m128 sqr_range = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)), _mm_mul_ps(tz, tz));
+		int valid = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(sqr_range, zero), _mm_cmple_ps(sqr_range, max_sqr)));
+		if(valid == 0)
+			continue;
+		__m128 range = _mm_sqrt_ps(sqr_range);
+		__m128 inverse_range = _mm_div_ps(one, range);
+		__m128 dx = _mm_mul_ps(tx, inverse_range);
+		__m128 dy = _mm_mul_ps(ty, inverse_range);
+		__m128 dz = _mm_mul_ps(tz, inverse_range);
+
+		// ------ Octahedral Encoding (as painterOctEncode) ------
+		__m128 l1 = _mm_add_ps(_mm_add_ps(_mm_and_ps(tx, abs_mask), _mm_and_ps(ty, abs_mask)), _mm_and_ps(tz, abs_mask));
+		__m128 px = _mm_div_ps(tx, l1);
+		__m128 py = _mm_div_ps(ty, l1);
+		__m128 sign_x = _mm_or_ps(_mm_and_ps(_mm_cmpge_ps(px, zero), one), _mm_andnot_ps(_mm_cmpge_ps(px, zero), _mm_sub_ps(zero, one)));
+		__m128 sign_y = _mm_or_ps(_mm_and_ps(_mm_cmpge_ps(py, zero), one), _mm_andnot_ps(_mm_cmpge_ps(py, zero), _mm_sub_ps(zero, one)));
+		__m128 fold_x = _mm_mul_ps(_mm_sub_ps(one, _mm_and_ps(py, abs_mask)), sign_x);
+		__m128 fold_y = _mm_mul_ps(_mm_sub_ps(one, _mm_and_ps(px, abs_mask)), sign_y);
+		__m128 lower = _mm_cmplt_ps(tz, zero);
+		px = _mm_or_ps(_mm_and_ps(lower, fold_x), _mm_andnot_ps(lower, px));
+		py = _mm_or_ps(_mm_and_ps(lower, fold_y), _mm_andnot_ps(lower, py));
+		__m128 qx = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(px, half), half), scale), half);
+		__m128 qy = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(py, half), half), scale), half);
+		qx = _mm_max_ps(zero, _mm_min_ps(scale, qx));
+		qy = _mm_max_ps(zero, _mm_min_ps(scale, qy));
+
+		float lane_tx[4], lane_ty[4], lane_tz[4], lane_range[4], lane_dx[4], lane_dy[4], lane_dz[4];
+		int32_t lane_u[4], lane_v[4];
+		_mm_storeu_ps(lane_tx, tx); 	_mm_storeu_ps(lane_ty, ty); 	_mm_storeu_ps(lane_tz, tz);
+		_mm_storeu_ps(lane_range, range);
+		_mm_storeu_ps(lane_dx, dx); 	_mm_storeu_ps(lane_dy, dy); 	_mm_storeu_ps(lane_dz, dz);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lane_u), _mm_cvttps_epi32(qx));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lane_v), _mm_cvttps_epi32(qy));
+		for(int lane=0; lane<4; lane++)
+		{
+			if(!(valid & (1 << lane)))
+				continue;
+			if(roi != NULL && !roi->containsPoint(lane_tx[lane], lane_ty[lane], lane_tz[lane]))
+				continue;
+			const uint8_t *point = p0 + lane*in.point_step;
+			float intensity = (in.intensity_offset >= 0) ? painterReadFloat(point, in.intensity_offset) : 0;
+			painterWriteDepthPoint(out, kept++, lane_tx[lane], lane_ty[lane], lane_tz[lane], intensity, lane_range[lane], lane_dx[lane], lane_dy[lane], lane_dz[lane], uint16_t(lane_u[lane]), uint16_t(lane_v[lane]));
+		}
+	}
+#endif
+	// Remaining points (or all of them, without SSE2)
+	for(; i<in.point_count; i++)
+	{
+		const uint8_t *point = in.data + i*in.point_step;
+		float x = painterReadFloat(point, in.x_offset);
+		float y = painterReadFloat(point, in.y_offset);
+		float z = painterReadFloat(point, in.z_offset);
+		float tx = (transform[0]*x + transform[1]*y) + (transform[2]*z + transform[3]);
+		float ty = (transform[4]*x + transform[5]*y) + (transform[6]*z + transform[7]);
+		float tz = (transform[8]*x + transform[9]*y) + (transform[10]*z + transform[11]);
+		float sqr_range = (tx*tx + ty*ty) + tz*tz;
+		if(!(sqr_range > 0 && sqr_range <= FLT_MAX))
+			continue;
+		if(roi != NULL && !roi->containsPoint(tx, ty, tz))
+			continue;
+		float range = sqrtf(sqr_range);
+		float inverse_range = 1.0f / range;
+		uint16_t u, v;
+		painterOctEncode(tx, ty, tz, u, v);
+		float intensity = (in.intensity_offset >= 0) ? painterReadFloat(point, in.intensity_offset) : 0;
+		painterWriteDepthPoint(out, kept++, tx, ty, tz, intensity, range, tx*inverse_range, ty*inverse_range, tz*inverse_range, u, v);
+	}
+	return kept;
+}
+
+#endif // POINTCLOUD_PAINTER_DEPTH_KERNEL_H
@@ -0,0 +1,323 @@
+
+#ifndef POINTCLOUD_PAINTER_LENS_MODELS_H
+#define POINTCLOUD_PAINTER_LENS_MODELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <pcl/point_types.h>
+
+// Lens model (projection type) IDs, as given in pointcloud_painter_srv/projections
+#define PAINTER_PROJ_EQUA_STEREO 	1
+#define PAINTER_PROJ_POLE_STEREO 	2
+#define PAINTER_PROJ_EQUAL_AREA 	3
+#define PAINTER_PROJ_FLAT 			4
+#define PAINTER_PROJ_EQUIDISTANT 	5
+#define PAINTER_PROJ_KANNALA_BRANDT 6
+
+// Number of lens_parameters given per image in pointcloud_painter_srv:  fx fy cx cy k1 k2 k3 k4
+#define PAINTER_LENS_PARAMETER_COUNT 8
+
+/* Lens Policies
+ 	Each lens model is a small policy type which PointcloudPainter::buildImageCloudsKernel is templated on, so that
+ 	each model compiles to its own branch-free pixel loop. A policy provides:
+ 	 - cut_corners 	  (compile-time) whether pixels outside the inscribed image circle should be skipped
+ 	 - setup() 		  precomputes everything which is constant over an image
+ 	 - inverse() 	  pixel (row i, column j) -> point on the unit sphere in the camera frame; false if the pixel is unused
+ 	 - forward() 	  point on the unit sphere -> pixel (row, column); false if it isn't seen by the lens
+ 	flat_x and flat_y are the pixel position normalized to [-0.5, 0.5], along rows and columns respectively.
+ 	As in the original models, the optical axis is -Z in the camera frame, with X along rows and Y along columns.
+ 	New models are added by writing a policy here and registering it in the PointcloudPainter constructor.
+*/
+
+// Everything a lens policy may need to know about one image
+struct PainterLensParams
+{
+	float max_angle; 					// Maximum FOV angle used by the lens (degrees)
+	int image_hgt; 						// Image size, after any raster compression
+	int image_wdt;
+	float pixel_scale; 					// Image size relative to the size the calibration was made at (1/compression ratio)
+	std::vector<float> coefficients; 	// PAINTER_LENS_PARAMETER_COUNT lens parameters (fx fy cx cy k1 k2 k3 k4), zero if not given
+	int row_offset; 					// Region of the image whose pixels were actually given (the whole image, unless it was cropped)
+	int col_offset;
+	int region_hgt;
+	int region_wdt;
+};
+
+// ------ Stereographic (Equidistant / Equal-angle) ------
+//   EQUA_STEREO and POLE_STEREO differ only in how wide the planar image is relative to the lens FOV
+template<int PlaneScale>
+struct PainterLensStereographic
+{
+	static const bool cut_corners = true;
+	float plane_width;
+
+	bool setup(const PainterLensParams &params)
+	{
+		// X position on the sphere where the highest angle allowed by the lens penetrates it from the origin:
+		float X_max_dist = cos( (params.max_angle-180)/2 *3.14159/180 );
+		float Z_max_dist = sin( (params.max_angle-180)/2 *3.14159/180 );
+		// maximum width of planar projection such that it will wrap properly to a R=1m sphere (since lenses do not have a 360 FOV, and blank areas are omitted from file)
+		plane_width = X_max_dist/(1 - Z_max_dist) * PlaneScale;
+		return true;
+	}
+	inline bool inverse(int i, int j, float flat_x, float flat_y, pcl::PointXYZRGB &point) const
+	{
+		// Account for FOV lens angle being less than 360 degrees
+		float xs = flat_x * plane_width;
+		float ys = flat_y * plane_width;
+		float rs = xs*xs + ys*ys;
+		// Perform projection
+		point.x = 2*xs/(1 + rs);
+		point.y = 2*ys/(1 + rs);
+		point.z = (-1 + rs)/(1 + rs);
+		return true;
+	}
+	inline bool forward(float x, float y, float z, int image_hgt, int image_wdt, float &row, float &col) const
+	{
+		if(z >= 1)
+			return false;
+		row = x/(1 - z) / plane_width * image_hgt + image_hgt/2;
+		col = y/(1 - z) / plane_width * image_wdt + image_wdt/2;
+		return true;
+	}
+};
+typedef PainterLensStereographic<2> PainterLensEquaStereo;
+typedef PainterLensStereographic<4> PainterLensPoleStereo;
+
+// ------ Lambert Zenithal Equal Area (Equisolid) ------
+struct PainterLensEqualArea
+{
+	static const bool cut_corners = true;
+	float plane_width;
+
+	bool setup(const PainterLensParams &params)
+	{
+		// X and Z position on the sphere where the highest angle allowed by the lens penetrates it from the origin:
+		float X_max_dist = cos( (params.max_angle-180)/2 *3.14159/180 );
+		float Z_max_dist = sin( (params.max_angle-180)/2 *3.14159/180 );
+		// maximum width of planar projection such that it will wrap properly to a R=1m sphere (since lenses do not have a 360 FOV, and blank areas are omitted from file)
+		plane_width = sqrt(2/(1-Z_max_dist)) * X_max_dist * 2;
+		return true;
+	}
+	inline bool inverse(int i, int j, float flat_x, float flat_y, pcl::PointXYZRGB &point) const
+	{
+		// Account for FOV lens angle being less than 360 degrees
+		float xs = flat_x * plane_width;
+		float ys = flat_y * plane_width;
+		float rs = xs*xs + ys*ys;
+		// Perform projection
+		float scale = sqrt( 1 - rs/4 );
+		point.x = scale * xs;
+		point.y = scale * ys;
+		point.z = -1 + rs/2;
+		return true;
+	}
+	inline bool forward(float x, float y, float z, int image_hgt, int image_wdt, float &row, float &col) const
+	{
+		if(z >= 1)
+			return false;
+		float scale = sqrt( (1 - z)/2 );
+		row = x/scale / plane_width * image_hgt + image_hgt/2;
+		col = y/scale / plane_width * image_wdt + image_wdt/2;
+		return true;
+	}
+};
+
+// ------ Rectangular ------
+struct PainterLensFlat
+{
+	static const bool cut_corners = false;
+	int image_hgt, image_wdt;
+	float tan_half_angle, tan_half_angle_off;
+
+	bool setup(const PainterLensParams &params)
+	{
+		image_hgt = params.image_hgt;
+		image_wdt = params.image_wdt;
+		float max_angle_off = params.max_angle * float(image_hgt) / float(image_wdt);
+		tan_half_angle = tan(params.max_angle/2);
+		tan_half_angle_off = tan(max_angle_off/2);
+		return true;
+	}
+	inline bool inverse(int i, int j, float flat_x, float flat_y, pcl::PointXYZRGB &point) const
+	{
+		float alpha = atan((1-2*float(i)/float(image_wdt))*tan_half_angle);
+		float beta = atan((1-2*float(j)/float(image_hgt))*tan_half_angle_off);
+		point.x = cos(beta)*cos(alpha);
+		point.y = cos(beta)*sin(alpha);
+		point.z = cos(beta);
+		return true;
+	}
+	// Not an exact inverse: inverse() above gives every pixel of a row the same ray direction (only its length changes
+	//   along the row), so no column can be recovered from a direction - see painterLensRoundTrips
+	inline bool forward(float x, float y, float z, int image_hgt, int image_wdt, float &row, float &col) const
+	{
+		if(z <= 0 || z > 1)
+			return false;
+		float alpha = atan2(y, x);
+		float beta = acos(z);
+		row = (1 - tan(alpha)/tan_half_angle) * image_wdt/2;
+		col = (1 - tan(beta)/tan_half_angle_off) * image_hgt/2;
+		return true;
+	}
+};
+
+// ------ Fisheye Distortion Polynomial ------
+// theta_d = theta (1 + k1 theta^2 + k2 theta^4 + k3 theta^6 + k4 theta^8), as used by Kannala-Brandt
+inline float painterFisheyeDistort(float theta, const float *k)
+{
+	float theta2 = theta*theta;
+	return theta * (1 + theta2*(k[0] + theta2*(k[1] + theta2*(k[2] + theta2*k[3]))));
+}
+// Invert painterFisheyeDistort by Newton's method (converges in a few steps for real lens coefficients)
+inline float painterFisheyeUndistort(float theta_d, const float *k)
+{
+	float theta = theta_d;
+	for(int iter=0; iter<8; iter++)
+	{
+		float theta2 = theta*theta;
+		float error = painterFisheyeDistort(theta, k) - theta_d;
+		float derivative = 1 + theta2*(3*k[0] + theta2*(5*k[1] + theta2*(7*k[2] + theta2*9*k[3])));
+		if(derivative == 0)
+			break;
+		theta -= error / derivative;
+		if(fabs(error) < 1e-6)
+			break;
+	}
+	return theta;
+}
+
+// ------ Equidistant (with distortion) ------
+//   Uncalibrated - the image circle is fit to max_angle (like the models above), with optional polynomial
+//   distortion k1..k4 in lens_parameters. With all k = 0 this is the ideal r = f*theta fisheye.
+struct PainterLensEquidistant
+{
+	static const bool cut_corners = true;
+	float k[4];
+	float theta_max, theta_d_max;
+
+	bool setup(const PainterLensParams &params)
+	{
+		for(int n=0; n<4; n++)
+			k[n] = params.coefficients[4+n];
+		theta_max = params.max_angle/2 *3.14159/180;
+		theta_d_max = painterFisheyeDistort(theta_max, k);
+		return theta_d_max > 0;
+	}
+	inline bool inverse(int i, int j, float flat_x, float flat_y, pcl::PointXYZRGB &point) const
+	{
+		float radius = sqrt(flat_x*flat_x + flat_y*flat_y);
+		if(radius == 0)
+		{
+			point.x = 0; 	point.y = 0; 	point.z = -1;
+			return true;
+		}
+		float theta = painterFisheyeUndistort(radius/0.5 * theta_d_max, k);
+		float sin_theta = sin(theta);
+		point.x = sin_theta * flat_x/radius;
+		point.y = sin_theta * flat_y/radius;
+		point.z = -cos(theta);
+		return true;
+	}
+	inline bool forward(float x, float y, float z, int image_hgt, int image_wdt, float &row, float &col) const
+	{
+		float theta = acos(std::max(-1.0f, std::min(1.0f, -z)));
+		if(theta > theta_max)
+			return false;
+		float xy = sqrt(x*x + y*y);
+		float radius = 0.5 * painterFisheyeDistort(theta, k) / theta_d_max;
+		row = (xy > 0 ? radius*x/xy : 0) * image_hgt + image_hgt/2;
+		col = (xy > 0 ? radius*y/xy : 0) * image_wdt + image_wdt/2;
+		return true;
+	}
+};
+
+// ------ Kannala-Brandt (calibrated) ------
+//   Uses a real fisheye calibration: fx fy cx cy (pixels, at full image resolution) and k1..k4.
+//   Pixels beyond max_angle are discarded.
+struct PainterLensKannalaBrandt
+{
+	static const bool cut_corners = false;
+	float fx, fy, cx, cy;
+	float k[4];
+	float theta_max;
+
+	bool setup(const PainterLensParams &params)
+	{
+		fx = params.coefficients[0] * params.pixel_scale;
+		fy = params.coefficients[1] * params.pixel_scale;
+		cx = params.coefficients[2] * params.pixel_scale;
+		cy = params.coefficients[3] * params.pixel_scale;
+		for(int n=0; n<4; n++)
+			k[n] = params.coefficients[4+n];
+		theta_max = params.max_angle/2 *3.14159/180;
+		return fx > 0 && fy > 0;
+	}
+	inline bool inverse(int i, int j, float flat_x, float flat_y, pcl::PointXYZRGB &point) const
+	{
+		float mx = (j - cx)/fx;
+		float my = (i - cy)/fy;
+		float theta_d = sqrt(mx*mx + my*my);
+		if(theta_d == 0)
+		{
+			point.x = 0; 	point.y = 0; 	point.z = -1;
+			return true;
+		}
+		float theta = painterFisheyeUndistort(theta_d, k);
+		if(theta > theta_max || theta < 0)
+			return false;
+		float sin_theta = sin(theta);
+		point.x = sin_theta * my/theta_d;
+		point.y = sin_theta * mx/theta_d;
+		point.z = -cos(theta);
+		return true;
+	}
+	inline bool forward(float x, float y, float z, int image_hgt, int image_wdt, float &row, float &col) const
+	{
+		float theta = acos(std::max(-1.0f, std::min(1.0f, -z)));
+		if(theta > theta_max)
+			return false;
+		float xy = sqrt(x*x + y*y);
+		float theta_d = painterFisheyeDistort(theta, k);
+		row = fy * (xy > 0 ? theta_d*x/xy : 0) + cy;
+		col = fx * (xy > 0 ? theta_d*y/xy : 0) + cx;
+		return true;
+	}
+};
+
+/* painterLensRoundTrips - whether a lens' forward() exactly inverts its inverse() for one image
+ 	Samples a grid of pixels over the image, takes each through inverse() to a unit ray and back through forward(),
+ 	and checks it lands within tolerance pixels of where it started (pixels the lens doesn't use are skipped).
+ 	Anything which maps directions back to pixels - such as painter_coordinator's image regions - should only trust
+ 	a lens for which this holds.
+*/
+template<typename Lens>
+bool painterLensRoundTrips(const Lens &lens, const PainterLensParams &params, int samples = 9, float tolerance = 1)
+{
+	int image_hgt = params.image_hgt;
+	int image_wdt = params.image_wdt;
+	for(int si=0; si<samples; si++)
+		for(int sj=0; sj<samples; sj++)
+		{
+			int i = (si * (image_hgt-1)) / std::max(samples-1, 1);
+			int j = (sj * (image_wdt-1)) / std::max(samples-1, 1);
+			// (pixel position normalized as in PointcloudPainter::buildImageCloudsKernel)
+			float flat_x = float(i-image_hgt/2) / image_hgt;
+			float flat_y = float(j-image_wdt/2) / image_wdt;
+			if(Lens::cut_corners && flat_x*flat_x + flat_y*flat_y > 0.25)
+				continue;
+			pcl::PointXYZRGB point;
+			if(!lens.inverse(i, j, flat_x, flat_y, point))
+				continue;
+			float distance = sqrt(point.x*point.x + point.y*point.y + point.z*point.z);
+			float row, col;
+			if(!(distance > 0) || !lens.forward(point.x/distance, point.y/distance, point.z/distance, image_hgt, image_wdt, row, col))
+				return false;
+			if(!(fabs(row - i) <= tolerance && fabs(col - j) <= tolerance))
+				return false;
+		}
+	return true;
+}
+
+#endif // POINTCLOUD_PAINTER_LENS_MODELS_H
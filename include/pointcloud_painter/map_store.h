@@ -0,0 +1,344 @@
+
+#ifndef POINTCLOUD_PAINTER_MAP_STORE_H
+#define POINTCLOUD_PAINTER_MAP_STORE_H
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdint.h>
+
+#include "pointcloud_painter/mapped_io.h"
+
+#define PAINTER_MAP_STORE_VERSION 1
+
+/* Painted Map Store
+ 	Painted points are archived on disk in cubic tiles (tile_size on a side, in the store's fixed frame): one file of
+ 	raw PainterStoredPoint records per tile, which new points are only ever appended to. index.bin holds one entry per
+ 	tile - its point count, the bounds of its points and the time span they were painted over - and is loaded whole
+ 	when the store is opened. A region query looks up the tiles it overlaps in the index and maps only those files,
+ 	so its cost depends on the size of the region (and the density of the points in it), not on the archive's.
+*/
+
+// One painted point, as stored
+struct PainterStoredPoint
+{
+	float x, y, z;
+	uint8_t r, g, b, a; 		// a unused
+	uint32_t stamp; 			// Time (whole seconds) of the paint call which produced it
+};
+
+// index.bin - this header, then tile_count PainterTileEntry
+struct PainterTileIndexHeader
+{
+	char magic[8]; 				// "PPMAPIDX"
+	uint32_t version;
+	float tile_size;
+	uint64_t tile_count;
+};
+
+struct PainterTileEntry
+{
+	int32_t ix, iy, iz; 		// The tile spans [ix, ix+1)*tile_size in x, and so on
+	uint32_t reserved;
+	uint64_t point_count; 		// Valid records in the tile file - any past these are from an interrupted append
+	float min[3], max[3]; 		// Bounds of the stored points
+	uint32_t stamp_min, stamp_max;
+};
+
+class PainterMapStore
+{
+public:
+	PainterMapStore() : tile_size_(0), point_count_(0) {}
+
+	// Opens the store in directory, creating it if there is none - an existing store keeps the tile size it was created with
+	bool open(const std::string &directory, float tile_size)
+	{
+		directory_.clear();
+		tiles_.clear();
+		point_count_ = 0;
+		if(mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+			return false;
+
+		PainterMappedFile index;
+		if(!index.openRead(directory + "/index.bin"))
+		{
+			if(!(tile_size > 0))
+				return false;
+			directory_ = directory;
+			tile_size_ = tile_size;
+			return writeIndex();
+		}
+		PainterTileIndexHeader header;
+		if(index.size() < sizeof(header))
+			return false;
+		memcpy(&header, index.data(), sizeof(header));
+		if(memcmp(header.magic, "PPMAPIDX", 8) != 0 || header.version != PAINTER_MAP_STORE_VERSION || !(header.tile_size > 0))
+			return false;
+		if(index.size() < sizeof(header) + header.tile_count*sizeof(PainterTileEntry))
+			return false;
+		for(uint64_t t=0; t<header.tile_count; t++)
+		{
+			PainterTileEntry tile;
+			memcpy(&tile, index.data() + sizeof(header) + t*sizeof(PainterTileEntry), sizeof(tile));
+			tiles_[tileKey(tile.ix, tile.iy, tile.iz)] = tile;
+			point_count_ += tile.point_count;
+		}
+		directory_ = directory;
+		tile_size_ = header.tile_size;
+		return true;
+	}
+
+	bool isOpen() const { return !directory_.empty(); }
+	float tileSize() const { return tile_size_; }
+	size_t tileCount() const { return tiles_.size(); }
+	uint64_t pointCount() const { return point_count_; }
+
+	// Appends points to their tiles, then rewrites the index; returns the number stored (points which are non-finite,
+	//   or too far out for a tile index, are skipped). Records are written past each tile's indexed count, and the
+	//   updated entries are only taken into the store once the new index has been written - if it can't be, the tile 
+	//   files are cut back to their indexed lengths, so a failed or interrupted call leaves the store as it was
+	size_t append(const std::vector<PainterStoredPoint> &points)
+	{
+		if(!isOpen())
+			return 0;
+		// Binned by tile first, so each tile file is written once
+		std::map<uint64_t, std::vector<PainterStoredPoint> > batches;
+		for(size_t i=0; i<points.size(); i++)
+		{
+			const PainterStoredPoint &point = points[i];
+			int32_t ix, iy, iz;
+			if(!tileIndex(point.x, ix) || !tileIndex(point.y, iy) || !tileIndex(point.z, iz))
+				continue;
+			batches[tileKey(ix, iy, iz)].push_back(point);
+		}
+
+		// Updated entries, with the ones they replace (point_count 0 for new tiles)
+		std::map<uint64_t, PainterTileEntry> staged, previous;
+		size_t stored = 0;
+		for(std::map<uint64_t, std::vector<PainterStoredPoint> >::iterator batch = batches.begin(); batch != batches.end(); batch++)
+		{
+			const PainterStoredPoint &first = batch->second[0];
+			PainterTileEntry tile;
+			std::unordered_map<uint64_t, PainterTileEntry>::iterator existing = tiles_.find(batch->first);
+			if(existing != tiles_.end())
+				tile = existing->second;
+			else
+			{
+				memset(&tile, 0, sizeof(tile));
+				tileIndex(first.x, tile.ix);
+				tileIndex(first.y, tile.iy);
+				tileIndex(first.z, tile.iz);
+				for(int a=0; a<3; a++)
+				{
+					tile.min[a] = std::numeric_limits<float>::max();
+					tile.max[a] = -std::numeric_limits<float>::max();
+				}
+				tile.stamp_min = std::numeric_limits<uint32_t>::max();
+			}
+
+			int fd = ::open(tilePath(tile).c_str(), O_WRONLY | O_CREAT, 0644);
+			if(fd < 0)
+				continue;
+			bool written = writeAll(fd, batch->second.data(), batch->second.size()*sizeof(PainterStoredPoint), tile.point_count*sizeof(PainterStoredPoint));
+			::close(fd);
+			if(!written)
+			{
+				truncateTile(tile);
+				continue;
+			}
+			previous[batch->first] = tile;
+
+			for(size_t i=0; i<batch->second.size(); i++)
+			{
+				const PainterStoredPoint &point = batch->second[i];
+				float xyz[3] = {point.x, point.y, point.z};
+				for(int a=0; a<3; a++)
+				{
+					tile.min[a] = std::min(tile.min[a], xyz[a]);
+					tile.max[a] = std::max(tile.max[a], xyz[a]);
+				}
+				tile.stamp_min = std::min(tile.stamp_min, point.stamp);
+				tile.stamp_max = std::max(tile.stamp_max, point.stamp);
+			}
+			tile.point_count += batch->second.size();
+			staged[batch->first] = tile;
+			stored += batch->second.size();
+		}
+		if(stored == 0)
+			return 0;
+
+		// The index is written from tiles_, so the staged entries go in - and come back out if it can't be written
+		for(std::map<uint64_t, PainterTileEntry>::iterator tile = staged.begin(); tile != staged.end(); tile++)
+			tiles_[tile->first] = tile->second;
+		if(!writeIndex())
+		{
+			for(std::map<uint64_t, PainterTileEntry>::iterator tile = previous.begin(); tile != previous.end(); tile++)
+			{
+				if(tile->second.point_count > 0)
+					tiles_[tile->first] = tile->second;
+				else
+					tiles_.erase(tile->first);
+				truncateTile(tile->second);
+			}
+			return 0;
+		}
+		point_count_ += stored;
+		return stored;
+	}
+
+	/* query - the stored points within region, painted between stamp_min and stamp_max (inclusive)
+	 	Region is anything with containsPoint(x, y, z), intersectsBox(min, max) and bounds(min, max) (see
+	 	region_of_interest.h). If voxel_size > 0, at most one point is kept per voxel_size cube, the first found.
+	 	Returns the number of tiles read.
+	*/
+	template<typename Region>
+	int query(const Region &region, uint32_t stamp_min, uint32_t stamp_max, float voxel_size, std::vector<PainterStoredPoint> &points) const
+	{
+		// Candidate tiles - enumerated from the region's bounds when that is fewer than there are tiles, so a small
+		//   query doesn't even scan the index
+		std::vector<const PainterTileEntry*> candidates;
+		float region_min[3], region_max[3];
+		bool enumerate = false;
+		int32_t first[3], last[3];
+		if(region.bounds(region_min, region_max))
+		{
+			double span = 1;
+			bool indexed = true; 		// (bounds too far out for a tile index just mean scanning the index instead)
+			for(int a=0; a<3 && indexed; a++)
+			{
+				indexed = tileIndex(region_min[a], first[a]) && tileIndex(region_max[a], last[a]);
+				span *= double(last[a]) - first[a] + 1;
+			}
+			enumerate = indexed && span < tiles_.size();
+		}
+		if(enumerate)
+		{
+			for(int32_t ix=first[0]; ix<=last[0]; ix++)
+				for(int32_t iy=first[1]; iy<=last[1]; iy++)
+					for(int32_t iz=first[2]; iz<=last[2]; iz++)
+					{
+						std::unordered_map<uint64_t, PainterTileEntry>::const_iterator tile = tiles_.find(tileKey(ix, iy, iz));
+						if(tile != tiles_.end())
+							candidates.push_back(&tile->second);
+					}
+		}
+		else
+			for(std::unordered_map<uint64_t, PainterTileEntry>::const_iterator tile = tiles_.begin(); tile != tiles_.end(); tile++)
+				candidates.push_back(&tile->second);
+
+		int tiles_read = 0;
+		std::unordered_set<uint64_t> occupied;
+		for(size_t c=0; c<candidates.size(); c++)
+		{
+			const PainterTileEntry &tile = *candidates[c];
+			if(tile.point_count == 0 || tile.stamp_max < stamp_min || tile.stamp_min > stamp_max || !region.intersectsBox(tile.min, tile.max))
+				continue;
+			PainterMappedFile file;
+			if(!file.openRead(tilePath(tile)) || file.size() < tile.point_count*sizeof(PainterStoredPoint))
+				continue;
+			tiles_read++;
+			const PainterStoredPoint *records = reinterpret_cast<const PainterStoredPoint*>(file.data()); 	// mappings are page aligned
+			for(uint64_t i=0; i<tile.point_count; i++)
+			{
+				const PainterStoredPoint &point = records[i];
+				if(point.stamp < stamp_min || point.stamp > stamp_max || !region.containsPoint(point.x, point.y, point.z))
+					continue;
+				if(voxel_size > 0 && !occupied.insert(voxelKey(point, voxel_size)).second)
+					continue;
+				points.push_back(point);
+			}
+		}
+		return tiles_read;
+	}
+
+private:
+	std::string directory_;
+	float tile_size_;
+	uint64_t point_count_;
+	std::unordered_map<uint64_t, PainterTileEntry> tiles_;
+
+	// False for a non-finite coordinate, or one outside the 21 bit signed index range of tileKey
+	bool tileIndex(float coordinate, int32_t &index) const
+	{
+		double scaled = std::floor(double(coordinate) / tile_size_);
+		if(!std::isfinite(scaled) || scaled < -double(1 << 20) || scaled >= double(1 << 20))
+			return false;
+		index = int32_t(scaled);
+		return true;
+	}
+
+	static uint64_t tileKey(int32_t ix, int32_t iy, int32_t iz)
+	{
+		return (uint64_t(uint32_t(ix) & 0x1FFFFF) << 42) | (uint64_t(uint32_t(iy) & 0x1FFFFF) << 21) | uint64_t(uint32_t(iz) & 0x1FFFFF);
+	}
+
+	// 21 bits per signed axis index, as the voxel map's keys
+	static uint64_t voxelKey(const PainterStoredPoint &point, float voxel_size)
+	{
+		int64_t ix = int64_t(std::floor(point.x / voxel_size)) + (1 << 20);
+		int64_t iy = int64_t(std::floor(point.y / voxel_size)) + (1 << 20);
+		int64_t iz = int64_t(std::floor(point.z / voxel_size)) + (1 << 20);
+		return (uint64_t(ix & 0x1FFFFF) << 42) | (uint64_t(iy & 0x1FFFFF) << 21) | uint64_t(iz & 0x1FFFFF);
+	}
+
+	std::string tilePath(const PainterTileEntry &tile) const
+	{
+		std::ostringstream path;
+		path << directory_ << "/tile_" << tile.ix << "_" << tile.iy << "_" << tile.iz << ".pts";
+		return path.str();
+	}
+
+	static bool writeAll(int fd, const void *data, size_t size, off_t offset)
+	{
+		const char *bytes = static_cast<const char*>(data);
+		while(size > 0)
+		{
+			ssize_t written = pwrite(fd, bytes, size, offset);
+			if(written <= 0)
+				return false;
+			bytes += written;
+			size -= written;
+			offset += written;
+		}
+		return true;
+	}
+
+	// Cuts a tile file back to the records tile indexes, dropping any appended past them
+	bool truncateTile(const PainterTileEntry &tile) const
+	{
+		return truncate(tilePath(tile).c_str(), off_t(tile.point_count*sizeof(PainterStoredPoint))) == 0;
+	}
+
+	// Written to a temporary file and renamed over the old index, so a reader never sees it half written
+	bool writeIndex() const
+	{
+		PainterTileIndexHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "PPMAPIDX", 8);
+		header.version = PAINTER_MAP_STORE_VERSION;
+		header.tile_size = tile_size_;
+		header.tile_count = tiles_.size();
+		std::vector<char> index(sizeof(header) + tiles_.size()*sizeof(PainterTileEntry));
+		memcpy(index.data(), &header, sizeof(header));
+		size_t offset = sizeof(header);
+		for(std::unordered_map<uint64_t, PainterTileEntry>::const_iterator tile = tiles_.begin(); tile != tiles_.end(); tile++)
+		{
+			memcpy(index.data() + offset, &tile->second, sizeof(PainterTileEntry));
+			offset += sizeof(PainterTileEntry);
+		}
+
+		std::string temporary_path = directory_ + "/index.bin.tmp";
+		int fd = ::open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			return false;
+		bool written = writeAll(fd, index.data(), index.size(), 0) && fsync(fd) == 0;
+		::close(fd);
+		return written && rename(temporary_path.c_str(), (directory_ + "/index.bin").c_str()) == 0;
+	}
+};
+
+#endif // POINTCLOUD_PAINTER_MAP_STORE_H
@@ -0,0 +1,447 @@
+
+#ifndef POINTCLOUD_PAINTER_MAPPED_IO_H
+#define POINTCLOUD_PAINTER_MAPPED_IO_H
+
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/CompressedImage.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Paths with this prefix name a POSIX shared memory segment (shm_open name) rather than a file
+#define PAINTER_SHM_PREFIX "shm:"
+
+/* PainterMappedFile - a file or POSIX shared memory segment mapped into memory
+ 	Paths starting with "shm:" are opened with shm_open (e.g. "shm:/painter_cloud"), anything else as a file.
+ 	Inputs are mapped read-only, so their pages come straight from the page cache (or the segment) without a
+ 	read() copy; outputs are created at their final size and written through the mapping.
+*/
+class PainterMappedFile
+{
+public:
+	PainterMappedFile() : data_(NULL), size_(0) {}
+	~PainterMappedFile() { close(); }
+
+	bool openRead(const std::string &path)
+	{
+		close();
+		int fd = openDescriptor(path, O_RDONLY, 0);
+		if(fd < 0)
+			return false;
+		struct stat file_stat;
+		if(fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0)
+		{
+			::close(fd);
+			return false;
+		}
+		void *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(mapping == MAP_FAILED)
+			return false;
+		data_ = static_cast<uint8_t*>(mapping);
+		size_ = file_stat.st_size;
+		madvise(data_, size_, MADV_SEQUENTIAL);
+		return true;
+	}
+
+	// Creates (or truncates) path at exactly size bytes, mapped read-write
+	bool create(const std::string &path, size_t size)
+	{
+		close();
+		int fd = openDescriptor(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			return false;
+		if(size == 0 || ftruncate(fd, size) != 0)
+		{
+			::close(fd);
+			return false;
+		}
+		void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(mapping == MAP_FAILED)
+			return false;
+		data_ = static_cast<uint8_t*>(mapping);
+		size_ = size;
+		return true;
+	}
+
+	void close()
+	{
+		if(data_ != NULL)
+			munmap(data_, size_);
+		data_ = NULL;
+		size_ = 0;
+	}
+
+	const uint8_t *data() const { return data_; }
+	uint8_t *data() { return data_; }
+	size_t size() const { return size_; }
+
+	static bool isSharedMemory(const std::string &path) { return path.compare(0, strlen(PAINTER_SHM_PREFIX), PAINTER_SHM_PREFIX) == 0; }
+
+private:
+	uint8_t *data_;
+	size_t size_;
+
+	PainterMappedFile(const PainterMappedFile &);
+	PainterMappedFile &operator=(const PainterMappedFile &);
+
+	static int openDescriptor(const std::string &path, int flags, mode_t mode)
+	{
+		if(isSharedMemory(path))
+			return shm_open(path.c_str() + strlen(PAINTER_SHM_PREFIX), flags, mode);
+		return open(path.c_str(), flags, mode);
+	}
+};
+
+// PointField datatype for a PCD TYPE/SIZE pair or a PLY property type, 0 if unsupported
+inline int painterPointFieldType(char type, int size)
+{
+	switch(type)
+	{
+		case 'F': return (size == 4) ? sensor_msgs::PointField::FLOAT32 : (size == 8) ? sensor_msgs::PointField::FLOAT64 : 0;
+		case 'I': return (size == 1) ? sensor_msgs::PointField::INT8 : (size == 2) ? sensor_msgs::PointField::INT16 : (size == 4) ? sensor_msgs::PointField::INT32 : 0;
+		case 'U': return (size == 1) ? sensor_msgs::PointField::UINT8 : (size == 2) ? sensor_msgs::PointField::UINT16 : (size == 4) ? sensor_msgs::PointField::UINT32 : 0;
+	}
+	return 0;
+}
+
+inline int painterPointFieldSize(int datatype)
+{
+	switch(datatype)
+	{
+		case sensor_msgs::PointField::INT8: case sensor_msgs::PointField::UINT8: return 1;
+		case sensor_msgs::PointField::INT16: case sensor_msgs::PointField::UINT16: return 2;
+		case sensor_msgs::PointField::INT32: case sensor_msgs::PointField::UINT32: case sensor_msgs::PointField::FLOAT32: return 4;
+		case sensor_msgs::PointField::FLOAT64: return 8;
+	}
+	return 0;
+}
+
+inline char painterPointFieldTypeChar(int datatype)
+{
+	switch(datatype)
+	{
+		case sensor_msgs::PointField::INT8: case sensor_msgs::PointField::INT16: case sensor_msgs::PointField::INT32: return 'I';
+		case sensor_msgs::PointField::UINT8: case sensor_msgs::PointField::UINT16: case sensor_msgs::PointField::UINT32: return 'U';
+	}
+	return 'F';
+}
+
+// Reads the text header at the start of a mapped file, up to and including the line starting with last_keyword
+//   header_size returns where the binary data begins
+inline bool painterReadHeader(const PainterMappedFile &file, const std::string &last_keyword, std::vector<std::string> &lines, size_t &header_size)
+{
+	lines.clear();
+	const char *text = reinterpret_cast<const char*>(file.data());
+	size_t line_start = 0;
+	while(line_start < file.size())
+	{
+		const char *line_end = static_cast<const char*>(memchr(text + line_start, '\n', file.size() - line_start));
+		if(line_end == NULL)
+			return false;
+		std::string line(text + line_start, line_end);
+		if(!line.empty() && line[line.size()-1] == '\r')
+			line.erase(line.size()-1);
+		line_start = (line_end - text) + 1;
+		lines.push_back(line);
+		if(line.compare(0, last_keyword.size(), last_keyword) == 0)
+		{
+			header_size = line_start;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* painterParsePCD - fills the layout of cloud from a binary PCD header (fields, dimensions), without its data
+ 	Only "DATA binary" is handled here; ascii and binary_compressed files have no fixed layout to map.
+*/
+inline bool painterParsePCD(const std::vector<std::string> &lines, sensor_msgs::PointCloud2 &cloud)
+{
+	std::vector<std::string> names;
+	std::vector<int> sizes, counts;
+	std::vector<char> types;
+	std::string data_format;
+	cloud.width = cloud.height = 0;
+	for(size_t l=0; l<lines.size(); l++)
+	{
+		std::istringstream line(lines[l]);
+		std::string keyword, token;
+		line >> keyword;
+		if(keyword == "FIELDS")
+			while(line >> token) names.push_back(token);
+		else if(keyword == "SIZE")
+			while(line >> token) sizes.push_back(atoi(token.c_str()));
+		else if(keyword == "TYPE")
+			while(line >> token) types.push_back(token[0]);
+		else if(keyword == "COUNT")
+			while(line >> token) counts.push_back(atoi(token.c_str()));
+		else if(keyword == "WIDTH")
+			line >> cloud.width;
+		else if(keyword == "HEIGHT")
+			line >> cloud.height;
+		else if(keyword == "DATA")
+			line >> data_format;
+	}
+	if(data_format != "binary" || names.empty() || sizes.size() != names.size() || types.size() != names.size())
+		return false;
+	counts.resize(names.size(), 1);
+
+	cloud.fields.clear();
+	uint32_t offset = 0;
+	for(size_t f=0; f<names.size(); f++)
+	{
+		sensor_msgs::PointField field;
+		field.name = names[f];
+		field.offset = offset;
+		field.datatype = painterPointFieldType(types[f], sizes[f]);
+		field.count = counts[f];
+		if(field.datatype == 0)
+			return false;
+		offset += sizes[f] * counts[f];
+		// "_" marks padding - it occupies space in each point but isn't a field
+		if(field.name != "_")
+			cloud.fields.push_back(field);
+	}
+	cloud.point_step = offset;
+	return true;
+}
+
+/* painterParsePLY - fills the layout of cloud from a binary little-endian PLY header, without its data
+ 	The vertices must be the first element, with only scalar properties; any elements after them are ignored.
+*/
+inline bool painterParsePLY(const std::vector<std::string> &lines, sensor_msgs::PointCloud2 &cloud)
+{
+	if(lines.empty() || lines[0] != "ply")
+		return false;
+	bool little_endian = false;
+	bool in_vertices = false;
+	bool seen_element = false;
+	uint32_t vertex_count = 0;
+	uint32_t offset = 0;
+	cloud.fields.clear();
+	for(size_t l=1; l<lines.size(); l++)
+	{
+		std::istringstream line(lines[l]);
+		std::string keyword;
+		line >> keyword;
+		if(keyword == "format")
+		{
+			std::string format;
+			line >> format;
+			little_endian = (format == "binary_little_endian");
+		}
+		else if(keyword == "element")
+		{
+			std::string element;
+			line >> element;
+			in_vertices = (!seen_element && element == "vertex");
+			if(in_vertices)
+				line >> vertex_count;
+			seen_element = true;
+		}
+		else if(keyword == "property" && in_vertices)
+		{
+			std::string type, name;
+			line >> type >> name;
+			int datatype = 0;
+			if(type == "char" || type == "int8") 			datatype = sensor_msgs::PointField::INT8;
+			else if(type == "uchar" || type == "uint8") 	datatype = sensor_msgs::PointField::UINT8;
+			else if(type == "short" || type == "int16") 	datatype = sensor_msgs::PointField::INT16;
+			else if(type == "ushort" || type == "uint16") 	datatype = sensor_msgs::PointField::UINT16;
+			else if(type == "int" || type == "int32") 		datatype = sensor_msgs::PointField::INT32;
+			else if(type == "uint" || type == "uint32") 	datatype = sensor_msgs::PointField::UINT32;
+			else if(type == "float" || type == "float32") 	datatype = sensor_msgs::PointField::FLOAT32;
+			else if(type == "double" || type == "float64") 	datatype = sensor_msgs::PointField::FLOAT64;
+			else
+				return false; 								// list properties have no fixed size
+			sensor_msgs::PointField field;
+			field.name = name;
+			field.offset = offset;
+			field.datatype = datatype;
+			field.count = 1;
+			cloud.fields.push_back(field);
+			offset += painterPointFieldSize(datatype);
+		}
+	}
+	if(!little_endian || cloud.fields.empty())
+		return false;
+	cloud.width = vertex_count;
+	cloud.height = 1;
+	cloud.point_step = offset;
+	return true;
+}
+
+/* painterMapCloud - maps a binary PCD or PLY cloud from a file or shared memory segment, without copying its points
+ 	cloud is given the layout (fields, size, steps) but no data; points returns where the points start within file,
+ 	which must be kept open while they are read. The header of cloud (frame, stamp) is left as it was, since neither
+ 	format carries one.
+*/
+inline bool painterMapCloud(const std::string &path, PainterMappedFile &file, sensor_msgs::PointCloud2 &cloud, const uint8_t *&points)
+{
+	if(!file.openRead(path))
+		return false;
+	std::vector<std::string> lines;
+	size_t header_size = 0;
+	bool parsed = false;
+	if(file.size() >= 3 && memcmp(file.data(), "ply", 3) == 0)
+		parsed = painterReadHeader(file, "end_header", lines, header_size) && painterParsePLY(lines, cloud);
+	else
+		parsed = painterReadHeader(file, "DATA", lines, header_size) && painterParsePCD(lines, cloud);
+	if(!parsed)
+		return false;
+
+	size_t data_size = size_t(cloud.width) * cloud.height * cloud.point_step;
+	if(header_size + data_size > file.size())
+		return false;
+	cloud.is_bigendian = false;
+	cloud.is_dense = false;
+	cloud.row_step = cloud.width * cloud.point_step;
+	cloud.data.clear();
+	points = file.data() + header_size;
+	return true;
+}
+
+/* painterReadCloud - loads a binary PCD or PLY cloud from a file or shared memory segment into cloud
+ 	As painterMapCloud, with the points then copied once, straight into the message buffer - for when the cloud has 
+ 	to outlive the mapping (e.g. to be sent on).
+*/
+inline bool painterReadCloud(const std::string &path, sensor_msgs::PointCloud2 &cloud)
+{
+	PainterMappedFile file;
+	const uint8_t *points = NULL;
+	if(!painterMapCloud(path, file, cloud, points))
+		return false;
+	cloud.data.assign(points, points + size_t(cloud.row_step) * cloud.height);
+	return true;
+}
+
+/* painterWriteCloud - writes cloud to a file or shared memory segment as a binary PCD
+ 	The output is created at its final size and the points are copied into it through the mapping. Gaps between
+ 	fields (e.g. the padding after xyz in PointXYZRGB) are written as "_" padding fields, as PCL does.
+ 	The points are read from data where given (rows of cloud.row_step bytes) - so they can be written straight from
+ 	wherever they are held, with cloud only giving their layout - or otherwise from cloud.data.
+*/
+inline bool painterWriteCloud(const std::string &path, const sensor_msgs::PointCloud2 &cloud, const uint8_t *data = NULL)
+{
+	if(data == NULL && cloud.data.size() > 0)
+		data = &cloud.data[0];
+	std::vector<sensor_msgs::PointField> fields(cloud.fields);
+	std::sort(fields.begin(), fields.end(), [](const sensor_msgs::PointField &a, const sensor_msgs::PointField &b) { return a.offset < b.offset; });
+
+	std::ostringstream names, sizes, types, counts;
+	uint32_t offset = 0;
+	for(size_t f=0; f<=fields.size(); f++)
+	{
+		uint32_t field_start = (f < fields.size()) ? fields[f].offset : cloud.point_step;
+		if(field_start > offset)
+		{
+			names << " _";
+			sizes << " 1";
+			types << " U";
+			counts << " " << (field_start - offset);
+		}
+		if(f == fields.size())
+			break;
+		int size = painterPointFieldSize(fields[f].datatype);
+		names << " " << fields[f].name;
+		sizes << " " << size;
+		types << " " << painterPointFieldTypeChar(fields[f].datatype);
+		counts << " " << fields[f].count;
+		offset = field_start + size * fields[f].count;
+	}
+
+	size_t point_count = size_t(cloud.width) * cloud.height;
+	std::ostringstream header;
+	header << "# .PCD v0.7 - Point Cloud Data file format\n"
+		<< "VERSION 0.7\n"
+		<< "FIELDS" << names.str() << "\n"
+		<< "SIZE" << sizes.str() << "\n"
+		<< "TYPE" << types.str() << "\n"
+		<< "COUNT" << counts.str() << "\n"
+		<< "WIDTH " << cloud.width << "\n"
+		<< "HEIGHT " << cloud.height << "\n"
+		<< "VIEWPOINT 0 0 0 1 0 0 0\n"
+		<< "POINTS " << point_count << "\n"
+		<< "DATA binary\n";
+	std::string header_text = header.str();
+
+	PainterMappedFile file;
+	if(!file.create(path, header_text.size() + point_count * cloud.point_step))
+		return false;
+	memcpy(file.data(), header_text.data(), header_text.size());
+	uint8_t *out = file.data() + header_text.size();
+	size_t row_size = size_t(cloud.width) * cloud.point_step;
+	for(uint32_t row=0; row<cloud.height && row_size > 0; row++)
+		memcpy(out + row * row_size, data + row * cloud.row_step, row_size);
+	return true;
+}
+
+// Read the size of an encoded image (PNG, or baseline / progressive JPEG) from its header, without decoding it
+//   (as stored - an EXIF orientation is not applied); false if the format isn't recognized
+inline bool painterEncodedImageSize(const std::vector<uint8_t> &data, int &rows, int &cols)
+{
+	// PNG - the IHDR chunk, holding the size, always comes first after the 8 byte signature
+	static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	if(data.size() >= 24 && std::equal(png_signature, png_signature+8, data.begin()) && std::equal(data.begin()+12, data.begin()+16, "IHDR"))
+	{
+		cols = (data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+		rows = (data[20] << 24) | (data[21] << 16) | (data[22] << 8) | data[23];
+		return rows > 0 && cols > 0;
+	}
+	// JPEG - walk the marker segments to the first start-of-frame (SOF0..SOF15, other than DHT / JPG / DAC)
+	if(data.size() < 4 || data[0] != 0xFF || data[1] != 0xD8)
+		return false;
+	size_t pos = 2;
+	while(pos + 4 <= data.size())
+	{
+		if(data[pos] != 0xFF)
+			return false;
+		uint8_t marker = data[pos+1];
+		if(marker == 0xFF) 										// fill byte
+			pos++;
+		else if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) 	// markers without a segment
+			pos += 2;
+		else if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+		{
+			if(pos + 9 > data.size())
+				return false;
+			rows = (data[pos+5] << 8) | data[pos+6];
+			cols = (data[pos+7] << 8) | data[pos+8];
+			return rows > 0 && cols > 0; 		// (a height of 0 is only given later, in a DNL segment)
+		}
+		else if(marker == 0xDA || marker == 0xD9) 				// scan data or end of image, with no frame header
+			return false;
+		else
+			pos += 2 + ((data[pos+2] << 8) | data[pos+3]);
+	}
+	return false;
+}
+
+/* painterReadImage - loads an encoded image (jpeg, png, ...) from a file or shared memory segment
+ 	The bytes are kept encoded, so that they go through the same reduced-resolution decode as compressed_image_list.
+*/
+inline bool painterReadImage(const std::string &path, sensor_msgs::CompressedImage &image)
+{
+	PainterMappedFile file;
+	if(!file.openRead(path))
+		return false;
+	image.data.assign(file.data(), file.data() + file.size());
+	// The decoder identifies the format from the data itself - this is just informational
+	size_t extension = path.find_last_of('.');
+	image.format = (extension == std::string::npos || PainterMappedFile::isSharedMemory(path)) ? "" : path.substr(extension+1);
+	if(image.format == "jpg")
+		image.format = "jpeg";
+	return true;
+}
+
+#endif // POINTCLOUD_PAINTER_MAPPED_IO_H
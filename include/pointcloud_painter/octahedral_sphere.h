@@ -0,0 +1,378 @@
+
+#ifndef POINTCLOUD_PAINTER_OCTAHEDRAL_SPHERE_H
+#define POINTCLOUD_PAINTER_OCTAHEDRAL_SPHERE_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+/* Compact Spherical Clouds
+ 	The painters only ever need a direction on the unit sphere plus one payload (a color, or a range) per point.
+ 	Directions are stored octahedral-encoded in 2x16 bits: the sphere is mapped onto the octahedron |x|+|y|+|z| = 1,
+ 	whose lower half is folded out over the corners of the square [-1,1]^2. Each point is then 8 bytes, against
+ 	16-32 for the padded float PCL types, and the quantization error is about 3e-5 rad.
+ 	PainterSphereIndex sorts these points into a uniform grid over the octahedral square, so neighbor queries walk
+ 	the encoded points directly (decoding candidates on the fly) without a separate float copy or tree.
+*/
+
+// A color point on the unit sphere
+struct PainterSphereColor
+{
+	uint16_t u, v; 			// Octahedral-encoded direction
+	uint8_t r, g, b, a;
+};
+
+// A depth point on the unit sphere
+struct PainterSphereDepth
+{
+	uint16_t u, v; 			// Octahedral-encoded direction
+	float range; 			// Distance from the sphere's origin to the original point
+};
+
+// Unit (or any nonzero) vector -> octahedral square coordinates, each in [-1,1]
+//   (single precision throughout, so that painterFusedDepthKernel's SIMD encoding can match it exactly)
+inline void painterOctProject(float x, float y, float z, float &px, float &py)
+{
+	float l1 = std::fabs(x) + std::fabs(y) + std::fabs(z);
+	if(l1 <= 0)
+	{
+		px = 0; 	py = 0;
+		return;
+	}
+	px = x/l1;
+	py = y/l1;
+	// Lower hemisphere is folded over the corners of the square
+	if(z < 0)
+	{
+		float fx = (1 - std::fabs(py)) * (px >= 0 ? 1.0f : -1.0f);
+		float fy = (1 - std::fabs(px)) * (py >= 0 ? 1.0f : -1.0f);
+		px = fx;
+		py = fy;
+	}
+}
+inline uint16_t painterOctQuantize(float p)
+{
+	float q = (p*0.5f + 0.5f) * 65535.0f + 0.5f;
+	return uint16_t( std::max(0.0f, std::min(65535.0f, q)) );
+}
+inline void painterOctEncode(float x, float y, float z, uint16_t &u, uint16_t &v)
+{
+	float px, py;
+	painterOctProject(x, y, z, px, py);
+	u = painterOctQuantize(px);
+	v = painterOctQuantize(py);
+}
+// Octahedral-encoded direction -> unit vector
+inline void painterOctDecode(uint16_t u, uint16_t v, float &x, float &y, float &z)
+{
+	float px = u * (2.0f/65535.0f) - 1;
+	float py = v * (2.0f/65535.0f) - 1;
+	z = 1 - fabs(px) - fabs(py);
+	if(z < 0)
+	{
+		float fx = (1 - fabs(py)) * (px >= 0 ? 1 : -1);
+		float fy = (1 - fabs(px)) * (py >= 0 ? 1 : -1);
+		px = fx;
+		py = fy;
+	}
+	float norm = 1.0f / sqrt(px*px + py*py + z*z);
+	x = px * norm;
+	y = py * norm;
+	z *= norm;
+}
+
+// Interleave two 16-bit coordinates into a 32-bit Morton (Z-order) key
+inline uint32_t painterMortonEncode2D(uint16_t u, uint16_t v)
+{
+	uint32_t x = u, y = v;
+	x = (x | (x << 8)) & 0x00FF00FF; 	y = (y | (y << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F; 	y = (y | (y << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333; 	y = (y | (y << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555; 	y = (y | (y << 1)) & 0x55555555;
+	return x | (y << 1);
+}
+
+// Stable LSD radix sort of 64-bit entries on their high 32 bits (four 8-bit passes)
+inline void painterRadixSortHigh32(std::vector<uint64_t> &entries)
+{
+	std::vector<uint64_t> scratch(entries.size());
+	for(int shift=32; shift<64; shift+=8)
+	{
+		size_t counts[257] = {0};
+		for(size_t i=0; i<entries.size(); i++)
+			counts[((entries[i] >> shift) & 0xFF) + 1]++;
+		for(int b=0; b<256; b++)
+			counts[b+1] += counts[b];
+		for(size_t i=0; i<entries.size(); i++)
+			scratch[counts[(entries[i] >> shift) & 0xFF]++] = entries[i];
+		entries.swap(scratch);
+	}
+}
+
+/* painterSphereMortonOrder - visiting order for a set of query points, along a Morton curve over the sphere
+ 	Each point's direction is octahedral-encoded and the (u, v) bits interleaved, so points which follow each other
+ 	in order are close on the sphere, and consecutive neighbor searches touch the same few grid cells. Works for any
+ 	vector of points with x, y, z members; order[n] is the index of the n-th point to visit.
+*/
+template<typename PointVector>
+void painterSphereMortonOrder(const PointVector &points, std::vector<uint32_t> &order)
+{
+	std::vector<uint64_t> entries(points.size());
+	for(size_t i=0; i<points.size(); i++)
+	{
+		uint16_t u, v;
+		painterOctEncode(points[i].x, points[i].y, points[i].z, u, v);
+		entries[i] = (uint64_t(painterMortonEncode2D(u, v)) << 32) | uint64_t(i);
+	}
+	painterRadixSortHigh32(entries);
+	order.resize(points.size());
+	for(size_t n=0; n<entries.size(); n++)
+		order[n] = uint32_t(entries[n]);
+}
+
+/* PainterSphereIndex - k nearest neighbor search over octahedral-encoded points
+ 	Points are bucketed (counting sort) into a grid_size x grid_size grid over the octahedral square. A query walks
+ 	rings of cells outward from its own cell, wrapping across the square's edges (where the folded lower hemisphere
+ 	meets itself mirrored), until no unvisited cell can hold a closer point. The octahedral map stretches distances
+ 	by at most sqrt(3), which gives that bound. Distances are squared chord distances between unit vectors, as a
+ 	kd-tree over the projected unit sphere would report.
+ 	The search can be made approximate (setApproximation): with epsilon > 0 it stops once no unvisited cell can hold a
+ 	point more than (1+epsilon) times closer than the current kth neighbor, and with max_checks > 0 it stops after the
+ 	first ring which brings the points examined to max_checks (once it has k). Painting only blends the neighbors,
+ 	so slightly-wrong ones barely change the result.
+ 	A query can also be limited to a maximum distance. Then only points within it are returned, and the walk stops at
+ 	the first ring which can't hold one, even without k points. Painting discards far neighbors anyway, so a query
+ 	with nothing indexed nearby (outside the cameras' coverage) costs a few rings rather than a walk over every cell;
+ 	per-row and per-column running counts let each side of a ring with no points in it be skipped without visiting
+ 	its cells, so even those rings cost almost nothing.
+ 	Queries reuse internal scratch space, so one index must not be searched from several threads at once.
+*/
+template<typename PointT>
+class PainterSphereIndex
+{
+public:
+	std::vector<PointT> points; 		// Fill, then build() - afterwards ordered by grid cell
+
+	PainterSphereIndex() : grid_size_(1), stamp_(0), epsilon_(0), max_checks_(0), checks_(0), max_sqr_distance_(0) {}
+
+	void clear() { points.clear(); }
+
+	// epsilon <= 0 and max_checks <= 0 -> exact search
+	void setApproximation(float epsilon, int max_checks)
+	{
+		epsilon_ = std::max(epsilon, 0.0f);
+		max_checks_ = std::max(max_checks, 0);
+	}
+	float epsilon() const { return epsilon_; }
+	int maxChecks() const { return max_checks_; }
+
+	// Sort points into the grid - roughly points_per_cell points land in each cell
+	void build(int points_per_cell = 2)
+	{
+		grid_size_ = int( sqrt( double(points.size()) / std::max(points_per_cell, 1) ) );
+		grid_size_ = std::max(1, std::min(grid_size_, 4096));
+		size_t cell_count = size_t(grid_size_) * grid_size_;
+		cell_start_.assign(cell_count + 1, 0);
+		for(size_t i=0; i<points.size(); i++)
+			cell_start_[cellOf(points[i]) + 1]++;
+		for(size_t c=0; c<cell_count; c++)
+			cell_start_[c+1] += cell_start_[c];
+		// The same counts in column-major order, for counting the points along a column of cells
+		column_start_.assign(cell_count + 1, 0);
+		for(int j=0; j<grid_size_; j++)
+			for(int i=0; i<grid_size_; i++)
+			{
+				size_t cell = size_t(i)*grid_size_ + j;
+				column_start_[size_t(j)*grid_size_ + i + 1] = column_start_[size_t(j)*grid_size_ + i] + cell_start_[cell+1] - cell_start_[cell];
+			}
+		sorted_.resize(points.size());
+		std::vector<uint32_t> cell_fill(cell_start_.begin(), cell_start_.end() - 1);
+		for(size_t i=0; i<points.size(); i++)
+			sorted_[cell_fill[cellOf(points[i])]++] = points[i];
+		points.swap(sorted_);
+		sorted_.clear();
+		cell_stamp_.assign(cell_count, 0);
+		stamp_ = 0;
+	}
+
+	// Find the k nearest points to direction (x, y, z) - indices into points, sorted nearest first
+	//   Only points within max_sqr_distance (squared chord distance; <= 0 -> unlimited) are returned
+	//   Returns the number found (k, unless the index holds fewer points within reach)
+	int nearestKSearch(float x, float y, float z, int k, std::vector<int> &indices, std::vector<float> &sqr_distances, float max_sqr_distance = 0)
+	{
+		indices.clear();
+		sqr_distances.clear();
+		if(points.size() == 0 || k <= 0)
+			return 0;
+		float norm = sqrt(x*x + y*y + z*z);
+		if(!(norm > 0)) 			// zero-length or NaN
+			return 0;
+		x /= norm; 	y /= norm; 	z /= norm;
+		if(++stamp_ == 0)
+		{
+			std::fill(cell_stamp_.begin(), cell_stamp_.end(), 0);
+			stamp_ = 1;
+		}
+
+		float px, py;
+		painterOctProject(x, y, z, px, py);
+		int ci = std::min(int((px*0.5f + 0.5f) * grid_size_), grid_size_-1);
+		int cj = std::min(int((py*0.5f + 0.5f) * grid_size_), grid_size_-1);
+		float cell_width = 2.0f / grid_size_;
+
+		// Max-heap of the best k so far (squared distance, index)
+		heap_.clear();
+		checks_ = 0;
+		max_sqr_distance_ = (max_sqr_distance > 0) ? max_sqr_distance : std::numeric_limits<float>::max();
+		float stop_scale = (1 + epsilon_) * (1 + epsilon_);
+		for(int ring=0; ring<=grid_size_; ring++)
+		{
+			if(int(heap_.size()) == k && max_checks_ > 0 && checks_ >= max_checks_)
+				break;
+			// Any point in this ring or beyond is at least (ring-1) cells away in the map, so at least this far on the sphere
+			if(ring > 1)
+			{
+				float angle = std::min(float((ring-1) * cell_width / sqrt(3.0)), float(M_PI));
+				float chord = 2*sin(angle/2);
+				if(chord*chord > max_sqr_distance_)
+					break;
+				if(int(heap_.size()) == k && heap_.front().first <= stop_scale*chord*chord)
+					break;
+			}
+			if(ring == 0)
+				searchCell(ci, cj, x, y, z, k);
+			else
+			{
+				// Sides without any points are skipped whole
+				if(columnCount(cj-ring, ci-ring, ci+ring) > 0)
+					for(int d=-ring; d<=ring; d++)
+						searchCell(ci+d, cj-ring, x, y, z, k);
+				if(columnCount(cj+ring, ci-ring, ci+ring) > 0)
+					for(int d=-ring; d<=ring; d++)
+						searchCell(ci+d, cj+ring, x, y, z, k);
+				if(rowCount(ci-ring, cj-ring+1, cj+ring-1) > 0)
+					for(int d=-ring+1; d<ring; d++)
+						searchCell(ci-ring, cj+d, x, y, z, k);
+				if(rowCount(ci+ring, cj-ring+1, cj+ring-1) > 0)
+					for(int d=-ring+1; d<ring; d++)
+						searchCell(ci+ring, cj+d, x, y, z, k);
+			}
+		}
+
+		std::sort_heap(heap_.begin(), heap_.end());
+		for(size_t n=0; n<heap_.size(); n++)
+		{
+			indices.push_back(heap_[n].second);
+			sqr_distances.push_back(heap_[n].first);
+		}
+		return indices.size();
+	}
+
+	// Give back memory (all of it, if free_memory; otherwise just scratch space well beyond what the points need)
+	void release(bool free_memory)
+	{
+		if(free_memory)
+		{
+			std::vector<PointT>().swap(points);
+			std::vector<uint32_t>().swap(cell_start_);
+			std::vector<uint32_t>().swap(column_start_);
+			std::vector<uint32_t>().swap(cell_stamp_);
+		}
+		std::vector<PointT>().swap(sorted_);
+	}
+	size_t bytes() const { return points.capacity()*sizeof(PointT) + (cell_start_.capacity() + column_start_.capacity() + cell_stamp_.capacity())*sizeof(uint32_t); }
+
+private:
+	int grid_size_;
+	std::vector<uint32_t> cell_start_; 		// points[cell_start_[c] .. cell_start_[c+1]) lie in cell c
+	std::vector<uint32_t> column_start_; 	// Running point counts over the cells in column-major order
+	std::vector<uint32_t> cell_stamp_; 		// Query which last visited each cell (a cell can be reached twice through the wrap)
+	uint32_t stamp_;
+	std::vector<PointT> sorted_;
+	std::vector<std::pair<float, int> > heap_;
+	float epsilon_;
+	int max_checks_;
+	int checks_; 							// Points examined by the current query
+	float max_sqr_distance_; 				// Reach of the current query
+
+	inline size_t cellOf(const PointT &point) const
+	{
+		size_t i = (size_t(point.u) * grid_size_) >> 16;
+		size_t j = (size_t(point.v) * grid_size_) >> 16;
+		return i*grid_size_ + j;
+	}
+	// Wrap a cell across the edges of the octahedral square - (1+e, y) is the same direction as (1-e, -y)
+	//   false if it is still outside after wrapping
+	inline bool wrapCell(int &i, int &j) const
+	{
+		for(int wrap=0; wrap<4 && (i < 0 || i >= grid_size_ || j < 0 || j >= grid_size_); wrap++)
+		{
+			if(i < 0) 				{ i = -1 - i; 				j = grid_size_-1 - j; }
+			else if(i >= grid_size_) 	{ i = 2*grid_size_-1 - i; 	j = grid_size_-1 - j; }
+			if(j < 0) 				{ j = -1 - j; 				i = grid_size_-1 - i; }
+			else if(j >= grid_size_) 	{ j = 2*grid_size_-1 - j; 	i = grid_size_-1 - i; }
+		}
+		return i >= 0 && i < grid_size_ && j >= 0 && j < grid_size_;
+	}
+	// Points in cells (i, j0..j1) / (i0..i1, j), after wrapping - split where the run leaves the square, since each
+	//   piece wraps onto a single run of cells (at least as many points as searchCell would visit, so 0 means none)
+	uint32_t rowCount(int i, int j0, int j1) const { return lineCount(i, j0, j1, true); }
+	uint32_t columnCount(int j, int i0, int i1) const { return lineCount(j, i0, i1, false); }
+	uint32_t lineCount(int fixed, int first, int last, bool row) const
+	{
+		uint32_t count = 0;
+		int piece_bounds[4] = {first, 0, grid_size_, last+1};
+		for(int p=0; p<3; p++)
+		{
+			int start = std::max(first, p > 0 ? piece_bounds[p] : first);
+			int end = std::min(last, (p < 2 ? piece_bounds[p+1] : last+1) - 1);
+			if(start > end)
+				continue;
+			int ai = row ? fixed : start, aj = row ? start : fixed;
+			int bi = row ? fixed : end, bj = row ? end : fixed;
+			if(!wrapCell(ai, aj) || !wrapCell(bi, bj))
+				continue;
+			if(ai == bi) 			// Still a row
+				count += cell_start_[size_t(ai)*grid_size_ + std::max(aj, bj) + 1] - cell_start_[size_t(ai)*grid_size_ + std::min(aj, bj)];
+			else if(aj == bj) 		// A column
+				count += column_start_[size_t(aj)*grid_size_ + std::max(ai, bi) + 1] - column_start_[size_t(aj)*grid_size_ + std::min(ai, bi)];
+			else
+				return 1; 			// Shouldn't happen - don't skip
+		}
+		return count;
+	}
+	inline void searchCell(int i, int j, float x, float y, float z, int k)
+	{
+		if(!wrapCell(i, j))
+			return;
+		size_t cell = size_t(i)*grid_size_ + j;
+		if(cell_stamp_[cell] == stamp_)
+			return;
+		cell_stamp_[cell] = stamp_;
+		checks_ += cell_start_[cell+1] - cell_start_[cell];
+		for(uint32_t n=cell_start_[cell]; n<cell_start_[cell+1]; n++)
+		{
+			float px, py, pz;
+			painterOctDecode(points[n].u, points[n].v, px, py, pz);
+			float dist = (px-x)*(px-x) + (py-y)*(py-y) + (pz-z)*(pz-z);
+			if(dist > max_sqr_distance_)
+				continue;
+			if(int(heap_.size()) < k)
+			{
+				heap_.push_back(std::make_pair(dist, int(n)));
+				std::push_heap(heap_.begin(), heap_.end());
+			}
+			else if(dist < heap_.front().first)
+			{
+				std::pop_heap(heap_.begin(), heap_.end());
+				heap_.back() = std::make_pair(dist, int(n));
+				std::push_heap(heap_.begin(), heap_.end());
+			}
+		}
+	}
+};
+
+#endif // POINTCLOUD_PAINTER_OCTAHEDRAL_SPHERE_H
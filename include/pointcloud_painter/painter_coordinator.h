@@ -0,0 +1,46 @@
+
+#include "pointcloud_painter/pointcloud_painter.h"
+
+#include <boost/thread/thread.hpp>
+
+// Number of azimuth bins used to balance the sectors by point count
+#define PAINTER_SECTOR_BINS 3600
+// Image regions are aligned to a multiple of this many pixels (times the image's compression ratio), so that they stay
+//   aligned at any raster compression a worker may apply (and Bayer phase)
+#define PAINTER_REGION_ALIGNMENT 8
+// Fraction of a request's deadline kept back for merging the painted sectors
+#define PAINTER_MERGE_TIME_FRACTION 0.1
+
+/* PainterCoordinator - paints one scan across several pointcloud_painter worker processes
+ 	Offers the same service as a single painter. The depth cloud is split into azimuth sectors about target_frame
+ 	(balanced by point count), and each sector is sent to a worker with only the region of each image which can
+ 	see it. Workers are ordinary pointcloud_painter nodes, on this host or any other host on the same ROS master.
+ 	The painted sectors are merged back into one cloud.
+*/
+class PainterCoordinator
+{
+public:
+	PainterCoordinator();
+	bool paintSharded(pointcloud_painter::pointcloud_painter_srv::Request &req, pointcloud_painter::pointcloud_painter_srv::Response &res);
+	bool loadReferencedInputs(pointcloud_painter::pointcloud_painter_srv::Request &req);
+	bool splitIntoSectors(std::vector<pcl::PointCloud<pcl::PointXYZI>::Ptr> &sectors, std::vector<std::vector<int> > &sector_sources, pcl::PointCloud<pcl::PointXYZI>::Ptr depth_cloud, int sector_count);
+	bool findImageRegion(std::vector<int> &region, pcl::PointCloud<pcl::PointXYZI>::Ptr sector, const tf::StampedTransform &target_to_camera, int projection, const PainterLensParams &lens_params, int alignment);
+	template<typename Lens>
+	bool findImageRegionKernel(std::vector<int> &region, pcl::PointCloud<pcl::PointXYZI>::Ptr sector, const tf::StampedTransform &target_to_camera, const PainterLensParams &lens_params, int alignment);
+	bool cropImage(pointcloud_painter::pointcloud_painter_srv::Request &shard_req, pointcloud_painter::pointcloud_painter_srv::Request &req, int image, const cv::Mat &raw_image, int image_hgt, int image_wdt, const std::vector<int> &region);
+	void runWorker(int worker, std::vector<pointcloud_painter::pointcloud_painter_srv> &shards, std::vector<int> &succeeded, ros::Time dispatch_end);
+
+private:
+	ros::NodeHandle nh_;
+	tf::TransformListener camera_frame_listener_;
+
+	std::vector<std::string> worker_services_; 		// Paint services of the worker painters
+	int sector_count_; 								// Sectors per scan (0 -> one per worker)
+	int region_margin_; 							// Extra pixels kept around each image region, for the neighbor search
+	int region_samples_; 							// Max sector points projected to find each image region
+
+	// ------ Lens Model Registry ------
+	//   As in PointcloudPainter - one region finder per projection type, specialized on its lens policy
+	typedef bool (PainterCoordinator::*ImageRegionKernel)(std::vector<int> &, pcl::PointCloud<pcl::PointXYZI>::Ptr, const tf::StampedTransform &, const PainterLensParams &, int);
+	std::map<int, ImageRegionKernel> lens_kernels_;
+};
@@ -7,6 +7,8 @@
 #include <pcl_conversions/pcl_conversions.h>
 
 #include "pointcloud_painter/pointcloud_painter_srv.h"
+#include "pointcloud_painter/voxel_map_srv.h"
+#include "pointcloud_painter/map_store_srv.h"
 
 #include <image_transport/image_transport.h>
 #include <cv_bridge/cv_bridge.h>
@@ -16,6 +18,7 @@
 
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/Image.h>
+#include <sensor_msgs/CompressedImage.h>
 
 #include <rosbag/bag.h>
 #include <rosbag/view.h>
@@ -23,25 +26,258 @@
 
 #include <pcl/kdtree/kdtree_flann.h>
 #include <pcl/filters/voxel_grid.h>
+#include <pcl/common/common.h>
+#include <pcl/features/normal_3d.h>
+#include <pcl/io/pcd_io.h>
 
-#define PAINTER_PROJ_EQUA_STEREO 	1
-#define PAINTER_PROJ_POLE_STEREO 	2
-#define PAINTER_PROJ_EQUAL_AREA 	3
-#define PAINTER_PROJ_FLAT 			4
+#include <map>
+#include <fstream>
+#include <unordered_map>
+
+#include "pointcloud_painter/lens_models.h"
+#include "pointcloud_painter/octahedral_sphere.h"
+#include "pointcloud_painter/task_graph.h"
+#include "pointcloud_painter/mapped_io.h"
+#include "pointcloud_painter/depth_kernel.h"
+#include "pointcloud_painter/region_of_interest.h"
+#include "pointcloud_painter/map_store.h"
+
+// Reach of the painters' neighbor searches, as squared chord distances on the unit sphere - a query point whose nearest
+//   neighbor is further than this is left unpainted, so searches never look beyond it
+#define PAINTER_COLOR_MAX_SQR_DISTANCE 	0.05f 			// Depth point -> color neighbors
+#define PAINTER_DEPTH_MAX_SQR_DISTANCE 	(0.02f*0.02f) 	// Color point -> depth neighbors
+
+// Painter loops check an anytime deadline every this many query points (a clock read - a few tens of microseconds of searches)
+#define PAINTER_DEADLINE_CHECK_STRIDE 	64
+
+// Pixel layouts which can be read in place from a shared (zero-copy) image buffer
+#define PAINTER_PIXEL_UNSUPPORTED 	0
+#define PAINTER_PIXEL_BGR8 			1
+#define PAINTER_PIXEL_RGB8 			2
+#define PAINTER_PIXEL_BGRA8 		3
+#define PAINTER_PIXEL_RGBA8 		4
+#define PAINTER_PIXEL_MONO8 		5
+#define PAINTER_PIXEL_BAYER_RGGB8 	6
+#define PAINTER_PIXEL_BAYER_BGGR8 	7
+#define PAINTER_PIXEL_BAYER_GBRG8 	8
+#define PAINTER_PIXEL_BAYER_GRBG8 	9
+
+// Find the PAINTER_PIXEL_* layout for a sensor_msgs image encoding
+inline int painterPixelFormat(const std::string &encoding)
+{
+	namespace enc = sensor_msgs::image_encodings;
+	if(encoding == enc::BGR8) 			return PAINTER_PIXEL_BGR8;
+	if(encoding == enc::RGB8) 			return PAINTER_PIXEL_RGB8;
+	if(encoding == enc::BGRA8) 			return PAINTER_PIXEL_BGRA8;
+	if(encoding == enc::RGBA8) 			return PAINTER_PIXEL_RGBA8;
+	if(encoding == enc::MONO8) 			return PAINTER_PIXEL_MONO8;
+	if(encoding == enc::BAYER_RGGB8) 	return PAINTER_PIXEL_BAYER_RGGB8;
+	if(encoding == enc::BAYER_BGGR8) 	return PAINTER_PIXEL_BAYER_BGGR8;
+	if(encoding == enc::BAYER_GBRG8) 	return PAINTER_PIXEL_BAYER_GBRG8;
+	if(encoding == enc::BAYER_GRBG8) 	return PAINTER_PIXEL_BAYER_GRBG8;
+	return PAINTER_PIXEL_UNSUPPORTED;
+}
+
+// Read one pixel (row i, column j) as RGB directly out of an image in any PAINTER_PIXEL_* layout
+//   Bayer mosaics are demosaiced on the fly from the 2x2 cell containing the pixel, so that only 
+//   the pixels actually used are ever converted
+inline void painterReadPixel(const cv::Mat &image, int pixel_format, int i, int j, uint8_t &r, uint8_t &g, uint8_t &b)
+{
+	const uint8_t *row = image.ptr<uint8_t>(i);
+	switch(pixel_format)
+	{
+		case PAINTER_PIXEL_BGR8: 	b = row[3*j]; 	g = row[3*j+1]; 	r = row[3*j+2]; 	return;
+		case PAINTER_PIXEL_RGB8: 	r = row[3*j]; 	g = row[3*j+1]; 	b = row[3*j+2]; 	return;
+		case PAINTER_PIXEL_BGRA8: 	b = row[4*j]; 	g = row[4*j+1]; 	r = row[4*j+2]; 	return;
+		case PAINTER_PIXEL_RGBA8: 	r = row[4*j]; 	g = row[4*j+1]; 	b = row[4*j+2]; 	return;
+		case PAINTER_PIXEL_MONO8: 	r = g = b = row[j]; 	return;
+	}
+	// ------ Bayer ------
+	// Top left corner of the 2x2 cell (clamped so odd-sized images stay in bounds)
+	int i0 = std::min(i - (i&1), image.rows-2);
+	int j0 = std::min(j - (j&1), image.cols-2);
+	const uint8_t *top = image.ptr<uint8_t>(i0) + j0;
+	const uint8_t *bot = image.ptr<uint8_t>(i0+1) + j0;
+	switch(pixel_format)
+	{
+		case PAINTER_PIXEL_BAYER_RGGB8: 	r = top[0]; 	g = (int(top[1]) + bot[0])/2; 	b = bot[1]; 	return;
+		case PAINTER_PIXEL_BAYER_BGGR8: 	b = top[0]; 	g = (int(top[1]) + bot[0])/2; 	r = bot[1]; 	return;
+		case PAINTER_PIXEL_BAYER_GBRG8: 	b = top[1]; 	g = (int(top[0]) + bot[1])/2; 	r = bot[0]; 	return;
+		case PAINTER_PIXEL_BAYER_GRBG8: 	r = top[1]; 	g = (int(top[0]) + bot[1])/2; 	b = bot[0]; 	return;
+	}
+	r = g = b = 0;
+}
+
+// Interleave the low 21 bits of three integer coordinates into a 63-bit Morton (Z-order) key
+inline uint64_t painterMortonEncode(uint32_t x, uint32_t y, uint32_t z)
+{
+	uint64_t key = 0;
+	for(int bit=0; bit<21; bit++)
+	{
+		key |= uint64_t((x >> bit) & 1) << (3*bit);
+		key |= uint64_t((y >> bit) & 1) << (3*bit + 1);
+		key |= uint64_t((z >> bit) & 1) << (3*bit + 2);
+	}
+	return key;
+}
+
+// Append a cloud of unit directions (with colors) to a color sphere, octahedral-encoded
+inline void painterAppendColorSphere(const pcl::PointCloud<pcl::PointXYZRGB> &cloud, std::vector<PainterSphereColor> &sphere)
+{
+	sphere.reserve(sphere.size() + cloud.points.size());
+	for(size_t i=0; i<cloud.points.size(); i++)
+	{
+		PainterSphereColor point;
+		painterOctEncode(cloud.points[i].x, cloud.points[i].y, cloud.points[i].z, point.u, point.v);
+		point.r = cloud.points[i].r;
+		point.g = cloud.points[i].g;
+		point.b = cloud.points[i].b;
+		point.a = 255;
+		sphere.push_back(point);
+	}
+}
+
+// A working cloud which is kept by the node between painting calls, so that large clouds are not 
+//   reallocated (and page-faulted back in) on every request
+template<typename PointT>
+struct PainterPooledCloud
+{
+	typename pcl::PointCloud<PointT>::Ptr cloud;
+	size_t high_water; 			// Recent peak size (points), decaying so one huge scan doesn't pin memory forever
+
+	PainterPooledCloud() : cloud(new pcl::PointCloud<PointT>()), high_water(0) {}
+
+	// Start of a call - empty the cloud, keeping enough capacity for the recent high-water mark
+	//   (left 0x0 like a new cloud, so clouds filled point by point are written out unorganized with their full size)
+	typename pcl::PointCloud<PointT>::Ptr acquire()
+	{
+		cloud->points.clear();
+		cloud->width = 0;
+		cloud->height = 0;
+		cloud->points.reserve(high_water);
+		return cloud;
+	}
+	// End of a call - update the high-water mark, and give back memory well beyond it (or all of it, if free_memory)
+	void release(bool free_memory)
+	{
+		high_water = std::max(cloud->points.size(), high_water - high_water/8);
+		if(free_memory || cloud->points.capacity() > 2*high_water)
+			typename pcl::PointCloud<PointT>::VectorType().swap(cloud->points);
+	}
+	// Within a call - give back the memory of a cloud which is no longer needed, counting its size toward the high-water mark
+	void discard()
+	{
+		high_water = std::max(cloud->points.size(), high_water);
+		typename pcl::PointCloud<PointT>::VectorType().swap(cloud->points);
+		cloud->width = cloud->height = 0;
+	}
+	size_t bytes() const { return cloud->points.capacity() * sizeof(PointT); }
+};
+
+// All of the large buffers used within one paintPointcloud call
+// Clouds built from one image, in their own buffers so that images can be preprocessed concurrently
+struct PainterImageBuffers
+{
+	PainterPooledCloud<pcl::PointXYZRGB> flat;
+	PainterPooledCloud<pcl::PointXYZRGB> spherical_lobed;
+	PainterPooledCloud<pcl::PointXYZRGB> spherical;
+};
+
+struct PainterBufferPool
+{
+	PainterPooledCloud<pcl::PointXYZI> input_depth;
+	PainterPooledCloud<pcl::PointXYZI> depth_voxel_temp;
+	PainterPooledCloud<pcl::PointXYZI> depth_projected_intensity;
+	PainterSphereIndex<PainterSphereDepth> depth_sphere;
+	PainterSphereIndex<PainterSphereColor> color_sphere;
+	std::vector<uint32_t> query_order; 		// Morton order in which the painters visit their query points
+	std::vector<uint32_t> output_origins; 	// Query point each output point came from (only to restore the original order)
+	std::vector<PainterImageBuffers> images;
+	PainterPooledCloud<pcl::PointXYZRGB> image_flat;
+	PainterPooledCloud<pcl::PointXYZRGB> image_spherical_lobed;
+	PainterPooledCloud<pcl::PointXYZRGB> image_spherical;
+	PainterPooledCloud<pcl::PointXYZRGB> image_voxel_temp;
+	PainterPooledCloud<pcl::PointXYZRGB> output;
+	sensor_msgs::PointCloud2 transformed_depth_msg;
+	sensor_msgs::PointCloud2 final_msg;
+};
+
+// Running color statistics for one voxel of the persistent fused map
+struct PainterVoxel
+{
+	double x, y, z; 			// Sum of observed positions (unweighted, for the centroid)
+	double r, g, b; 			// Weighted sums of observed colors
+	double weight; 				// Sum of observation weights
+	int point_count; 			// Number of painted points fused into this voxel
+	int observation_count; 		// Number of painting calls which observed this voxel
+	int last_shot; 				// Index of the last painting call which observed this voxel
+};
 
 class PointcloudPainter
 {
 public:
 	PointcloudPainter();
-	bool buildImageClouds(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_flat, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical_lobed, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical, cv_bridge::CvImagePtr cv_image, std::string camera_frame, std::string target_frame, int projection, float max_angle, int image_hgt, int image_wdt, int image_number);
+	bool buildImageClouds(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_flat, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical_lobed, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical, cv_bridge::CvImageConstPtr cv_image, std::string camera_frame, std::string target_frame, int projection, const PainterLensParams &lens_params, const PainterRegionOfInterest *roi, int image_number);
+	template<typename Lens>
+	bool buildImageCloudsKernel(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_flat, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical_lobed, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical, cv_bridge::CvImageConstPtr cv_image, std::string camera_frame, std::string target_frame, const PainterLensParams &lens_params, const PainterRegionOfInterest *roi, int image_number);
 	bool paintPointcloud(pointcloud_painter::pointcloud_painter_srv::Request &req, pointcloud_painter::pointcloud_painter_srv::Response &res);
-	bool projectColorOntoDepth(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr spherical_depth_cloud, pcl::PointCloud<pcl::PointXYZI>::Ptr &depth_cloud, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &rgb_cloud, int ver_res, int hor_res, int k);
-	bool projectDepthOntoColor(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr spherical_depth_cloud, pcl::PointCloud<pcl::PointXYZI>::Ptr &depth_cloud, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &rgb_cloud, int ver_res, int hor_res, int k);
+	bool paintAnytime(pointcloud_painter::pointcloud_painter_srv::Request &req, pointcloud_painter::pointcloud_painter_srv::Response &res);
+	bool paintAtLevel(pointcloud_painter::pointcloud_painter_srv::Request &req, pointcloud_painter::pointcloud_painter_srv::Response &res, int level);
+	bool deadlinePassed();
+	bool projectColorOntoDepth(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, pcl::PointCloud<pcl::PointXYZI>::Ptr &depth_cloud, PainterSphereIndex<PainterSphereColor> &color_sphere, int ver_res, int hor_res, int k, bool preserve_order);
+	bool projectDepthOntoColor(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, PainterSphereIndex<PainterSphereDepth> &depth_sphere, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &rgb_cloud, int ver_res, int hor_res, int k, bool preserve_order);
+	bool blendNeighbors(PainterSphereIndex<PainterSphereColor> &color_sphere, const std::vector<int> &nearest_indices, const std::vector<float> &nearest_dist_squareds, float *value);
+	bool blendNeighbors(PainterSphereIndex<PainterSphereDepth> &depth_sphere, const std::vector<int> &nearest_indices, const std::vector<float> &nearest_dist_squareds, float *value);
+	template<typename SphereT, typename QueryT>
+	void validateNeighborSearch(PainterSphereIndex<SphereT> &sphere, const pcl::PointCloud<QueryT> &queries, int k, float max_sqr_distance, int samples, float &recall, float &deviation);
+	void restorePointOrder(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud, const std::vector<uint32_t> &origins, size_t query_count);
 	bool interpolateColors(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, pcl::PointCloud<pcl::PointXYZ> &depth_cloud, pcl::PointCloud<pcl::PointXYZRGB> &rgb_cloud, int ver_res, int hor_res);
-	bool downsampleImage(cv_bridge::CvImagePtr image_out, cv_bridge::CvImagePtr image_in, int height, int width, int height_mult, int width_mult);
+	double estimateMemoryMB(pointcloud_painter::pointcloud_painter_srv::Request &req, std::vector<int> &compression_ratios, bool low_footprint);
+	void releaseBuffers(bool free_memory);
+	void resetPeakMemory();
+	double peakMemoryMB();
+	bool fuseIntoVoxelMap(pcl::PointCloud<pcl::PointXYZRGB>::Ptr painted_cloud, std::string target_frame);
+	bool queryVoxelMap(pointcloud_painter::voxel_map_srv::Request &req, pointcloud_painter::voxel_map_srv::Response &res);
+	bool storePaintedCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr painted_cloud, std::string target_frame, ros::Time stamp);
+	bool queryMapStore(pointcloud_painter::map_store_srv::Request &req, pointcloud_painter::map_store_srv::Response &res);
+	bool renderPanorama(cv::Mat &rgb_image, cv::Mat &range_image, pcl::PointCloud<pcl::PointXYZRGB> &organized_cloud, pcl::PointCloud<pcl::PointXYZRGB>::Ptr painted_cloud, int width);
+	bool buildOctreeLOD(std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> &lod_clouds, std::vector<float> &lod_voxel_sizes, pcl::PointCloud<pcl::PointXYZRGB>::Ptr painted_cloud, int depth);
+	bool loadReferencedInputs(pointcloud_painter::pointcloud_painter_srv::Request &req);
+	void releaseReferencedInputs();
+	bool decodeCompressedImage(cv_bridge::CvImagePtr image_out, const sensor_msgs::CompressedImage &image_in, int compression_ratio, int &remaining_ratio);
+	bool downsampleImage(cv_bridge::CvImagePtr image_out, cv_bridge::CvImageConstPtr image_in, int height, int width, int height_mult, int width_mult);
 
 private:
 	ros::NodeHandle nh_;
 	tf::TransformListener camera_frame_listener_;
 
+	// ------ Lens Model Registry ------
+	typedef bool (PointcloudPainter::*ImageCloudKernel)(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &, cv_bridge::CvImageConstPtr, std::string, std::string, const PainterLensParams &, const PainterRegionOfInterest *, int);
+	std::map<int, ImageCloudKernel> lens_kernels_;
+
+	// ------ Buffer Pool / Memory Budget ------
+	PainterBufferPool buffer_pool_;
+	float memory_budget_mb_; 		// 0 -> unlimited
+
+	// ------ Referenced Inputs ------
+	PainterMappedFile input_cloud_file_; 		// Mapping of input_cloud_path, held open for the whole paint call
+	const uint8_t *input_cloud_points_; 		// Points of the input cloud within it (NULL -> they are in req.input_cloud.data)
+
+	// ------ Preprocessing ------
+	int preprocessing_threads_; 	// Threads for the depth / per-image preprocessing task graph (0 -> hardware threads)
+
+	// ------ Anytime Painting ------
+	ros::WallTime deadline_; 		// Deadline of the current anytime paint (zero -> none)
+	bool deadline_checks_enabled_; 	// Off while the coarsest anytime level is painted, which always runs to completion
+
+	// ------ Persistent Voxel Map ------
+	std::unordered_map<uint64_t, PainterVoxel> voxel_map_;
+	std::string voxel_map_frame_; 	// Fixed frame the map is accumulated in
+	float voxel_map_size_; 			// Voxel edge length (m)
+	int voxel_map_shots_; 			// Number of painting calls fused so far
+
+	// ------ Painted Map Store ------
+	PainterMapStore map_store_; 	// Closed if no map_store_directory is set
+	std::string map_store_frame_; 	// Fixed frame points are archived in
+
 };
\ No newline at end of file
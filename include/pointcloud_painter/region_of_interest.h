@@ -0,0 +1,244 @@
+
+#ifndef POINTCLOUD_PAINTER_REGION_OF_INTEREST_H
+#define POINTCLOUD_PAINTER_REGION_OF_INTEREST_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Extra angle (radians) kept around the region when culling image pixels, so that depth points at its edge still find
+//   their color neighbors
+#define PAINTER_ROI_PIXEL_MARGIN 0.02
+
+/* PainterRegionOfInterest - the part of the scene a paint request is restricted to, in target_frame
+ 	An oriented box (center, half sizes, rotation) and/or an azimuth/elevation window about target_frame's origin;
+ 	a point must lie within both (where given). Depth points are tested directly. Image pixels are only directions,
+ 	so a pixel is kept if its ray from the origin passes through the box and within the window.
+*/
+struct PainterRegionOfInterest
+{
+	bool has_box;
+	float center[3];
+	float half_size[3];
+	float axes[9]; 				// Rows are the box's axes, in target_frame
+	bool has_window;
+	float azimuth_min, azimuth_max; 	// Radians about +Z from +X, in -pi..pi; min > max wraps through pi
+	float elevation_min, elevation_max;
+
+	PainterRegionOfInterest() : has_box(false), has_window(false) {}
+
+	bool active() const { return has_box || has_window; }
+
+	// From the request's roi_box (cx cy cz hx hy hz qx qy qz qw) and roi_window (az_min az_max el_min el_max)
+	//   false if either is given but malformed
+	bool setup(const std::vector<float> &box, const std::vector<float> &window)
+	{
+		has_box = has_window = false;
+		if(box.size() > 0)
+		{
+			if(box.size() != 10)
+				return false;
+			for(int a=0; a<3; a++)
+			{
+				center[a] = box[a];
+				half_size[a] = std::fabs(box[3+a]);
+			}
+			float qx = box[6], qy = box[7], qz = box[8], qw = box[9];
+			float norm = std::sqrt(qx*qx + qy*qy + qz*qz + qw*qw);
+			if(!(norm > 0))
+				return false;
+			qx /= norm; 	qy /= norm; 	qz /= norm; 	qw /= norm;
+			// Columns of the rotation matrix are the box axes - stored as rows, to project onto them
+			axes[0] = 1 - 2*(qy*qy + qz*qz); 	axes[1] = 2*(qx*qy + qz*qw); 		axes[2] = 2*(qx*qz - qy*qw);
+			axes[3] = 2*(qx*qy - qz*qw); 		axes[4] = 1 - 2*(qx*qx + qz*qz); 	axes[5] = 2*(qy*qz + qx*qw);
+			axes[6] = 2*(qx*qz + qy*qw); 		axes[7] = 2*(qy*qz - qx*qw); 		axes[8] = 1 - 2*(qx*qx + qy*qy);
+			has_box = true;
+		}
+		if(window.size() > 0)
+		{
+			if(window.size() != 4 || window[2] > window[3])
+				return false;
+			azimuth_min = window[0];
+			azimuth_max = window[1];
+			elevation_min = window[2];
+			elevation_max = window[3];
+			has_window = true;
+		}
+		return true;
+	}
+
+	// Depth points - (x, y, z) in target_frame
+	inline bool containsPoint(float x, float y, float z) const
+	{
+		if(has_box)
+		{
+			float dx = x - center[0], dy = y - center[1], dz = z - center[2];
+			for(int a=0; a<3; a++)
+				if(std::fabs(axes[3*a]*dx + axes[3*a+1]*dy + axes[3*a+2]*dz) > half_size[a])
+					return false;
+		}
+		return !has_window || inWindow(x, y, z, 0);
+	}
+
+	// Image pixels - the ray from target_frame's origin along (x, y, z), with margin radians to spare
+	inline bool containsDirection(float x, float y, float z, float margin) const
+	{
+		if(has_window && !inWindow(x, y, z, margin))
+			return false;
+		if(!has_box)
+			return true;
+		// Slab test in the box's frame, with the box grown by the margin at its distance from the origin
+		float distance = std::sqrt(center[0]*center[0] + center[1]*center[1] + center[2]*center[2]);
+		float t_near = 0;
+		float t_far = INFINITY;
+		for(int a=0; a<3; a++)
+		{
+			float origin = -(axes[3*a]*center[0] + axes[3*a+1]*center[1] + axes[3*a+2]*center[2]);
+			float direction = axes[3*a]*x + axes[3*a+1]*y + axes[3*a+2]*z;
+			float half = half_size[a] + margin*distance;
+			if(std::fabs(direction) < 1e-12f)
+			{
+				if(std::fabs(origin) > half)
+					return false;
+				continue;
+			}
+			float t0 = (-half - origin) / direction;
+			float t1 = (half - origin) / direction;
+			t_near = std::max(t_near, std::min(t0, t1));
+			t_far = std::min(t_far, std::max(t0, t1));
+			if(t_near > t_far)
+				return false;
+		}
+		return true;
+	}
+
+	// Axis-aligned bounds of the region - false if it is unbounded (no box)
+	bool bounds(float min[3], float max[3]) const
+	{
+		if(!has_box)
+			return false;
+		for(int a=0; a<3; a++)
+		{
+			// Extent along target_frame axis a of the box's three (scaled) axes
+			float extent = std::fabs(axes[a])*half_size[0] + std::fabs(axes[3+a])*half_size[1] + std::fabs(axes[6+a])*half_size[2];
+			min[a] = center[a] - extent;
+			max[a] = center[a] + extent;
+		}
+		return true;
+	}
+
+	// Whether the region may overlap an axis-aligned box (conservative - true if unsure)
+	bool intersectsBox(const float min[3], const float max[3]) const
+	{
+		float region_min[3], region_max[3];
+		if(!bounds(region_min, region_max))
+			return true;
+		for(int a=0; a<3; a++)
+			if(region_max[a] < min[a] || region_min[a] > max[a])
+				return false;
+		return true;
+	}
+
+private:
+	inline bool inWindow(float x, float y, float z, float margin) const
+	{
+		float elevation = std::atan2(z, std::sqrt(x*x + y*y));
+		if(elevation < elevation_min - margin || elevation > elevation_max + margin)
+			return false;
+		float azimuth = std::atan2(y, x);
+		if(azimuth_min <= azimuth_max)
+			return angleBetween(azimuth, azimuth_min - margin, azimuth_max + margin);
+		return !angleBetween(azimuth, azimuth_max + margin, azimuth_min - margin); 	// wraps through pi
+	}
+	// Whether angle lies in [low, high], allowing for the bounds having been pushed past +-pi by a margin
+	static inline bool angleBetween(float angle, float low, float high)
+	{
+		if(high - low >= 2*M_PI)
+			return true;
+		if(angle < low)
+			angle += 2*M_PI;
+		else if(angle > high)
+			angle -= 2*M_PI;
+		return angle >= low && angle <= high;
+	}
+};
+
+/* PainterFrustum - a camera's view frustum, for querying stored points by what a view would see
+ 	Looks along +Z of its own frame, with X horizontal and Y vertical (as the painter's camera frames), between the near
+ 	and far distances. Kept as six inward-facing planes in the frame of the transform it is set up with.
+*/
+struct PainterFrustum
+{
+	float planes[6][4]; 		// a b c d - inside where a*x + b*y + c*z + d >= 0
+	float corners[8][3];
+
+	// transform - row-major 3x4 [R|t] from the frustum's frame; fovs in radians
+	bool setup(const float transform[12], float horizontal_fov, float vertical_fov, float near_distance, float far_distance)
+	{
+		if(!(horizontal_fov > 0 && horizontal_fov < M_PI && vertical_fov > 0 && vertical_fov < M_PI && near_distance >= 0 && far_distance > near_distance))
+			return false;
+		float tan_h = std::tan(horizontal_fov/2);
+		float tan_v = std::tan(vertical_fov/2);
+		// In the frustum's frame
+		float local[6][4] = { {0, 0, 1, -near_distance}, {0, 0, -1, far_distance},
+		                      {1, 0, tan_h, 0}, {-1, 0, tan_h, 0},
+		                      {0, 1, tan_v, 0}, {0, -1, tan_v, 0} };
+		for(int p=0; p<6; p++)
+		{
+			float norm = std::sqrt(local[p][0]*local[p][0] + local[p][1]*local[p][1] + local[p][2]*local[p][2]);
+			float normal[3];
+			for(int a=0; a<3; a++)
+				normal[a] = (transform[4*a]*local[p][0] + transform[4*a+1]*local[p][1] + transform[4*a+2]*local[p][2]) / norm;
+			for(int a=0; a<3; a++)
+				planes[p][a] = normal[a];
+			planes[p][3] = local[p][3]/norm - (normal[0]*transform[3] + normal[1]*transform[7] + normal[2]*transform[11]);
+		}
+		for(int c=0; c<8; c++)
+		{
+			float distance = (c & 4) ? far_distance : near_distance;
+			float local_corner[3] = { ((c & 1) ? 1 : -1) * distance * tan_h, ((c & 2) ? 1 : -1) * distance * tan_v, distance };
+			for(int a=0; a<3; a++)
+				corners[c][a] = transform[4*a]*local_corner[0] + transform[4*a+1]*local_corner[1] + transform[4*a+2]*local_corner[2] + transform[4*a+3];
+		}
+		return true;
+	}
+
+	inline bool containsPoint(float x, float y, float z) const
+	{
+		for(int p=0; p<6; p++)
+			if(planes[p][0]*x + planes[p][1]*y + planes[p][2]*z + planes[p][3] < 0)
+				return false;
+		return true;
+	}
+
+	bool bounds(float min[3], float max[3]) const
+	{
+		for(int a=0; a<3; a++)
+		{
+			min[a] = max[a] = corners[0][a];
+			for(int c=1; c<8; c++)
+			{
+				min[a] = std::min(min[a], corners[c][a]);
+				max[a] = std::max(max[a], corners[c][a]);
+			}
+		}
+		return true;
+	}
+
+	// Conservative - a box is only rejected if it lies wholly outside one of the planes
+	bool intersectsBox(const float min[3], const float max[3]) const
+	{
+		for(int p=0; p<6; p++)
+		{
+			// The box corner furthest along the plane's normal
+			float x = (planes[p][0] >= 0) ? max[0] : min[0];
+			float y = (planes[p][1] >= 0) ? max[1] : min[1];
+			float z = (planes[p][2] >= 0) ? max[2] : min[2];
+			if(planes[p][0]*x + planes[p][1]*y + planes[p][2]*z + planes[p][3] < 0)
+				return false;
+		}
+		return true;
+	}
+};
+
+#endif // POINTCLOUD_PAINTER_REGION_OF_INTEREST_H
@@ -0,0 +1,193 @@
+
+#ifndef POINTCLOUD_PAINTER_TASK_GRAPH_H
+#define POINTCLOUD_PAINTER_TASK_GRAPH_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* PainterTaskGraph - runs a small DAG of tasks on a work-stealing pool of threads
+ 	Tasks are added with the tasks they depend on (which must already have been added), then run() executes the
+ 	whole graph and returns once every task has finished. Each worker takes new work from the back of its own
+ 	deque (tasks it just made ready, so their inputs are still in its cache) and, when that is empty, steals from
+ 	the front of the others'. The painter's tasks are few and coarse, so one lock guards all of the deques.
+ 	A task which returns false (or throws) fails, and every task depending on it is skipped and fails too.
+*/
+class PainterTaskGraph
+{
+public:
+	typedef std::function<bool()> TaskFunction;
+
+	// thread_count <= 0 -> one per hardware thread
+	explicit PainterTaskGraph(int thread_count = 0) : thread_count_(thread_count)
+	{
+		if(thread_count_ <= 0)
+			thread_count_ = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	int addTask(const std::string &name, TaskFunction function, const std::vector<int> &dependencies = std::vector<int>())
+	{
+		Task task;
+		task.name = name;
+		task.function = function;
+		task.dependencies = dependencies;
+		task.pending = dependencies.size();
+		task.failed = false;
+		task.start = task.end = 0;
+		task.thread = -1;
+		int id = tasks_.size();
+		for(size_t d=0; d<dependencies.size(); d++)
+			tasks_[dependencies[d]].dependents.push_back(id);
+		tasks_.push_back(task);
+		return id;
+	}
+
+	// Run every task; true if none failed
+	bool run()
+	{
+		start_time_ = std::chrono::steady_clock::now();
+		remaining_ = tasks_.size();
+		int thread_count = std::max(1, std::min(thread_count_, int(tasks_.size())));
+		queues_.assign(thread_count, std::deque<int>());
+		int next_queue = 0;
+		for(size_t t=0; t<tasks_.size(); t++)
+			if(tasks_[t].pending == 0)
+				queues_[next_queue++ % thread_count].push_back(t);
+
+		std::vector<std::thread> threads;
+		for(int w=1; w<thread_count; w++)
+			threads.push_back(std::thread(&PainterTaskGraph::workerLoop, this, w));
+		workerLoop(0);
+		for(size_t w=0; w<threads.size(); w++)
+			threads[w].join();
+
+		for(size_t t=0; t<tasks_.size(); t++)
+			if(tasks_[t].failed)
+				return false;
+		return true;
+	}
+
+	// Per-task results, in seconds since run() started
+	double taskStart(int task) const { return tasks_[task].start; }
+	double taskEnd(int task) const { return tasks_[task].end; }
+	double taskDuration(int task) const { return tasks_[task].end - tasks_[task].start; }
+	bool taskFailed(int task) const { return tasks_[task].failed; }
+	const std::string &taskName(int task) const { return tasks_[task].name; }
+
+	// Longest chain of dependent tasks by summed run time - a lower bound on the graph's wall time with unlimited threads
+	double criticalPath(std::vector<int> &path) const
+	{
+		std::vector<double> chain_time(tasks_.size(), 0);
+		std::vector<int> chain_previous(tasks_.size(), -1);
+		int last = -1;
+		for(size_t t=0; t<tasks_.size(); t++)
+		{
+			for(size_t d=0; d<tasks_[t].dependencies.size(); d++)
+			{
+				int dependency = tasks_[t].dependencies[d];
+				if(chain_previous[t] < 0 || chain_time[dependency] > chain_time[chain_previous[t]])
+					chain_previous[t] = dependency;
+			}
+			chain_time[t] = taskDuration(t) + (chain_previous[t] >= 0 ? chain_time[chain_previous[t]] : 0);
+			if(last < 0 || chain_time[t] > chain_time[last])
+				last = t;
+		}
+		path.clear();
+		for(int t=last; t>=0; t=chain_previous[t])
+			path.insert(path.begin(), t);
+		return (last >= 0) ? chain_time[last] : 0;
+	}
+
+private:
+	struct Task
+	{
+		std::string name;
+		TaskFunction function;
+		std::vector<int> dependencies;
+		std::vector<int> dependents;
+		int pending; 			// Dependencies not yet finished
+		bool failed;
+		double start, end; 		// Seconds since run() started
+		int thread; 			// Worker which ran it
+	};
+
+	std::vector<Task> tasks_;
+	int thread_count_;
+	std::vector<std::deque<int> > queues_;
+	int remaining_;
+	std::mutex mutex_;
+	std::condition_variable ready_;
+	std::chrono::steady_clock::time_point start_time_;
+
+	double now() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time_).count(); }
+
+	void workerLoop(int worker)
+	{
+		while(true)
+		{
+			int task = -1;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				while(task < 0)
+				{
+					if(remaining_ == 0)
+						return;
+					if(!queues_[worker].empty())
+					{
+						task = queues_[worker].back();
+						queues_[worker].pop_back();
+					}
+					for(size_t offset=1; task < 0 && offset<queues_.size(); offset++)
+					{
+						std::deque<int> &victim = queues_[(worker + offset) % queues_.size()];
+						if(!victim.empty())
+						{
+							task = victim.front();
+							victim.pop_front();
+						}
+					}
+					if(task < 0)
+						ready_.wait(lock);
+				}
+			}
+
+			// A task's failed flag can only be set (by a failed dependency) before it becomes ready
+			Task &current = tasks_[task];
+			current.thread = worker;
+			current.start = now();
+			if(!current.failed)
+			{
+				try
+				{
+					current.failed = !current.function();
+				}
+				catch(...)
+				{
+					current.failed = true;
+				}
+			}
+			current.end = now();
+
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				remaining_--;
+				for(size_t d=0; d<current.dependents.size(); d++)
+				{
+					Task &dependent = tasks_[current.dependents[d]];
+					if(current.failed)
+						dependent.failed = true;
+					if(--dependent.pending == 0)
+						queues_[worker].push_back(current.dependents[d]);
+				}
+			}
+			ready_.notify_all();
+		}
+	}
+};
+
+#endif // POINTCLOUD_PAINTER_TASK_GRAPH_H
@@ -24,8 +24,21 @@ int main(int argc, char** argv)
 	nh.param<int>("/pointcloud_painter/projection_type", projection_type, PAINTER_PROJ_EQUA_STEREO);
 	bool color_onto_depth;
 	nh.param<bool>("/pointcloud_painter/color_onto_depth", color_onto_depth, false);
+	float deadline;
+	nh.param<float>("/pointcloud_painter/deadline", deadline, 0);
+	// Region of interest - empty lists -> paint everything
+	std::vector<float> roi_box, roi_window;
+	nh.getParam("/pointcloud_painter/roi_box", roi_box);
+	nh.getParam("/pointcloud_painter/roi_window", roi_window);
+	bool preserve_point_order;
+	nh.param<bool>("/pointcloud_painter/preserve_point_order", preserve_point_order, false);
 	int neighbor_search_count;
 	nh.param<int>("/pointcloud_painter/neighbor_search_count", neighbor_search_count, 3);
+	float neighbor_search_epsilon;
+	int neighbor_search_max_checks, neighbor_validation_samples;
+	nh.param<float>("/pointcloud_painter/neighbor_search_epsilon", neighbor_search_epsilon, 0);
+	nh.param<int>("/pointcloud_painter/neighbor_search_max_checks", neighbor_search_max_checks, 0);
+	nh.param<int>("/pointcloud_painter/neighbor_validation_samples", neighbor_validation_samples, 0);
 	// Should this process loop? 
 	bool should_loop;
 	nh.param<bool>("/pointcloud_painter/should_loop", should_loop);
@@ -61,6 +74,13 @@ int main(int argc, char** argv)
 	nh.param<std::string>("/pointcloud_painter/bag_name_right", right_bag_name, "/home/conor/ros_data/Highbay_Scans_SRS/pointcloud_painting_test/right_camera.bag");
 	nh.param<std::string>("/pointcloud_painter/bag_name_depth", cloud_bag_name, "/home/conor/ros_data/Highbay_Scans_SRS/pointcloud_painting_test/with_cameras_scan.bag");
 
+	// Optionally pass the data by reference (binary PCD/PLY and image files, or "shm:/name" segments) for a painter on this host
+	std::string input_cloud_path, output_cloud_path;
+	std::vector<std::string> image_paths;
+	nh.param<std::string>("/pointcloud_painter/input_cloud_path", input_cloud_path, "");
+	nh.param<std::string>("/pointcloud_painter/output_cloud_path", output_cloud_path, "");
+	nh.getParam("/pointcloud_painter/image_paths", image_paths);
+
 	// ---------------------------------------------------------------------------
 	// ------------------------ Extract Data from ROSBAGs ------------------------
 	// ---------------------------------------------------------------------------
@@ -100,6 +120,7 @@ int main(int argc, char** argv)
 	ROS_INFO_STREAM("                      Getting left image data from file " << left_bag_name << " using topic " << left_bag_topic);
     // ------------- Second Bag - left IMAGE -------------
     sensor_msgs::Image left_image;
+    sensor_msgs::CompressedImage left_image_compressed; 	// used instead if the bag topic holds compressed images
 	rosbag::Bag left_bag; 
 	left_bag.open(left_bag_name, rosbag::bagmode::Read);
 
@@ -110,8 +131,11 @@ int main(int argc, char** argv)
 	BOOST_FOREACH(rosbag::MessageInstance const m, view_left)
     {
         sensor_msgs::Image::ConstPtr left_ptr = m.instantiate<sensor_msgs::Image>();
+        sensor_msgs::CompressedImage::ConstPtr left_compressed_ptr = m.instantiate<sensor_msgs::CompressedImage>();
         if (left_ptr != NULL)
             left_image = *left_ptr;
+        else if (left_compressed_ptr != NULL)
+            left_image_compressed = *left_compressed_ptr;
         else
         	ROS_ERROR_STREAM("[PointcloudPainter] left image retrieved from bag is null...");
     }
@@ -120,6 +144,7 @@ int main(int argc, char** argv)
 	ROS_INFO_STREAM("                      Getting right image data from file " << right_bag_name << " using topic " << right_bag_topic);
     // ------------- Third Bag - right IMAGE -------------
     sensor_msgs::Image right_image;
+    sensor_msgs::CompressedImage right_image_compressed; 	// used instead if the bag topic holds compressed images
 	rosbag::Bag right_bag; 
 	right_bag.open(right_bag_name, rosbag::bagmode::Read);
 
@@ -131,8 +156,11 @@ int main(int argc, char** argv)
     {
     	ROS_INFO_STREAM("opening this bit..." );
         sensor_msgs::Image::ConstPtr right_ptr = m.instantiate<sensor_msgs::Image>();
+        sensor_msgs::CompressedImage::ConstPtr right_compressed_ptr = m.instantiate<sensor_msgs::CompressedImage>();
         if (right_ptr != NULL)
             right_image = *right_ptr;
+        else if (right_compressed_ptr != NULL)
+            right_image_compressed = *right_compressed_ptr;
         else
         	ROS_ERROR_STREAM("[PointcloudPainter] left image retrieved from bag is null...");
     }
@@ -145,15 +173,40 @@ int main(int argc, char** argv)
 	srv.request.input_cloud.header.stamp = ros::Time::now();
 	srv.request.image_list.push_back(left_image);
 	srv.request.image_list.push_back(right_image);
+	srv.request.compressed_image_list.push_back(left_image_compressed);
+	srv.request.compressed_image_list.push_back(right_image_compressed);
 	srv.request.image_names.push_back("left_image");
 	srv.request.image_names.push_back("right_image");
+	srv.request.image_paths = image_paths;
+	for(int i=0; i<image_paths.size() && i<srv.request.image_list.size(); i++)
+		if(image_paths[i].size() > 0)
+		{
+			srv.request.image_list[i].data.clear();
+			srv.request.compressed_image_list[i].data.clear();
+		}
+	srv.request.output_cloud_path = output_cloud_path;
+	if(input_cloud_path.size() > 0)
+	{
+		// Only the header (frame) goes with the request - the points are read from the file
+		srv.request.input_cloud_path = input_cloud_path;
+		srv.request.input_cloud.data.clear();
+		srv.request.input_cloud.width = 0;
+		srv.request.input_cloud.row_step = 0;
+	}
 	// -------- Projection Stuff --------
 	srv.request.projections.push_back(projection_type);
 	srv.request.projections.push_back(projection_type);//1);
 	srv.request.max_image_angles.push_back(max_lens_angle);
 	srv.request.max_image_angles.push_back(max_lens_angle);//260);
 	srv.request.color_onto_depth = color_onto_depth;
+	srv.request.preserve_point_order = preserve_point_order;
+	srv.request.deadline = deadline;
+	srv.request.roi_box = roi_box;
+	srv.request.roi_window = roi_window;
 	srv.request.neighbor_search_count = neighbor_search_count;
+	srv.request.neighbor_search_epsilon = neighbor_search_epsilon;
+	srv.request.neighbor_search_max_checks = neighbor_search_max_checks;
+	srv.request.neighbor_validation_samples = neighbor_validation_samples;
 	// -------- Compression --------
 	// Raster-space Compression
 	srv.request.compress_images.push_back(compress_image);
@@ -188,7 +241,8 @@ int main(int argc, char** argv)
 		cv_bridge::CvImagePtr image_ptr(new cv_bridge::CvImage);
 		image.copyTo(image_ptr->image);
 		//image_ptr->toImageMsg(srv.request.image_list[0]);
-		srv.request.image_list[0].encoding = srv.request.image_list[1].encoding;
+		if(left_image_compressed.data.size() == 0)
+			srv.request.image_list[0].encoding = srv.request.image_list[1].encoding;
 
 		// Call service
 		if( ! painter_srv.call(srv) )
@@ -196,7 +250,13 @@ int main(int argc, char** argv)
 		else
 		{	
 			ROS_INFO_STREAM("[PointcloudPainter] Successfully called painting service.");
-			ROS_INFO_STREAM("[PointcloudPainter]   Cloud Size: " << srv.response.output_cloud.height*srv.response.output_cloud.width);
+			ROS_INFO_STREAM("[PointcloudPainter]   Cloud Size: " << srv.response.output_point_count);
+			if(deadline > 0)
+				ROS_INFO_STREAM("[PointcloudPainter]   Anytime level: " << srv.response.achieved_level << " (image scale " << srv.response.achieved_image_scale << ", depth fraction " << srv.response.achieved_depth_fraction << ")");
+			if(neighbor_validation_samples > 0)
+				ROS_INFO_STREAM("[PointcloudPainter]   Neighbor recall: " << srv.response.neighbor_recall << "  deviation: " << srv.response.neighbor_deviation);
+			if(srv.response.output_cloud_path.size() > 0)
+				ROS_INFO_STREAM("[PointcloudPainter]   Written to: " << srv.response.output_cloud_path);
 			ros::Duration(0.5).sleep();
 		}
 
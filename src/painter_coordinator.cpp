@@ -0,0 +1,610 @@
+
+#include "pointcloud_painter/painter_coordinator.h"
+
+PainterCoordinator::PainterCoordinator()
+{
+	// ------ Lens Model Registry ------
+	lens_kernels_[PAINTER_PROJ_EQUA_STEREO] = &PainterCoordinator::findImageRegionKernel<PainterLensEquaStereo>;
+	lens_kernels_[PAINTER_PROJ_POLE_STEREO] = &PainterCoordinator::findImageRegionKernel<PainterLensPoleStereo>;
+	lens_kernels_[PAINTER_PROJ_EQUAL_AREA] = &PainterCoordinator::findImageRegionKernel<PainterLensEqualArea>;
+	lens_kernels_[PAINTER_PROJ_FLAT] = &PainterCoordinator::findImageRegionKernel<PainterLensFlat>;
+	lens_kernels_[PAINTER_PROJ_EQUIDISTANT] = &PainterCoordinator::findImageRegionKernel<PainterLensEquidistant>;
+	lens_kernels_[PAINTER_PROJ_KANNALA_BRANDT] = &PainterCoordinator::findImageRegionKernel<PainterLensKannalaBrandt>;
+
+	// By default the coordinator takes the usual painter service name, so clients don't need to know the painting is sharded
+	ros::NodeHandle private_nh("~");
+	std::string service_name;
+	nh_.param<std::string>("/pointcloud_painter/service_name", service_name, "/pointcloud_painter/paint");
+	private_nh.param<std::string>("service_name", service_name, service_name);
+
+	nh_.param<std::vector<std::string> >("/pointcloud_painter/coordinator/worker_services", worker_services_, std::vector<std::string>());
+	nh_.param<int>("/pointcloud_painter/coordinator/sector_count", sector_count_, 0);
+	nh_.param<int>("/pointcloud_painter/coordinator/region_margin", region_margin_, 16);
+	nh_.param<int>("/pointcloud_painter/coordinator/region_samples", region_samples_, 5000);
+	if(worker_services_.size() == 0)
+	{
+		ROS_ERROR_STREAM("[PainterCoordinator] No worker services given in /pointcloud_painter/coordinator/worker_services - exiting.");
+		return;
+	}
+	if(sector_count_ <= 0)
+		sector_count_ = worker_services_.size();
+
+	ROS_INFO_STREAM("[PainterCoordinator] Initializing service with name " << service_name << ", splitting scans into " << sector_count_ << " sectors across " << worker_services_.size() << " workers.");
+	ros::ServiceServer coordinator = nh_.advertiseService(service_name, &PainterCoordinator::paintSharded, this);
+
+	ros::spin();
+}
+
+/* paintSharded - paints a cloud by splitting it into azimuth sectors and farming them out to worker painters
+ 	Takes and returns the same request/response as PointcloudPainter::paintPointcloud. Images are expected whole
+ 	(image_regions and image_crops empty). The voxel map, map store, panorama and LOD outputs need the whole painted cloud in one place, so they
+ 	are not available here - request them from a single painter.
+*/
+bool PainterCoordinator::paintSharded(pointcloud_painter::pointcloud_painter_srv::Request &req, pointcloud_painter::pointcloud_painter_srv::Response &res)
+{
+	ROS_INFO_STREAM("[PainterCoordinator] Received call to paint pointcloud!");
+	// Inputs passed by path are read here; workers are sent embedded sectors, since they may be on other hosts
+	if(!loadReferencedInputs(req))
+		return false;
+	ROS_INFO_STREAM("[PainterCoordinator]   Input cloud size: " << req.input_cloud.height*req.input_cloud.width);
+	ros::Time start_time = ros::Time::now();
+	ros::Duration time_elapsed;
+
+	if(req.fuse_into_voxel_map || req.store_in_map || req.output_panorama || req.build_lod)
+		ROS_WARN_STREAM("[PainterCoordinator] Voxel map fusion, map store archiving, panorama and LOD outputs are not supported when painting is sharded - ignoring them.");
+	int image_count = std::max(req.image_list.size(), req.compressed_image_list.size());
+
+	// ------ Transform input_cloud (depth information) to target_frame ------
+	//   Sectors are taken about target_frame, so each worker then receives its sector already in that frame
+	std::string cloud_frame = req.input_cloud.header.frame_id;
+	sensor_msgs::PointCloud2 transformed_depth_cloud;
+	if(camera_frame_listener_.waitForTransform(cloud_frame, req.target_frame, ros::Time(0), ros::Duration(0.5)))
+	{
+		tf::StampedTransform transform;
+		camera_frame_listener_.lookupTransform(req.target_frame, cloud_frame, ros::Time(0), transform);
+		pcl_ros::transformPointCloud(req.target_frame, transform, req.input_cloud, transformed_depth_cloud);
+	}
+	else
+	{
+		ROS_WARN_THROTTLE(60, "[PainterCoordinator] listen for transformation from %s to %s timed out. Defaulting to initial location of input cloud...", cloud_frame.c_str(), req.target_frame.c_str());
+		transformed_depth_cloud = req.input_cloud;
+	}
+	pcl::PointCloud<pcl::PointXYZI>::Ptr depth_pcl(new pcl::PointCloud<pcl::PointXYZI>());
+	pcl::fromROSMsg(transformed_depth_cloud, *depth_pcl);
+
+	// ------ Region of Interest ------
+	//   Points outside it are dropped before splitting, so sectors are balanced over (and only carry) the points painted;
+	//   the region is still forwarded so that each worker culls its image pixels too
+	PainterRegionOfInterest roi;
+	if(!roi.setup(req.roi_box, req.roi_window))
+	{
+		ROS_ERROR_STREAM("[PainterCoordinator] Rejecting paint request - malformed roi_box / roi_window (need 10 and 4 values).");
+		return false;
+	}
+	if(roi.active())
+	{
+		size_t kept = 0;
+		for(size_t i=0; i<depth_pcl->points.size(); i++)
+			if(roi.containsPoint(depth_pcl->points[i].x, depth_pcl->points[i].y, depth_pcl->points[i].z))
+				depth_pcl->points[kept++] = depth_pcl->points[i];
+		depth_pcl->points.resize(kept);
+		depth_pcl->width = kept;
+		depth_pcl->height = 1;
+	}
+
+	// ------ Split into Sectors ------
+	std::vector<pcl::PointCloud<pcl::PointXYZI>::Ptr> sectors;
+	std::vector<std::vector<int> > sector_sources;
+	splitIntoSectors(sectors, sector_sources, depth_pcl, sector_count_);
+	time_elapsed = ros::Time::now() - start_time;
+	ROS_DEBUG_STREAM("split input cloud into " << sectors.size() << " sectors " << time_elapsed);
+
+	// ------ Images and Camera Transforms ------
+	//   Raw images are wrapped here, then cropped for every sector which can see them. Compressed images are not decoded at
+	//   all (only their size is read) - each sector is sent the original bytes with its crop, for the worker to apply after
+	//   its own (reduced resolution) decode, so the pixels are neither decoded at full size here nor re-encoded
+	std::vector<cv::Mat> raw_images(image_count);
+	std::vector<tf::StampedTransform> camera_transforms(image_count);
+	std::vector<bool> have_transform(image_count, false);
+	std::vector<PainterLensParams> lens_params(image_count);
+	// Regions are aligned to a multiple of every compression ratio a worker may use for the image, so that their offsets are
+	//   whole compressed pixels - the requested ratio, raised up to 8 (memory budget) or 2^anytime_levels (anytime painting)
+	std::vector<int> region_alignments(image_count);
+	int anytime_levels = (req.deadline > 0) ? ((req.anytime_levels > 0) ? req.anytime_levels : 3) : 0;
+	for(int i=0; i<image_count; i++)
+	{
+		int compression_ratio = req.compress_images[i] ? std::max(int(req.image_compression_ratios[i]), 1) : 1;
+		region_alignments[i] = compression_ratio * std::max(PAINTER_REGION_ALIGNMENT, 1 << anytime_levels);
+
+		int image_hgt = 0;
+		int image_wdt = 0;
+		if( i < req.compressed_image_list.size() && req.compressed_image_list[i].data.size() > 0 )
+		{
+			const std::vector<uint8_t> &data = req.compressed_image_list[i].data;
+			// (formats whose header can't be read are decoded just for their size)
+			if(!painterEncodedImageSize(data, image_hgt, image_wdt))
+			{
+				cv::Mat decoded_image = cv::imdecode(cv::Mat(1, data.size(), CV_8UC1, const_cast<uint8_t*>(&data[0])), cv::IMREAD_COLOR);
+				image_hgt = decoded_image.rows;
+				image_wdt = decoded_image.cols;
+			}
+		}
+		else
+		{
+			try
+			{
+				// Wraps the request buffer without copying it (req outlives the Mat)
+				raw_images[i] = cv_bridge::toCvShare(req.image_list[i], boost::shared_ptr<void const>())->image;
+			}
+			catch(cv_bridge::Exception& e)
+			{
+				ROS_ERROR_STREAM("[PainterCoordinator] cv_bridge exception: " << e.what());
+				return false;
+			}
+			image_hgt = raw_images[i].rows;
+			image_wdt = raw_images[i].cols;
+		}
+		if(image_hgt <= 0 || image_wdt <= 0)
+		{
+			ROS_ERROR_STREAM("[PainterCoordinator] Failed to read image " << req.image_names[i] << " - rejecting paint request.");
+			return false;
+		}
+
+		lens_params[i].max_angle = req.max_image_angles[i];
+		lens_params[i].image_hgt = image_hgt;
+		lens_params[i].image_wdt = image_wdt;
+		lens_params[i].pixel_scale = 1;
+		lens_params[i].coefficients.assign(PAINTER_LENS_PARAMETER_COUNT, 0);
+		for(int n=0; n<PAINTER_LENS_PARAMETER_COUNT && PAINTER_LENS_PARAMETER_COUNT*i+n < req.lens_parameters.size(); n++)
+			lens_params[i].coefficients[n] = req.lens_parameters[PAINTER_LENS_PARAMETER_COUNT*i+n];
+
+		if(camera_frame_listener_.waitForTransform(req.camera_frames[i], req.target_frame, ros::Time(0), ros::Duration(0.5)))
+		{
+			camera_frame_listener_.lookupTransform(req.camera_frames[i], req.target_frame, ros::Time(0), camera_transforms[i]);
+			have_transform[i] = true;
+		}
+		else
+			ROS_WARN_STREAM("[PainterCoordinator] Failed to find transform from " << req.target_frame << " to " << req.camera_frames[i] << " - sending image " << req.image_names[i] << " whole to every sector.");
+	}
+
+	// ------ Build Shard Requests ------
+	std::vector<pointcloud_painter::pointcloud_painter_srv> shards;
+	std::vector<int> shard_sectors;
+	for(int s=0; s<sectors.size(); s++)
+	{
+		if(sectors[s]->points.size() == 0)
+			continue;
+		pointcloud_painter::pointcloud_painter_srv shard;
+		pcl::toROSMsg(*sectors[s], shard.request.input_cloud);
+		shard.request.input_cloud.header.frame_id = req.target_frame;
+		shard.request.input_cloud.header.stamp = req.input_cloud.header.stamp;
+		shard.request.voxelize_rgb_images = req.voxelize_rgb_images;
+		shard.request.flat_voxel_size = req.flat_voxel_size;
+		shard.request.spherical_voxel_size = req.spherical_voxel_size;
+		shard.request.voxelize_depth_cloud = req.voxelize_depth_cloud;
+		shard.request.depth_voxel_size = req.depth_voxel_size;
+		shard.request.neighbor_search_count = req.neighbor_search_count;
+		shard.request.anytime_levels = req.anytime_levels;
+		shard.request.release_buffers_first = req.release_buffers_first;
+		shard.request.roi_box = req.roi_box;
+		shard.request.roi_window = req.roi_window;
+		shard.request.neighbor_search_epsilon = req.neighbor_search_epsilon;
+		shard.request.neighbor_search_max_checks = req.neighbor_search_max_checks;
+		shard.request.neighbor_validation_samples = (req.neighbor_validation_samples + int(sectors.size()) - 1) / std::max(int(sectors.size()), 1); 	// rounded up
+		shard.request.target_frame = req.target_frame;
+		shard.request.color_onto_depth = req.color_onto_depth;
+		shard.request.preserve_point_order = req.preserve_point_order; 	// within each sector - see Merge
+
+		// Find the region of each image which sees this sector
+		std::vector<std::vector<int> > regions(image_count);
+		int visible_images = 0;
+		for(int i=0; i<image_count; i++)
+		{
+			if(!have_transform[i] || findImageRegion(regions[i], sectors[s], camera_transforms[i], req.projections[i], lens_params[i], region_alignments[i]))
+				visible_images++;
+		}
+		// Points no lens can see are still colored from their nearest image points, as by a single painter
+		if(visible_images == 0)
+			for(int i=0; i<image_count; i++)
+				regions[i].clear();
+		for(int i=0; i<image_count; i++)
+		{
+			if(visible_images > 0 && have_transform[i] && regions[i].size() == 0)
+				continue;
+			if(!cropImage(shard.request, req, i, raw_images[i], lens_params[i].image_hgt, lens_params[i].image_wdt, regions[i]))
+				return false;
+		}
+		ROS_DEBUG_STREAM("[PainterCoordinator] sector " << s << ": " << sectors[s]->points.size() << " points, " << shard.request.image_names.size() << " images");
+		shards.push_back(shard);
+		shard_sectors.push_back(s);
+	}
+	time_elapsed = ros::Time::now() - start_time;
+	ROS_DEBUG_STREAM("built " << shards.size() << " shard requests " << time_elapsed);
+
+	// ------ Deadline ------
+	//   Sectors must all be painted by dispatch_end, leaving part of the deadline for the merge - each worker paints its
+	//   sectors one after another, so runWorker splits this between them as it goes
+	ros::Time dispatch_end;
+	if(req.deadline > 0)
+	{
+		dispatch_end = start_time + ros::Duration(req.deadline * (1 - PAINTER_MERGE_TIME_FRACTION));
+		for(int s=0; s<shards.size(); s++)
+			shards[s].request.deadline = req.deadline; 	// replaced by each sector's share when it is sent
+	}
+
+	// ------ Dispatch ------
+	//   One thread per worker, each working through its share of the sectors in turn
+	std::vector<int> succeeded(shards.size(), 0);
+	boost::thread_group worker_threads;
+	for(int w=0; w<worker_services_.size(); w++)
+		worker_threads.create_thread(boost::bind(&PainterCoordinator::runWorker, this, w, boost::ref(shards), boost::ref(succeeded), dispatch_end));
+	worker_threads.join_all();
+	// Retry any failed sectors on the other workers
+	for(int s=0; s<shards.size(); s++)
+		for(int attempt=1; attempt<worker_services_.size() && !succeeded[s]; attempt++)
+		{
+			std::string service = worker_services_[(s + attempt) % worker_services_.size()];
+			ROS_WARN_STREAM("[PainterCoordinator] Retrying sector " << s << " on worker " << service);
+			if(req.deadline > 0)
+				shards[s].request.deadline = std::max(float((dispatch_end - ros::Time::now()).toSec()), 0.001f);
+			ros::ServiceClient worker = nh_.serviceClient<pointcloud_painter::pointcloud_painter_srv>(service);
+			succeeded[s] = worker.call(shards[s]);
+		}
+	time_elapsed = ros::Time::now() - start_time;
+	ROS_INFO_STREAM("[PainterCoordinator] painted " << shards.size() << " sectors " << time_elapsed);
+
+	// ------ Merge ------
+	//   To preserve point order when painting color onto depth, each painted point is matched back to its sector point (by
+	//   position - sectors are sent in target_frame, so workers return their coordinates unchanged, and in sector order),
+	//   and the merged cloud is put back into depth cloud order by their source indices. Voxelized depth points can't be
+	//   matched, and image order (painting depth onto color) isn't kept across sectors - both stay grouped by sector.
+	pcl::PointCloud<pcl::PointXYZRGB> merged_pcl;
+	bool restore_order = req.preserve_point_order && req.color_onto_depth && !req.voxelize_depth_cloud;
+	std::vector<int> merged_sources;
+	res.depth_preprocessing_time = 0;
+	res.preprocessing_time = 0;
+	res.critical_path_time = 0;
+	res.neighbor_recall = 0;
+	res.neighbor_deviation = 0;
+	res.achieved_level = 0;
+	res.achieved_image_scale = 1;
+	res.achieved_depth_fraction = 1;
+	res.completed_levels = 0;
+	res.image_voxelizing_time = 0;
+	res.painting_time = 0;
+	res.estimated_memory_mb = 0;
+	res.peak_memory_mb = 0;
+	res.reduced_footprint = false;
+	for(int s=0; s<shards.size(); s++)
+	{
+		if(!succeeded[s])
+		{
+			ROS_ERROR_STREAM("[PainterCoordinator] Sector " << s << " failed on every worker - rejecting paint request.");
+			return false;
+		}
+		pcl::PointCloud<pcl::PointXYZRGB> shard_pcl;
+		pcl::fromROSMsg(shards[s].response.output_cloud, shard_pcl);
+		merged_pcl += shard_pcl;
+		if(restore_order)
+		{
+			const pcl::PointCloud<pcl::PointXYZI> &sector = *sectors[shard_sectors[s]];
+			const std::vector<int> &sources = sector_sources[shard_sectors[s]];
+			size_t j = 0;
+			for(size_t k=0; k<shard_pcl.points.size() && restore_order; k++)
+			{
+				const pcl::PointXYZRGB &point = shard_pcl.points[k];
+				while(j < sector.points.size() && !(sector.points[j].x == point.x && sector.points[j].y == point.y && sector.points[j].z == point.z))
+					j++;
+				if(j < sector.points.size())
+					merged_sources.push_back(sources[j++]);
+				else
+				{
+					ROS_WARN_STREAM("[PainterCoordinator] Painted points of sector " << s << " don't match its input points - leaving the output grouped by sector.");
+					restore_order = false;
+				}
+			}
+		}
+		// Workers run side by side, so the slowest (and largest) of them is what matters
+		pointcloud_painter::pointcloud_painter_srv::Response &shard_res = shards[s].response;
+		res.depth_preprocessing_time = std::max(res.depth_preprocessing_time, shard_res.depth_preprocessing_time);
+		res.preprocessing_time = std::max(res.preprocessing_time, shard_res.preprocessing_time);
+		if(shard_res.critical_path_time >= res.critical_path_time)
+		{
+			res.critical_path_time = shard_res.critical_path_time;
+			res.critical_path = shard_res.critical_path;
+		}
+		res.image_voxelizing_time = std::max(res.image_voxelizing_time, shard_res.image_voxelizing_time);
+		// The merged cloud is only as fine as its coarsest sector
+		if(shard_res.achieved_level >= res.achieved_level)
+		{
+			res.achieved_level = shard_res.achieved_level;
+			res.achieved_image_scale = shard_res.achieved_image_scale;
+			res.achieved_depth_fraction = shard_res.achieved_depth_fraction;
+		}
+		res.completed_levels = (s == 0) ? shard_res.completed_levels : std::min(res.completed_levels, shard_res.completed_levels);
+		// Each worker validated an equal share of the samples
+		res.neighbor_recall += shard_res.neighbor_recall / shards.size();
+		res.neighbor_deviation += shard_res.neighbor_deviation / shards.size();
+		res.painting_time = std::max(res.painting_time, shard_res.painting_time);
+		res.estimated_memory_mb = std::max(res.estimated_memory_mb, shard_res.estimated_memory_mb);
+		res.peak_memory_mb = std::max(res.peak_memory_mb, shard_res.peak_memory_mb);
+		res.reduced_footprint = res.reduced_footprint || shard_res.reduced_footprint;
+	}
+	if(restore_order)
+	{
+		// Scatter each merged point to its source index, then gather them in that order
+		std::vector<int> merged_positions(depth_pcl->points.size(), -1);
+		for(size_t k=0; k<merged_sources.size(); k++)
+			merged_positions[merged_sources[k]] = k;
+		pcl::PointCloud<pcl::PointXYZRGB> ordered_pcl;
+		ordered_pcl.points.reserve(merged_pcl.points.size());
+		for(size_t i=0; i<merged_positions.size(); i++)
+			if(merged_positions[i] >= 0)
+				ordered_pcl.points.push_back(merged_pcl.points[merged_positions[i]]);
+		ordered_pcl.width = ordered_pcl.points.size();
+		ordered_pcl.height = 1;
+		merged_pcl.swap(ordered_pcl);
+	}
+	pcl::toROSMsg(merged_pcl, res.output_cloud);
+	res.output_cloud.header.frame_id = req.target_frame;
+	res.output_cloud.header.stamp = req.input_cloud.header.stamp;
+	ros::Publisher pub_final = nh_.advertise<sensor_msgs::PointCloud2>("final_cloud", 1, this);
+	pub_final.publish(res.output_cloud);
+	res.output_point_count = merged_pcl.points.size();
+	if(req.output_cloud_path.size() > 0)
+	{
+		if(!painterWriteCloud(req.output_cloud_path, res.output_cloud))
+		{
+			ROS_ERROR_STREAM("[PainterCoordinator] Failed to write painted cloud to " << req.output_cloud_path << " - rejecting paint request.");
+			return false;
+		}
+		res.output_cloud_path = req.output_cloud_path;
+		res.output_cloud.data.clear();
+		res.output_cloud.width = res.output_cloud.height = res.output_cloud.row_step = 0;
+	}
+
+	time_elapsed = ros::Time::now() - start_time;
+	res.total_time = time_elapsed.toSec();
+	ROS_INFO_STREAM("[PainterCoordinator] merged " << shards.size() << " sectors into " << merged_pcl.points.size() << " points " << time_elapsed);
+
+	return true;
+}
+
+/* loadReferencedInputs - replaces any inputs given by path (input_cloud_path, image_paths) with their data
+ 	As in PointcloudPainter - see mapped_io.h.
+*/
+bool PainterCoordinator::loadReferencedInputs(pointcloud_painter::pointcloud_painter_srv::Request &req)
+{
+	if(req.input_cloud_path.size() > 0 && !painterReadCloud(req.input_cloud_path, req.input_cloud))
+	{
+		ROS_ERROR_STREAM("[PainterCoordinator] Failed to read input cloud from " << req.input_cloud_path << " - it must be a binary PCD or binary little-endian PLY.");
+		return false;
+	}
+	if(req.compressed_image_list.size() < req.image_paths.size())
+		req.compressed_image_list.resize(req.image_paths.size());
+	for(int i=0; i<req.image_paths.size(); i++)
+	{
+		if(req.image_paths[i].size() > 0 && !painterReadImage(req.image_paths[i], req.compressed_image_list[i]))
+		{
+			ROS_ERROR_STREAM("[PainterCoordinator] Failed to read image from " << req.image_paths[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* splitIntoSectors - splits a cloud into azimuth sectors about its origin, with roughly equal numbers of points
+ 	Sector edges are placed at quantiles of a fine azimuth histogram, so dense and sparse parts of a scan cost the
+ 	workers about the same. Non-finite points are dropped. Each sector keeps the cloud's point order, and sector_sources
+ 	gives the index in depth_cloud of each of its points.
+*/
+bool PainterCoordinator::splitIntoSectors(std::vector<pcl::PointCloud<pcl::PointXYZI>::Ptr> &sectors, std::vector<std::vector<int> > &sector_sources, pcl::PointCloud<pcl::PointXYZI>::Ptr depth_cloud, int sector_count)
+{
+	std::vector<int> bin_counts(PAINTER_SECTOR_BINS, 0);
+	std::vector<int> point_bins(depth_cloud->points.size(), -1);
+	int valid_points = 0;
+	for(int i=0; i<depth_cloud->points.size(); i++)
+	{
+		const pcl::PointXYZI &point = depth_cloud->points[i];
+		if(!pcl_isfinite(point.x) || !pcl_isfinite(point.y) || !pcl_isfinite(point.z))
+			continue;
+		float azimuth = atan2(point.y, point.x);
+		int bin = std::min(int( (azimuth + M_PI) / (2*M_PI) * PAINTER_SECTOR_BINS ), PAINTER_SECTOR_BINS-1);
+		point_bins[i] = std::max(bin, 0);
+		bin_counts[point_bins[i]]++;
+		valid_points++;
+	}
+
+	// Assign each bin to a sector by the fraction of points which come before it
+	std::vector<int> bin_sectors(PAINTER_SECTOR_BINS, 0);
+	double preceding_points = 0;
+	for(int bin=0; bin<PAINTER_SECTOR_BINS; bin++)
+	{
+		if(valid_points > 0)
+			bin_sectors[bin] = std::min(int(preceding_points * sector_count / valid_points), sector_count-1);
+		preceding_points += bin_counts[bin];
+	}
+
+	sectors.clear();
+	sector_sources.assign(sector_count, std::vector<int>());
+	for(int s=0; s<sector_count; s++)
+	{
+		sectors.push_back(pcl::PointCloud<pcl::PointXYZI>::Ptr(new pcl::PointCloud<pcl::PointXYZI>()));
+		sectors[s]->points.reserve(valid_points / sector_count + 1);
+		sector_sources[s].reserve(valid_points / sector_count + 1);
+	}
+	for(int i=0; i<depth_cloud->points.size(); i++)
+		if(point_bins[i] >= 0)
+		{
+			sectors[bin_sectors[point_bins[i]]]->points.push_back(depth_cloud->points[i]);
+			sector_sources[bin_sectors[point_bins[i]]].push_back(i);
+		}
+	for(int s=0; s<sector_count; s++)
+	{
+		sectors[s]->width = sectors[s]->points.size();
+		sectors[s]->height = 1;
+	}
+	return true;
+}
+
+/* findImageRegion - looks up the lens model for an image in the registry, and runs its region finder */
+bool PainterCoordinator::findImageRegion(std::vector<int> &region, pcl::PointCloud<pcl::PointXYZI>::Ptr sector, const tf::StampedTransform &target_to_camera, int projection, const PainterLensParams &lens_params, int alignment)
+{
+	std::map<int, ImageRegionKernel>::iterator kernel = lens_kernels_.find(projection);
+	if(kernel == lens_kernels_.end())
+	{
+		ROS_ERROR_STREAM("[PainterCoordinator] No lens model registered for projection type " << projection);
+		region.clear();
+		return false;
+	}
+	return (this->*(kernel->second))(region, sector, target_to_camera, lens_params, alignment);
+}
+
+/* findImageRegionKernel - finds the pixel region of an image which sees a sector, using the lens' forward model
+ 	Projects (a sample of) the sector's points into the image, and takes their bounding box plus region_margin_,
+ 	aligned outward to a multiple of alignment pixels. region is returned as row offset, column offset, full height, full
+ 	width, region height, region width (all in full-resolution pixels). Returns false if no point lands in the image. Lenses
+ 	whose forward model fails painterLensRoundTrips (such as FLAT) get the whole image.
+*/
+template<typename Lens>
+bool PainterCoordinator::findImageRegionKernel(std::vector<int> &region, pcl::PointCloud<pcl::PointXYZI>::Ptr sector, const tf::StampedTransform &target_to_camera, const PainterLensParams &lens_params, int alignment)
+{
+	region.clear();
+	Lens lens;
+	if(!lens.setup(lens_params))
+		return false;
+	int image_hgt = lens_params.image_hgt;
+	int image_wdt = lens_params.image_wdt;
+	// Points can only be placed in the image by a forward model which inverts the lens' pixel model (see lens_models.h) -
+	//   otherwise the region found could be the wrong part of the image, so the image is sent whole
+	if(!painterLensRoundTrips(lens, lens_params))
+	{
+		ROS_WARN_THROTTLE(60, "[PainterCoordinator] Lens forward model doesn't invert its pixel model for a %d x %d image - sending it whole to every sector.", image_hgt, image_wdt);
+		int full_region[6] = {0, 0, image_hgt, image_wdt, image_hgt, image_wdt};
+		region.assign(full_region, full_region+6);
+		return true;
+	}
+
+	int stride = std::max(int(sector->points.size() / std::max(region_samples_, 1)), 1);
+	float row_min = image_hgt, row_max = -1;
+	float col_min = image_wdt, col_max = -1;
+	for(int i=0; i<sector->points.size(); i+=stride)
+	{
+		tf::Vector3 point = target_to_camera * tf::Vector3(sector->points[i].x, sector->points[i].y, sector->points[i].z);
+		double distance = point.length();
+		if(distance <= 0)
+			continue;
+		float row, col;
+		if(!lens.forward(point.x()/distance, point.y()/distance, point.z()/distance, image_hgt, image_wdt, row, col))
+			continue;
+		if(row < 0 || row >= image_hgt || col < 0 || col >= image_wdt)
+			continue;
+		row_min = std::min(row_min, row); 	row_max = std::max(row_max, row);
+		col_min = std::min(col_min, col); 	col_max = std::max(col_max, col);
+	}
+	if(row_max < 0)
+		return false;
+
+	int row_start = std::max(int(row_min) - region_margin_, 0);
+	int col_start = std::max(int(col_min) - region_margin_, 0);
+	row_start -= row_start % alignment;
+	col_start -= col_start % alignment;
+	int row_end = int(row_max) + 1 + region_margin_;
+	int col_end = int(col_max) + 1 + region_margin_;
+	row_end = std::min(row_end + (alignment - row_end % alignment) % alignment, image_hgt);
+	col_end = std::min(col_end + (alignment - col_end % alignment) % alignment, image_wdt);
+
+	region.push_back(row_start);
+	region.push_back(col_start);
+	region.push_back(image_hgt);
+	region.push_back(image_wdt);
+	region.push_back(row_end - row_start);
+	region.push_back(col_end - col_start);
+	return true;
+}
+
+/* cropImage - appends one image to a shard request, cropped to region (or whole, if region is empty)
+ 	Raw images are cropped here and sent as image_regions. Images which arrived compressed are passed on as they arrived,
+ 	with the region as image_crops, for the worker to crop once it has decoded them (at its reduced resolution).
+*/
+bool PainterCoordinator::cropImage(pointcloud_painter::pointcloud_painter_srv::Request &shard_req, pointcloud_painter::pointcloud_painter_srv::Request &req, int image, const cv::Mat &raw_image, int image_hgt, int image_wdt, const std::vector<int> &region)
+{
+	std::vector<int> full_region = region;
+	if(full_region.size() == 0)
+	{
+		full_region.push_back(0);
+		full_region.push_back(0);
+		full_region.push_back(image_hgt);
+		full_region.push_back(image_wdt);
+		full_region.push_back(image_hgt);
+		full_region.push_back(image_wdt);
+	}
+
+	// Both image lists (and both region lists) are kept the same length, so each image's entries line up with its settings
+	sensor_msgs::Image image_msg;
+	sensor_msgs::CompressedImage compressed_msg;
+	if( image < req.compressed_image_list.size() && req.compressed_image_list[image].data.size() > 0 )
+	{
+		compressed_msg = req.compressed_image_list[image];
+		for(int n=0; n<4; n++)
+			shard_req.image_regions.push_back(0);
+		shard_req.image_crops.push_back(full_region[0]);
+		shard_req.image_crops.push_back(full_region[1]);
+		shard_req.image_crops.push_back(full_region[4]);
+		shard_req.image_crops.push_back(full_region[5]);
+	}
+	else
+	{
+		cv::Mat cropped_image = raw_image(cv::Rect(full_region[1], full_region[0], full_region[5], full_region[4]));
+		cv_bridge::CvImage(req.image_list[image].header, req.image_list[image].encoding, cropped_image).toImageMsg(image_msg);
+		for(int n=0; n<4; n++)
+			shard_req.image_regions.push_back(full_region[n]);
+		for(int n=0; n<4; n++)
+			shard_req.image_crops.push_back(0);
+	}
+	shard_req.image_list.push_back(image_msg);
+	shard_req.compressed_image_list.push_back(compressed_msg);
+
+	shard_req.image_names.push_back(req.image_names[image]);
+	shard_req.projections.push_back(req.projections[image]);
+	shard_req.max_image_angles.push_back(req.max_image_angles[image]);
+	for(int n=0; n<PAINTER_LENS_PARAMETER_COUNT; n++)
+	{
+		int index = PAINTER_LENS_PARAMETER_COUNT*image + n;
+		shard_req.lens_parameters.push_back( (index < req.lens_parameters.size()) ? req.lens_parameters[index] : 0 );
+	}
+	shard_req.compress_images.push_back(req.compress_images[image]);
+	shard_req.image_compression_ratios.push_back(req.image_compression_ratios[image]);
+	shard_req.camera_frames.push_back(req.camera_frames[image]);
+	return true;
+}
+
+/* runWorker - sends each sector assigned to one worker (every worker_services_.size()-th, starting at worker) in turn
+ 	With a deadline, each sector gets an even share of the time left before dispatch_end among the sectors this worker
+ 	still has to send, so time saved (or overrun) on one sector carries over to the rest.
+*/
+void PainterCoordinator::runWorker(int worker, std::vector<pointcloud_painter::pointcloud_painter_srv> &shards, std::vector<int> &succeeded, ros::Time dispatch_end)
+{
+	ros::ServiceClient client = nh_.serviceClient<pointcloud_painter::pointcloud_painter_srv>(worker_services_[worker]);
+	for(int s=worker; s<shards.size(); s+=worker_services_.size())
+	{
+		if(shards[s].request.deadline > 0)
+		{
+			int sectors_left = (int(shards.size()) - 1 - s) / int(worker_services_.size()) + 1;
+			shards[s].request.deadline = std::max(float((dispatch_end - ros::Time::now()).toSec()) / sectors_left, 0.001f);
+		}
+		succeeded[s] = client.call(shards[s]);
+		if(!succeeded[s])
+			ROS_WARN_STREAM("[PainterCoordinator] Worker " << worker_services_[worker] << " failed to paint sector " << s);
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	ros::init(argc, argv, "painter_coordinator");
+
+	pcl::console::setVerbosityLevel(pcl::console::L_ALWAYS);
+
+	PainterCoordinator coordinator;
+}
@@ -0,0 +1,334 @@
+
+#include <ros/ros.h>
+#include "pointcloud_painter/pointcloud_painter.h"
+
+/* painter_sweep - offline tuning tool for the pointcloud_painter service
+ 	Loads one recorded scan (depth cloud + left/right images) from bag files, exactly as painter_client does, then
+ 	paints it once at full resolution as a reference and once for every combination of the swept parameters.
+ 	Each run is scored on runtime (painter's total_time), peak painter memory, and color error against the
+ 	reference paint. The Pareto-optimal runs are written out as ready-to-use param yaml files.
+*/
+
+// One combination of swept parameters, and how it performed
+struct SweepResult
+{
+	float flat_voxel_size; 			// 0 -> image voxelization off
+	float spherical_voxel_size; 	// 0 -> image voxelization off
+	bool voxelize_rgb_images; 		// Both image voxel sizes set - as requested, and as written to the param yaml
+	float depth_voxel_size; 		// 0 -> depth voxelization off
+	int image_compression_ratio; 	// 1 -> raster compression off
+	int neighbor_search_count;
+
+	bool succeeded;
+	double runtime; 				// s
+	double peak_memory_mb;
+	double color_error; 			// RMS RGB error per reference point (0-255), with unpainted points counted as 255
+	double coverage; 				// Fraction of reference points with a painted point within match_distance
+	bool pareto;
+};
+
+// Read the last message on a topic from a bag file
+template<typename MessageT>
+bool readFromBag(std::string bag_name, std::string topic, MessageT &message)
+{
+	rosbag::Bag bag;
+	try
+	{
+		bag.open(bag_name, rosbag::bagmode::Read);
+	}
+	catch(rosbag::BagException &e)
+	{
+		ROS_ERROR_STREAM("[PainterSweep] Failed to open bag " << bag_name << ": " << e.what());
+		return false;
+	}
+	std::vector<std::string> topics;
+	topics.push_back(topic);
+	rosbag::View view(bag, rosbag::TopicQuery(topics));
+	bool found = false;
+	BOOST_FOREACH(rosbag::MessageInstance const m, view)
+	{
+		typename MessageT::ConstPtr message_ptr = m.instantiate<MessageT>();
+		if(message_ptr != NULL)
+		{
+			message = *message_ptr;
+			found = true;
+		}
+	}
+	bag.close();
+	return found;
+}
+
+// Score a painted cloud against the reference paint
+//   For every reference point, the nearest candidate point within match_distance is found and their colors compared
+double scoreColorError(const sensor_msgs::PointCloud2 &candidate_msg, const sensor_msgs::PointCloud2 &reference_msg, float match_distance, double &coverage)
+{
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr candidate(new pcl::PointCloud<pcl::PointXYZRGB>());
+	pcl::PointCloud<pcl::PointXYZRGB> reference;
+	pcl::fromROSMsg(candidate_msg, *candidate);
+	pcl::fromROSMsg(reference_msg, reference);
+	coverage = 0;
+	if(reference.points.size() == 0)
+		return 0;
+	if(candidate->points.size() == 0)
+		return 255;
+
+	pcl::KdTreeFLANN<pcl::PointXYZRGB> kdtree;
+	kdtree.setInputCloud(candidate);
+	std::vector<int> nearest_index(1);
+	std::vector<float> nearest_dist_squared(1);
+	double squared_error_sum = 0;
+	int matched = 0;
+	for(int i=0; i<reference.points.size(); i++)
+	{
+		if( kdtree.nearestKSearch(reference.points[i], 1, nearest_index, nearest_dist_squared) > 0 && nearest_dist_squared[0] < match_distance*match_distance )
+		{
+			const pcl::PointXYZRGB &match = candidate->points[nearest_index[0]];
+			float dr = float(match.r) - reference.points[i].r;
+			float dg = float(match.g) - reference.points[i].g;
+			float db = float(match.b) - reference.points[i].b;
+			squared_error_sum += (dr*dr + dg*dg + db*db) / 3;
+			matched++;
+		}
+		else
+			squared_error_sum += 255*255;
+	}
+	coverage = double(matched) / reference.points.size();
+	return sqrt(squared_error_sum / reference.points.size());
+}
+
+// True if a is at least as good as b in every objective and strictly better in one
+bool dominates(const SweepResult &a, const SweepResult &b)
+{
+	bool no_worse = a.runtime <= b.runtime && a.peak_memory_mb <= b.peak_memory_mb && a.color_error <= b.color_error;
+	bool better = a.runtime < b.runtime || a.peak_memory_mb < b.peak_memory_mb || a.color_error < b.color_error;
+	return no_worse && better;
+}
+
+// Write a param yaml file: every scalar setting currently under /pointcloud_painter, with the swept ones replaced
+bool writeParamYaml(std::string file_name, XmlRpc::XmlRpcValue base_params, const SweepResult &result)
+{
+	std::ofstream file(file_name.c_str());
+	if(!file.is_open())
+		return false;
+
+	std::map<std::string, std::string> overrides;
+	std::ostringstream value;
+	value << result.neighbor_search_count; 		overrides["neighbor_search_count"] = value.str(); 	value.str("");
+	value << (result.depth_voxel_size > 0 ? "true" : "false"); 	overrides["voxelize_depth_cloud"] = value.str(); 	value.str("");
+	value << result.depth_voxel_size; 			overrides["depth_voxel_size"] = value.str(); 		value.str("");
+	value << (result.voxelize_rgb_images ? "true" : "false"); 	overrides["voxelize_rgb_images"] = value.str(); 	value.str("");
+	value << result.flat_voxel_size; 			overrides["flat_voxel_size"] = value.str(); 		value.str("");
+	value << result.spherical_voxel_size; 		overrides["spherical_voxel_size"] = value.str(); 	value.str("");
+	value << (result.image_compression_ratio > 1 ? "true" : "false"); 	overrides["compress_image"] = value.str(); 	value.str("");
+	value << result.image_compression_ratio; 	overrides["image_compression_ratio"] = value.str(); value.str("");
+
+	file << "# Generated by painter_sweep - runtime " << result.runtime << " s, peak memory " << result.peak_memory_mb << " MB, "
+		 << "color error " << result.color_error << " (RMS, 0-255), coverage " << result.coverage << std::endl;
+	file << "pointcloud_painter:" << std::endl;
+	for(std::map<std::string, std::string>::iterator it = overrides.begin(); it != overrides.end(); it++)
+		file << "  " << it->first << ": " << it->second << std::endl;
+	if(base_params.getType() == XmlRpc::XmlRpcValue::TypeStruct)
+		for(XmlRpc::XmlRpcValue::iterator it = base_params.begin(); it != base_params.end(); it++)
+		{
+			if(overrides.count(it->first) > 0)
+				continue;
+			XmlRpc::XmlRpcValue &param = it->second;
+			switch(param.getType())
+			{
+				case XmlRpc::XmlRpcValue::TypeBoolean: 	file << "  " << it->first << ": " << (bool(param) ? "true" : "false") << std::endl; 	break;
+				case XmlRpc::XmlRpcValue::TypeInt: 		file << "  " << it->first << ": " << int(param) << std::endl; 						break;
+				case XmlRpc::XmlRpcValue::TypeDouble: 	file << "  " << it->first << ": " << double(param) << std::endl; 					break;
+				case XmlRpc::XmlRpcValue::TypeString: 	file << "  " << it->first << ": \"" << std::string(param) << "\"" << std::endl; 	break;
+				default: 	break; 		// nested settings (such as the sweep itself) are not needed to run the painter
+			}
+		}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	// ---------------------------------------------------------------------------
+	// ----------------------------- Basic ROS Stuff -----------------------------
+	// ---------------------------------------------------------------------------
+
+	ros::init(argc, argv, "painter_sweep");
+
+	ros::NodeHandle nh;
+
+	std::string service_name;
+	nh.param<std::string>("/pointcloud_painter/service_name", service_name, "/pointcloud_painter/paint");
+	ros::ServiceClient painter_srv = nh.serviceClient<pointcloud_painter::pointcloud_painter_srv>(service_name);
+
+	// ------ Fixed Settings (as in painter_client) ------
+	float max_lens_angle;
+	nh.param<float>("/pointcloud_painter/max_lens_angle", max_lens_angle, 235);
+	int projection_type;
+	nh.param<int>("/pointcloud_painter/projection_type", projection_type, PAINTER_PROJ_EQUA_STEREO);
+	bool color_onto_depth;
+	nh.param<bool>("/pointcloud_painter/color_onto_depth", color_onto_depth, false);
+	int reference_neighbor_count;
+	nh.param<int>("/pointcloud_painter/neighbor_search_count", reference_neighbor_count, 3);
+
+	std::string camera_frame_left, camera_frame_right, target_frame;
+	nh.param<std::string>("/pointcloud_painter/camera_frame_left", camera_frame_left, "left_camera_frame");
+	nh.param<std::string>("/pointcloud_painter/camera_frame_right", camera_frame_right, "right_camera_frame");
+	nh.param<std::string>("/pointcloud_painter/target_frame", target_frame, "target_frame");
+
+	std::string left_bag_topic, right_bag_topic, cloud_bag_topic;
+	nh.param<std::string>("/pointcloud_painter/left_image_topic", left_bag_topic, "/camera1/usb_cam1/image_raw");
+	nh.param<std::string>("/pointcloud_painter/right_image_topic", right_bag_topic, "/camera1/usb_cam1/image_raw");
+	nh.param<std::string>("/pointcloud_painter/depth_cloud_topic", cloud_bag_topic, "/laser_stitcher/local_dense_cloud");
+
+	std::string left_bag_name, right_bag_name, cloud_bag_name;
+	nh.param<std::string>("/pointcloud_painter/bag_name_left", left_bag_name, "");
+	nh.param<std::string>("/pointcloud_painter/bag_name_right", right_bag_name, "");
+	nh.param<std::string>("/pointcloud_painter/bag_name_depth", cloud_bag_name, "");
+
+	// ------ Swept Settings ------
+	std::vector<float> default_flat_sizes, default_spherical_sizes, default_depth_sizes;
+	std::vector<int> default_ratios, default_neighbor_counts;
+	default_flat_sizes.push_back(0.0025);
+	default_spherical_sizes.push_back(0); 		default_spherical_sizes.push_back(0.002); 	default_spherical_sizes.push_back(0.005);
+	default_depth_sizes.push_back(0); 			default_depth_sizes.push_back(0.01); 		default_depth_sizes.push_back(0.05);
+	default_ratios.push_back(1); 	default_ratios.push_back(2); 	default_ratios.push_back(4); 	default_ratios.push_back(8);
+	default_neighbor_counts.push_back(1); 		default_neighbor_counts.push_back(3);
+	std::vector<float> flat_voxel_sizes, spherical_voxel_sizes, depth_voxel_sizes;
+	std::vector<int> image_compression_ratios, neighbor_search_counts;
+	nh.param<std::vector<float> >("/pointcloud_painter/sweep/flat_voxel_sizes", flat_voxel_sizes, default_flat_sizes);
+	nh.param<std::vector<float> >("/pointcloud_painter/sweep/spherical_voxel_sizes", spherical_voxel_sizes, default_spherical_sizes);
+	nh.param<std::vector<float> >("/pointcloud_painter/sweep/depth_voxel_sizes", depth_voxel_sizes, default_depth_sizes);
+	nh.param<std::vector<int> >("/pointcloud_painter/sweep/image_compression_ratios", image_compression_ratios, default_ratios);
+	nh.param<std::vector<int> >("/pointcloud_painter/sweep/neighbor_search_counts", neighbor_search_counts, default_neighbor_counts);
+	// Max distance (m) between a painted point and a reference point for them to be compared
+	float match_distance;
+	nh.param<float>("/pointcloud_painter/sweep/match_distance", match_distance, 0.02);
+	// Pareto-optimal settings are written to <output_prefix>_<n>.yaml
+	std::string output_prefix;
+	nh.param<std::string>("/pointcloud_painter/sweep/output_prefix", output_prefix, "painter_sweep_pareto");
+
+	XmlRpc::XmlRpcValue base_params;
+	nh.getParam("/pointcloud_painter", base_params);
+
+	// ---------------------------------------------------------------------------
+	// ------------------------ Extract Data from ROSBAGs ------------------------
+	// ---------------------------------------------------------------------------
+
+	ROS_INFO_STREAM("[PainterSweep] Loading data from bag files....");
+	sensor_msgs::PointCloud2 pointcloud;
+	sensor_msgs::Image left_image, right_image;
+	if( !readFromBag(cloud_bag_name, cloud_bag_topic, pointcloud) || !readFromBag(left_bag_name, left_bag_topic, left_image) || !readFromBag(right_bag_name, right_bag_topic, right_image) )
+	{
+		ROS_ERROR_STREAM("[PainterSweep] Failed to load the depth cloud and both images from bag files - exiting.");
+		return -1;
+	}
+
+	// -------- Set up service object (fixed fields) --------
+	pointcloud_painter::pointcloud_painter_srv srv;
+	srv.request.input_cloud = pointcloud;
+	srv.request.image_list.push_back(left_image);
+	srv.request.image_list.push_back(right_image);
+	srv.request.image_names.push_back("left_image");
+	srv.request.image_names.push_back("right_image");
+	srv.request.projections.push_back(projection_type);
+	srv.request.projections.push_back(projection_type);
+	srv.request.max_image_angles.push_back(max_lens_angle);
+	srv.request.max_image_angles.push_back(max_lens_angle);
+	srv.request.color_onto_depth = color_onto_depth;
+	srv.request.compress_images.resize(2);
+	srv.request.image_compression_ratios.resize(2);
+	srv.request.camera_frames.push_back(camera_frame_left);
+	srv.request.camera_frames.push_back(camera_frame_right);
+	srv.request.target_frame = target_frame;
+	// Every run starts from an empty buffer pool, so its peak memory isn't inflated by buffers kept from the (larger)
+	//   reference paint or the runs before it
+	srv.request.release_buffers_first = true;
+
+	painter_srv.waitForExistence();
+
+	// ---------------------------------------------------------------------------
+	// ------------------------------ Reference Paint ----------------------------
+	// ---------------------------------------------------------------------------
+	// Full resolution - no raster compression and no voxelization
+	srv.request.compress_images[0] = srv.request.compress_images[1] = false;
+	srv.request.image_compression_ratios[0] = srv.request.image_compression_ratios[1] = 1;
+	srv.request.voxelize_rgb_images = false;
+	srv.request.voxelize_depth_cloud = false;
+	srv.request.neighbor_search_count = reference_neighbor_count;
+	if( !painter_srv.call(srv) )
+	{
+		ROS_ERROR_STREAM("[PainterSweep] Reference painting call failed - exiting.");
+		return -1;
+	}
+	sensor_msgs::PointCloud2 reference_cloud = srv.response.output_cloud;
+	ROS_INFO_STREAM("[PainterSweep] Reference paint: " << reference_cloud.width*reference_cloud.height << " points in " << srv.response.total_time << " s, peak memory " << srv.response.peak_memory_mb << " MB.");
+
+	// ---------------------------------------------------------------------------
+	// ----------------------------------- Sweep ---------------------------------
+	// ---------------------------------------------------------------------------
+	std::vector<SweepResult> results;
+	for(int a=0; a<flat_voxel_sizes.size(); a++)
+	for(int b=0; b<spherical_voxel_sizes.size(); b++)
+	for(int c=0; c<depth_voxel_sizes.size(); c++)
+	for(int d=0; d<image_compression_ratios.size(); d++)
+	for(int e=0; e<neighbor_search_counts.size() && ros::ok(); e++)
+	{
+		SweepResult result;
+		result.flat_voxel_size = flat_voxel_sizes[a];
+		result.spherical_voxel_size = spherical_voxel_sizes[b];
+		result.voxelize_rgb_images = (result.spherical_voxel_size > 0 && result.flat_voxel_size > 0);
+		result.depth_voxel_size = depth_voxel_sizes[c];
+		result.image_compression_ratio = std::max(image_compression_ratios[d], 1);
+		result.neighbor_search_count = neighbor_search_counts[e];
+		result.pareto = false;
+
+		srv.request.compress_images[0] = srv.request.compress_images[1] = (result.image_compression_ratio > 1);
+		srv.request.image_compression_ratios[0] = srv.request.image_compression_ratios[1] = result.image_compression_ratio;
+		srv.request.voxelize_rgb_images = result.voxelize_rgb_images;
+		srv.request.flat_voxel_size = result.flat_voxel_size;
+		srv.request.spherical_voxel_size = result.spherical_voxel_size;
+		srv.request.voxelize_depth_cloud = (result.depth_voxel_size > 0);
+		srv.request.depth_voxel_size = result.depth_voxel_size;
+		srv.request.neighbor_search_count = result.neighbor_search_count;
+
+		result.succeeded = painter_srv.call(srv);
+		if(!result.succeeded)
+		{
+			ROS_WARN_STREAM("[PainterSweep] Painting call failed for run " << results.size() << " - skipping it.");
+			results.push_back(result);
+			continue;
+		}
+		result.runtime = srv.response.total_time;
+		result.peak_memory_mb = srv.response.peak_memory_mb;
+		result.color_error = scoreColorError(srv.response.output_cloud, reference_cloud, match_distance, result.coverage);
+		ROS_INFO_STREAM("[PainterSweep] Run " << results.size() << ": flat " << result.flat_voxel_size << " spherical " << result.spherical_voxel_size << " depth " << result.depth_voxel_size
+			<< " ratio " << result.image_compression_ratio << " k " << result.neighbor_search_count << " -> " << result.runtime << " s, " << result.peak_memory_mb << " MB, color error " << result.color_error << ", coverage " << result.coverage);
+		results.push_back(result);
+	}
+
+	// ---------------------------------------------------------------------------
+	// ------------------------------- Pareto Front ------------------------------
+	// ---------------------------------------------------------------------------
+	int pareto_count = 0;
+	for(int i=0; i<results.size(); i++)
+	{
+		if(!results[i].succeeded)
+			continue;
+		results[i].pareto = true;
+		for(int j=0; j<results.size() && results[i].pareto; j++)
+			if(j != i && results[j].succeeded && dominates(results[j], results[i]))
+				results[i].pareto = false;
+		if(!results[i].pareto)
+			continue;
+
+		std::ostringstream file_name;
+		file_name << output_prefix << "_" << pareto_count << ".yaml";
+		if(writeParamYaml(file_name.str(), base_params, results[i]))
+			ROS_INFO_STREAM("[PainterSweep] Pareto-optimal: " << results[i].runtime << " s, " << results[i].peak_memory_mb << " MB, color error " << results[i].color_error << " -> " << file_name.str());
+		else
+			ROS_ERROR_STREAM("[PainterSweep] Failed to write " << file_name.str());
+		pareto_count++;
+	}
+	ROS_INFO_STREAM("[PainterSweep] Finished - " << pareto_count << " Pareto-optimal settings out of " << results.size() << " runs.");
+
+	return 0;
+}
@@ -4,12 +4,63 @@
 
 PointcloudPainter::PointcloudPainter()
 {
+	// ------ Lens Model Registry ------
+	//   Each projection type maps to a pixel loop specialized on its lens policy (see lens_models.h)
+	lens_kernels_[PAINTER_PROJ_EQUA_STEREO] = &PointcloudPainter::buildImageCloudsKernel<PainterLensEquaStereo>;
+	lens_kernels_[PAINTER_PROJ_POLE_STEREO] = &PointcloudPainter::buildImageCloudsKernel<PainterLensPoleStereo>;
+	lens_kernels_[PAINTER_PROJ_EQUAL_AREA] = &PointcloudPainter::buildImageCloudsKernel<PainterLensEqualArea>;
+	lens_kernels_[PAINTER_PROJ_FLAT] = &PointcloudPainter::buildImageCloudsKernel<PainterLensFlat>;
+	lens_kernels_[PAINTER_PROJ_EQUIDISTANT] = &PointcloudPainter::buildImageCloudsKernel<PainterLensEquidistant>;
+	lens_kernels_[PAINTER_PROJ_KANNALA_BRANDT] = &PointcloudPainter::buildImageCloudsKernel<PainterLensKannalaBrandt>;
+
+	// Service names may be overridden per node (private params), so several painters can run as workers for painter_coordinator
+	ros::NodeHandle private_nh("~");
 	std::string service_name;
 	nh_.param<std::string>("/pointcloud_painter/service_name", service_name, "/pointcloud_painter/paint");
+	private_nh.param<std::string>("service_name", service_name, service_name);
 	ROS_INFO_STREAM("[PointcloudPainter] Initializing service with name " << service_name << ".");
 
 	ros::ServiceServer painter = nh_.advertiseService(service_name, &PointcloudPainter::paintPointcloud, this);
 
+	// ------ Memory Budget ------
+	nh_.param<float>("/pointcloud_painter/memory_budget_mb", memory_budget_mb_, 0);
+
+	// ------ Preprocessing ------
+	nh_.param<int>("/pointcloud_painter/preprocessing_threads", preprocessing_threads_, 0);
+
+	// ------ Referenced Inputs ------
+	input_cloud_points_ = NULL;
+
+	// ------ Anytime Painting ------
+	deadline_checks_enabled_ = true;
+
+	// ------ Persistent Voxel Map ------
+	std::string voxel_map_service_name;
+	nh_.param<std::string>("/pointcloud_painter/voxel_map_service_name", voxel_map_service_name, "/pointcloud_painter/voxel_map");
+	private_nh.param<std::string>("voxel_map_service_name", voxel_map_service_name, voxel_map_service_name);
+	nh_.param<std::string>("/pointcloud_painter/voxel_map_frame", voxel_map_frame_, "map");
+	nh_.param<float>("/pointcloud_painter/voxel_map_size", voxel_map_size_, 0.01);
+	voxel_map_shots_ = 0;
+	ros::ServiceServer voxel_map = nh_.advertiseService(voxel_map_service_name, &PointcloudPainter::queryVoxelMap, this);
+
+	// ------ Painted Map Store ------
+	std::string map_store_directory, map_store_service_name;
+	float map_store_tile_size;
+	nh_.param<std::string>("/pointcloud_painter/map_store_directory", map_store_directory, "");
+	private_nh.param<std::string>("map_store_directory", map_store_directory, map_store_directory);
+	nh_.param<float>("/pointcloud_painter/map_store_tile_size", map_store_tile_size, 10.0);
+	nh_.param<std::string>("/pointcloud_painter/map_store_frame", map_store_frame_, "map");
+	nh_.param<std::string>("/pointcloud_painter/map_store_service_name", map_store_service_name, "/pointcloud_painter/map_store");
+	private_nh.param<std::string>("map_store_service_name", map_store_service_name, map_store_service_name);
+	if(map_store_directory.size() > 0)
+	{
+		if(map_store_.open(map_store_directory, map_store_tile_size))
+			ROS_INFO_STREAM("[PointcloudPainter] Opened map store " << map_store_directory << " - " << map_store_.tileCount() << " tiles of " << map_store_.tileSize() << " m, " << map_store_.pointCount() << " points.");
+		else
+			ROS_ERROR_STREAM("[PointcloudPainter] Failed to open map store " << map_store_directory << " - painted points will not be archived.");
+	}
+	ros::ServiceServer map_store = nh_.advertiseService(map_store_service_name, &PointcloudPainter::queryMapStore, this);
+
 	ros::spin();
 }
 
@@ -24,158 +75,571 @@ bool PointcloudPainter::paintPointcloud(pointcloud_painter::pointcloud_painter_s
 {
 
 	ROS_INFO_STREAM("[PointcloudPainter] Received call to paint pointcloud!");
+	// Inputs passed by path (file or shared memory) are mapped in here, and the rest of the call works as if they were embedded
+	if(!loadReferencedInputs(req))
+	{
+		releaseReferencedInputs();
+		return false;
+	}
+	// A fresh pool, so that the peak memory measured over this call isn't inflated by buffers sized for earlier calls
+	if(req.release_buffers_first)
+		buffer_pool_ = PainterBufferPool();
+
+	bool painted;
+	if(req.deadline > 0)
+		painted = paintAnytime(req, res);
+	else
+	{
+		res.achieved_level = 0;
+		res.achieved_image_scale = 1;
+		res.achieved_depth_fraction = 1;
+		res.completed_levels = 1;
+		painted = paintAtLevel(req, res, 0);
+	}
+	releaseReferencedInputs();
+	return painted;
+}
+
+/* paintAnytime - paints within req.deadline seconds, coarse to fine
+ 	Starts at level anytime_levels (images and depth cloud reduced as in paintAtLevel) and works toward level 0, full
+ 	resolution. Every completed level is published on final_cloud as it finishes, so viewers see a complete coarse
+ 	result early which then sharpens. A level is only started if, scaling from the last one (each level has about 4x 
+ 	the work of the one above it), it should finish in time; one which runs past the deadline anyway is abandoned 
+ 	at its next deadline check (in preprocessing or painting). The coarsest level is always painted to completion, even
+ 	past the deadline, so there is always a result to return. The response is that of the finest completed level.
+ 	Voxel map fusion, map store archiving, panorama and LOD outputs are only produced by the full-resolution level.
+*/
+bool PointcloudPainter::paintAnytime(pointcloud_painter::pointcloud_painter_srv::Request &req, pointcloud_painter::pointcloud_painter_srv::Response &res)
+{
+	ros::WallTime start_time = ros::WallTime::now();
+	deadline_ = start_time + ros::WallDuration(req.deadline);
+	int coarsest_level = (req.anytime_levels > 0) ? req.anytime_levels : 3;
+	bool fuse_into_voxel_map = req.fuse_into_voxel_map;
+	bool store_in_map = req.store_in_map;
+	bool output_panorama = req.output_panorama;
+	bool build_lod = req.build_lod;
+
+	int completed_levels = 0;
+	double last_pass_time = 0;
+	for(int level=coarsest_level; level>=0; level--)
+	{
+		// The coarsest level always runs, so there is something to return
+		double remaining = (deadline_ - ros::WallTime::now()).toSec();
+		if(completed_levels > 0 && last_pass_time*4 > remaining)
+		{
+			ROS_INFO_STREAM("[PointcloudPainter] Stopping anytime painting at level " << level+1 << " - level " << level << " would take about " << last_pass_time*4 << " s, with " << remaining << " s left.");
+			break;
+		}
+		req.fuse_into_voxel_map = fuse_into_voxel_map && level == 0;
+		req.store_in_map = store_in_map && level == 0;
+		req.output_panorama = output_panorama && level == 0;
+		req.build_lod = build_lod && level == 0;
+
+		ros::WallTime pass_start = ros::WallTime::now();
+		pointcloud_painter::pointcloud_painter_srv::Response pass_res;
+		// (no deadline checks until the coarsest level is done)
+		deadline_checks_enabled_ = (completed_levels > 0);
+		bool pass_completed = paintAtLevel(req, pass_res, level);
+		deadline_checks_enabled_ = true;
+		if(!pass_completed)
+		{
+			if(completed_levels == 0)
+			{
+				ROS_ERROR_STREAM("[PointcloudPainter] The coarsest anytime level (" << level << ") could not be painted - rejecting paint request.");
+				deadline_ = ros::WallTime();
+				req.fuse_into_voxel_map = fuse_into_voxel_map;
+				req.store_in_map = store_in_map;
+				req.output_panorama = output_panorama;
+				req.build_lod = build_lod;
+				return false;
+			}
+			ROS_WARN_STREAM("[PointcloudPainter] Anytime level " << level << " did not finish before the deadline - returning level " << level+1 << ".");
+			break;
+		}
+		last_pass_time = (ros::WallTime::now() - pass_start).toSec();
+		completed_levels++;
+		std::swap(res, pass_res);
+		res.achieved_level = level;
+		res.achieved_image_scale = 1.0 / (1 << level);
+		res.achieved_depth_fraction = 1.0 / (1 << 2*level);
+		ROS_INFO_STREAM("[PointcloudPainter] Painted anytime level " << level << " in " << last_pass_time << " s (" << (ros::WallTime::now() - start_time).toSec() << " s of " << req.deadline << " s used).");
+	}
+	res.completed_levels = completed_levels;
+	res.total_time = (ros::WallTime::now() - start_time).toSec();
+
+	deadline_ = ros::WallTime();
+	req.fuse_into_voxel_map = fuse_into_voxel_map;
+	req.store_in_map = store_in_map;
+	req.output_panorama = output_panorama;
+	req.build_lod = build_lod;
+	return true;
+}
+
+// deadlinePassed - whether an anytime paint has run out of time (never, outside of paintAnytime)
+bool PointcloudPainter::deadlinePassed()
+{
+	return deadline_checks_enabled_ && !deadline_.isZero() && ros::WallTime::now() > deadline_;
+}
+
+/* paintAtLevel - one complete paint of the request, with images and depth cloud reduced by level
+ 	At level L each image is compressed a further 2^L per side and every 4^L-th depth point is used (level 0 -> the 
+ 	request as given). Fails if an anytime deadline passes while preprocessing or painting.
+*/
+bool PointcloudPainter::paintAtLevel(pointcloud_painter::pointcloud_painter_srv::Request &req, pointcloud_painter::pointcloud_painter_srv::Response &res, int level)
+{
 	ROS_INFO_STREAM("[PointcloudPainter]   Input cloud size: " << req.input_cloud.height*req.input_cloud.width);
-	for(int i=0; i<req.image_list.size(); i++)
+	// Images can arrive either raw (image_list) or compressed (compressed_image_list) - compressed entries take precedence where both are given
+	int image_count = std::max(req.image_list.size(), req.compressed_image_list.size());
+	std::vector<bool> image_is_compressed(image_count, false);
+	for(int i=0; i<image_count; i++)
 	{
-		ROS_INFO_STREAM("[PointcloudPainter]   " << req.image_names[i] << " image size: " << req.image_list[i].height << " by " << req.image_list[i].width);
+		image_is_compressed[i] = ( i < req.compressed_image_list.size() && req.compressed_image_list[i].data.size() > 0 );
+		if(image_is_compressed[i])
+			ROS_INFO_STREAM("[PointcloudPainter]   " << req.image_names[i] << " compressed image (" << req.compressed_image_list[i].format << "), " << req.compressed_image_list[i].data.size() << " bytes");
+		else
+			ROS_INFO_STREAM("[PointcloudPainter]   " << req.image_names[i] << " image size: " << req.image_list[i].height << " by " << req.image_list[i].width);
 	}
 	
 	ros::Time start_time = ros::Time::now();
 	ros::Duration time_elapsed;
+	resetPeakMemory();
 
-	// Publish the Input Depth Cloud (sensor_msgs/PointCloud2)
-	ros::Publisher pub_input_depth = nh_.advertise<sensor_msgs::PointCloud2>("input_depth_cloud", 1, this);
-	pub_input_depth.publish(req.input_cloud);
-	// Publish the Input Imagery (sensor_msgs/Image)
-	ros::Publisher pub_input_left_image = nh_.advertise<sensor_msgs::Image>("input_imagery_left", 1, this);
-	pub_input_left_image.publish(req.image_list[0]);
-	ros::Publisher pub_input_right_image = nh_.advertise<sensor_msgs::Image>("input_imagery_right", 1, this);
-	pub_input_right_image.publish(req.image_list[1]);
+	// ------ Memory Budget ------
+	// Effective raster compression per image (may be raised below to fit the budget)
+	std::vector<int> compression_ratios(image_count, 1);
+	for(int i=0; i<image_count; i++)
+		if(req.compress_images[i])
+			compression_ratios[i] = std::max(int(req.image_compression_ratios[i]), 1);
+	// Coarser levels (anytime painting) reduce the imagery a further factor of two per side, and the depth cloud to match
+	for(int i=0; i<image_count; i++)
+		compression_ratios[i] <<= level;
+	size_t depth_stride = size_t(1) << 2*level;
+
+	// ------ Region of Interest ------
+	//   Depth points and image pixels outside it are dropped as they are first read, before voxelization or any index is built
+	PainterRegionOfInterest roi;
+	if(!roi.setup(req.roi_box, req.roi_window))
+	{
+		ROS_ERROR_STREAM("[PointcloudPainter] Rejecting paint request - roi_box needs 10 values (center, half sizes, quaternion) and roi_window 4 (azimuth min/max, elevation min <= max); got " << req.roi_box.size() << " and " << req.roi_window.size() << ".");
+		return false;
+	}
+	const PainterRegionOfInterest *active_roi = roi.active() ? &roi : NULL;
+	// Low-footprint mode: skip debug cloud output and give all pooled memory back after the call
+	bool low_footprint = false;
+	res.estimated_memory_mb = estimateMemoryMB(req, compression_ratios, low_footprint);
+	if(memory_budget_mb_ > 0 && res.estimated_memory_mb > memory_budget_mb_)
+	{
+		low_footprint = true;
+		res.estimated_memory_mb = estimateMemoryMB(req, compression_ratios, low_footprint);
+		// Coarsen the imagery a step at a time, stopping at the smallest ratio which fits - up to the JPEG DCT limit of 8,
+		//   and only through divisors of 8x the requested ratio, so that regions cropped by a coordinator stay aligned
+		std::vector<int> requested_ratios(image_count);
+		for(int i=0; i<image_count; i++)
+			requested_ratios[i] = compression_ratios[i] >> level;
+		bool can_reduce = true;
+		while(res.estimated_memory_mb > memory_budget_mb_ && can_reduce)
+		{
+			can_reduce = false;
+			for(int i=0; i<image_count; i++)
+				for(int ratio=compression_ratios[i]+1; ratio<=8; ratio++)
+					if((8*requested_ratios[i]) % ratio == 0)
+					{
+						compression_ratios[i] = ratio;
+						can_reduce = true;
+						break;
+					}
+			res.estimated_memory_mb = estimateMemoryMB(req, compression_ratios, low_footprint);
+		}
+		if(res.estimated_memory_mb > memory_budget_mb_)
+		{
+			ROS_ERROR_STREAM("[PointcloudPainter] Rejecting paint request - estimated memory use of " << res.estimated_memory_mb << " MB exceeds the budget of " << memory_budget_mb_ << " MB even in low-footprint mode.");
+			releaseBuffers(true);
+			return false;
+		}
+		ROS_WARN_STREAM("[PointcloudPainter] Request exceeds memory budget of " << memory_budget_mb_ << " MB - switching to low-footprint mode, estimated " << res.estimated_memory_mb << " MB.");
+	}
+	res.reduced_footprint = low_footprint;
 
-	// ----------------------------------------------------------------------------------
-	// ------------------------------- SET UP DEPTH CLOUD -------------------------------
-	// ----------------------------------------------------------------------------------
-	
-	// ------ Transform input_cloud (depth information) to camera_frame ------
-	std::string cloud_frame = req.input_cloud.header.frame_id;
-	sensor_msgs::PointCloud2 transformed_depth_cloud;
-	if(camera_frame_listener_.waitForTransform(cloud_frame, req.target_frame, ros::Time(0), ros::Duration(0.5)))  
+	// Publish the Input Depth Cloud (sensor_msgs/PointCloud2) - unless it is still mapped, since it was given by path to avoid the copy
+	if(input_cloud_points_ == NULL)
 	{
-		tf::StampedTransform transform;
-		camera_frame_listener_.lookupTransform(req.target_frame, cloud_frame, ros::Time(0), transform);
-		pcl_ros::transformPointCloud(req.target_frame, transform, req.input_cloud, transformed_depth_cloud);
+		ros::Publisher pub_input_depth = nh_.advertise<sensor_msgs::PointCloud2>("input_depth_cloud", 1, this);
+		pub_input_depth.publish(req.input_cloud);
 	}
-	else 
-	{  													// if Transform request times out... Continues WITHOUT TRANSFORM
-		ROS_WARN_THROTTLE(60, "[PointcloudPainter] listen for transformation from %s to %s timed out. Defaulting to initial location of input cloud...", cloud_frame.c_str(), req.target_frame.c_str());
-		transformed_depth_cloud = req.input_cloud;
+	// Publish the Input Imagery (sensor_msgs/Image, or sensor_msgs/CompressedImage on the /compressed subtopic)
+	std::string input_image_topics[2] = {"input_imagery_left", "input_imagery_right"};
+	for(int i=0; i<image_count && i<2; i++)
+	{
+		if(image_is_compressed[i])
+		{
+			ros::Publisher pub_input_image = nh_.advertise<sensor_msgs::CompressedImage>(input_image_topics[i] + "/compressed", 1, this);
+			pub_input_image.publish(req.compressed_image_list[i]);
+		}
+		else
+		{
+			ros::Publisher pub_input_image = nh_.advertise<sensor_msgs::Image>(input_image_topics[i], 1, this);
+			pub_input_image.publish(req.image_list[i]);
+		}
 	}
-	time_elapsed = ros::Time::now() - start_time;
-	ROS_DEBUG_STREAM("transformed input cloud " << time_elapsed);
+
+	// ----------------------------------------------------------------------------------
+	// -------------------------------- PREPROCESSING -----------------------------------
+	// ----------------------------------------------------------------------------------
+	//   The depth cloud and each image are independent until painting, so each is prepared in its own branch of a task
+	//   graph, run concurrently on a work-stealing pool (see task_graph.h):
+	//     depth_transform -> depth_sphere
+	//     <image>_decode -> <image>_clouds 		(one chain per image)
+	//   Each branch only touches its own pooled buffers; the image clouds are merged in image order afterwards.
+	PainterTaskGraph preprocessing(preprocessing_threads_);
 
 	// ------ Create PCL Pointclouds ------
-	pcl::PointCloud<pcl::PointXYZI>::Ptr input_depth_pcl(new pcl::PointCloud<pcl::PointXYZI>());
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr output_pcl(new pcl::PointCloud<pcl::PointXYZRGB>());
-	pcl::fromROSMsg(transformed_depth_cloud, *input_depth_pcl); 	// Initialize input cloud 
-	ROS_DEBUG_STREAM("Transformed: " << transformed_depth_cloud.height << " " << transformed_depth_cloud.width << " " << input_depth_pcl->points.size());
-	
-	// ------ Voxelize Input Depth Cloud ------
-	if(req.voxelize_depth_cloud)
+	//   (all working clouds are taken from the node's buffer pool, rather than allocated fresh each call)
+	pcl::PointCloud<pcl::PointXYZI>::Ptr input_depth_pcl = buffer_pool_.input_depth.acquire();
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr output_pcl = buffer_pool_.output.acquire();
+	PainterSphereIndex<PainterSphereDepth> &depth_sphere = buffer_pool_.depth_sphere;
+	pcl::PointCloud<pcl::PointXYZI>::Ptr input_pcl_projected_intensity = buffer_pool_.depth_projected_intensity.acquire(); 
+
+	// ------ Transform input_cloud (depth information) to camera_frame ------
+	//   Where the message layout allows, one fused pass (see depth_kernel.h) reads the points straight out of the request,
+	//   transforms them, drops NaN / zero-range points and writes the spheres; voxelization needs the transformed cloud
+	//   first, so then the spheres are written in a second pass (as they are for layouts the kernel can't read)
+	bool depth_projected = false;
+	int depth_transform_task = preprocessing.addTask("depth_transform", [&]() -> bool
 	{
-		pcl::VoxelGrid<pcl::PointXYZI> vg_xyz;
-		vg_xyz.setInputCloud(input_depth_pcl);
-		vg_xyz.setLeafSize(req.depth_voxel_size, req.depth_voxel_size, req.depth_voxel_size);
-		// Apply Filter and return Voxelized Data
-		pcl::PointCloud<pcl::PointXYZI>::Ptr temp_depth_pcp = pcl::PointCloud<pcl::PointXYZI>::Ptr(new pcl::PointCloud<pcl::PointXYZI>());
-		vg_xyz.filter(*temp_depth_pcp);
-		*input_depth_pcl = *temp_depth_pcp;
-		time_elapsed = ros::Time::now() - start_time;
-		ROS_DEBUG_STREAM("voxelized input depth cloud with voxel size " << req.depth_voxel_size << " in " << time_elapsed << " seconds... new size: " << input_depth_pcl->points.size());
-	}
+		depth_sphere.clear();
+		if(deadlinePassed())
+			return false;
+		std::string cloud_frame = req.input_cloud.header.frame_id;
+		float transform[12] = {1,0,0,0, 0,1,0,0, 0,0,1,0};
+		tf::StampedTransform tf_transform;
+		bool have_transform = camera_frame_listener_.waitForTransform(cloud_frame, req.target_frame, ros::Time(0), ros::Duration(0.5));
+		if(have_transform)
+		{
+			camera_frame_listener_.lookupTransform(req.target_frame, cloud_frame, ros::Time(0), tf_transform);
+			for(int r=0; r<3; r++)
+			{
+				for(int c=0; c<3; c++)
+					transform[4*r+c] = tf_transform.getBasis()[r][c];
+				transform[4*r+3] = tf_transform.getOrigin()[r];
+			}
+		}
+		else 
+			// if Transform request times out... Continues WITHOUT TRANSFORM
+			ROS_WARN_THROTTLE(60, "[PointcloudPainter] listen for transformation from %s to %s timed out. Defaulting to initial location of input cloud...", cloud_frame.c_str(), req.target_frame.c_str());
 
-	// ------ Create Spherical PCL "Depth" Clouds for Second Method ------
-	//   These only matter for the K Nearest Neighbors approach (not for interpolation)
+		PainterDepthInput depth_input;
+		if(painterDepthLayout(req.input_cloud, depth_input, input_cloud_points_))
+		{
+			// Decimation just strides over the message buffer (or the mapped input file)
+			depth_input.point_count = (depth_input.point_count + depth_stride - 1) / depth_stride;
+			depth_input.point_step *= depth_stride;
+			input_depth_pcl->points.resize(depth_input.point_count);
+			PainterDepthOutput depth_output;
+			depth_output.points = input_depth_pcl->points.data();
+			depth_output.sphere = NULL;
+			depth_output.directions = NULL;
+			if(!req.voxelize_depth_cloud)
+			{
+				if(!req.color_onto_depth)
+				{
+					depth_sphere.points.resize(depth_input.point_count);
+					depth_output.sphere = depth_sphere.points.data();
+				}
+				if(!low_footprint)
+				{
+					input_pcl_projected_intensity->points.resize(depth_input.point_count);
+					depth_output.directions = input_pcl_projected_intensity->points.data();
+				}
+			}
+			size_t kept = painterFusedDepthKernel(depth_input, transform, depth_output, active_roi);
+			input_depth_pcl->points.resize(kept);
+			if(depth_output.sphere != NULL)
+				depth_sphere.points.resize(kept);
+			if(depth_output.directions != NULL)
+				input_pcl_projected_intensity->points.resize(kept);
+			depth_projected = !req.voxelize_depth_cloud;
+		}
+		else
+		{
+			sensor_msgs::PointCloud2 &transformed_depth_cloud = buffer_pool_.transformed_depth_msg;
+			if(have_transform)
+				pcl_ros::transformPointCloud(req.target_frame, tf_transform, req.input_cloud, transformed_depth_cloud);
+			else
+				transformed_depth_cloud = req.input_cloud;
+			pcl::fromROSMsg(transformed_depth_cloud, *input_depth_pcl); 	// Initialize input cloud 
+			if(depth_stride > 1 || active_roi != NULL)
+			{
+				size_t kept = 0;
+				for(size_t i=0; i<input_depth_pcl->points.size(); i+=depth_stride)
+				{
+					const pcl::PointXYZI &point = input_depth_pcl->points[i];
+					if(active_roi == NULL || active_roi->containsPoint(point.x, point.y, point.z))
+						input_depth_pcl->points[kept++] = point;
+				}
+				input_depth_pcl->points.resize(kept);
+			}
+		}
+		input_depth_pcl->width = input_depth_pcl->points.size();
+		input_depth_pcl->height = 1;
+		ROS_DEBUG_STREAM("Transformed: " << req.input_cloud.height*req.input_cloud.width << " to " << input_depth_pcl->points.size() << " points " << ros::Time::now() - start_time);
+		
+		// ------ Voxelize Input Depth Cloud ------
+		if(deadlinePassed())
+			return false;
+		if(req.voxelize_depth_cloud)
+		{
+			pcl::VoxelGrid<pcl::PointXYZI> vg_xyz;
+			vg_xyz.setInputCloud(input_depth_pcl);
+			vg_xyz.setLeafSize(req.depth_voxel_size, req.depth_voxel_size, req.depth_voxel_size);
+			// Apply Filter and return Voxelized Data
+			pcl::PointCloud<pcl::PointXYZI>::Ptr temp_depth_pcp = buffer_pool_.depth_voxel_temp.acquire();
+			vg_xyz.filter(*temp_depth_pcp);
+			input_depth_pcl->swap(*temp_depth_pcp);
+			ROS_DEBUG_STREAM("voxelized input depth cloud with voxel size " << req.depth_voxel_size << " in " << ros::Time::now() - start_time << " seconds... new size: " << input_depth_pcl->points.size());
+		}
+		return true;
+	});
+
+	// ------ Create Spherical "Depth" Cloud for Second Method ------
+	//   This only matters for the K Nearest Neighbors approach (not for interpolation)
 	//   Although the interpolation methods aren't really implemented yet... not sure if I WILL implement them, we'll see
-	// Input Cloud - projected onto a sphere of fixed radius
-	pcl::PointCloud<pcl::PointXYZ>::Ptr input_pcl_projected (new pcl::PointCloud<pcl::PointXYZ>()); 
-	pcl::PointCloud<pcl::PointXYZI>::Ptr input_pcl_projected_intensity (new pcl::PointCloud<pcl::PointXYZI>()); 
-	// Actually perform projection: 
-	for(int i=0; i<input_depth_pcl->points.size(); i++)
-	{
-		float distance = sqrt( pow(input_depth_pcl->points[i].x,2) + pow(input_depth_pcl->points[i].y,2) + pow(input_depth_pcl->points[i].z,2) );
-		pcl::PointXYZ point;
-		point.x = input_depth_pcl->points[i].x / distance;
-		point.y = input_depth_pcl->points[i].y / distance;
-		point.z = input_depth_pcl->points[i].z / distance;
-		input_pcl_projected->points.push_back(point);
-
-		pcl::PointXYZI point_i;
-		point_i.x = point.x;
-		point_i.y = point.y;
-		point_i.z = point.z; 
-		point_i.intensity = input_depth_pcl->points[i].intensity;
-		input_pcl_projected_intensity->points.push_back(point_i);
-	}
-	time_elapsed = ros::Time::now() - start_time;
-	ROS_DEBUG_STREAM("projected depth cloud to sphere " << time_elapsed);
-	res.depth_preprocessing_time = time_elapsed.toSec();
+	// Input Cloud - projected onto the unit sphere, as octahedral-encoded directions with their ranges (see octahedral_sphere.h)
+	//   Only searched when painting depth onto color; the float copy (with intensity) is only kept for debug output
+	preprocessing.addTask("depth_sphere", [&]() -> bool
+	{
+		if(deadlinePassed())
+			return false;
+		if(!depth_projected)
+		{
+			// Same kernel over the (already transformed) PCL cloud - it compacts input_depth_pcl in place as it drops points
+			size_t point_count = input_depth_pcl->points.size();
+			PainterDepthOutput depth_output;
+			depth_output.points = input_depth_pcl->points.data();
+			depth_output.sphere = NULL;
+			depth_output.directions = NULL;
+			if(!req.color_onto_depth)
+			{
+				depth_sphere.points.resize(point_count);
+				depth_output.sphere = depth_sphere.points.data();
+			}
+			if(!low_footprint)
+			{
+				input_pcl_projected_intensity->points.resize(point_count);
+				depth_output.directions = input_pcl_projected_intensity->points.data();
+			}
+			float identity[12] = {1,0,0,0, 0,1,0,0, 0,0,1,0};
+			size_t kept = painterFusedDepthKernel(painterDepthLayout(*input_depth_pcl), identity, depth_output);
+			input_depth_pcl->points.resize(kept);
+			input_depth_pcl->width = kept;
+			input_depth_pcl->height = 1;
+			if(!req.color_onto_depth)
+				depth_sphere.points.resize(kept);
+			if(!low_footprint)
+				input_pcl_projected_intensity->points.resize(kept);
+		}
+		input_pcl_projected_intensity->width = input_pcl_projected_intensity->points.size();
+		input_pcl_projected_intensity->height = 1;
+		if(!req.color_onto_depth)
+			depth_sphere.build();
+		time_elapsed = ros::Time::now() - start_time;
+		ROS_DEBUG_STREAM("projected depth cloud to sphere " << time_elapsed);
+		res.depth_preprocessing_time = time_elapsed.toSec();
+		return true;
+	}, std::vector<int>(1, depth_transform_task));
 
 	// ----------------------------------------------------------------------------------
 	// -------------------------------- SET UP RGB CLOUDS -------------------------------
 	// ----------------------------------------------------------------------------------
 	
 	// ------ Set Up PCL Objects ------
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr flat_image_pcl = pcl::PointCloud<pcl::PointXYZRGB>::Ptr(new pcl::PointCloud<pcl::PointXYZRGB>); 
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr spherical_image_lobed_pcl = pcl::PointCloud<pcl::PointXYZRGB>::Ptr(new pcl::PointCloud<pcl::PointXYZRGB>);
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr spherical_image_pcl = pcl::PointCloud<pcl::PointXYZRGB>::Ptr(new pcl::PointCloud<pcl::PointXYZRGB>);
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr flat_image_pcl = buffer_pool_.image_flat.acquire(); 
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr spherical_image_lobed_pcl = buffer_pool_.image_spherical_lobed.acquire();
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr spherical_image_pcl = buffer_pool_.image_spherical.acquire();
+	if(buffer_pool_.images.size() < image_count)
+		buffer_pool_.images.resize(image_count);
+	// Final (post-compression) raster dimensions of each image
+	std::vector<int> image_heights(image_count, 0);
+	std::vector<int> image_widths(image_count, 0);
+	std::vector<cv_bridge::CvImageConstPtr> image_ptrs(image_count);
+	std::vector<PainterLensParams> lens_params(image_count);
+	res.image_preprocessing_times.assign(image_count, 0);
+	std::vector<int> image_tasks;
 	// ------ Extract Data ------
-	for(int i=0; i<req.image_list.size(); i++)
+	for(int i=0; i<image_count; i++)
 	{
-		// ------ Set up CV Object ------
-		cv_bridge::CvImagePtr image_ptr(new cv_bridge::CvImage); 
-		try
+		int decode_task = preprocessing.addTask(req.image_names[i] + "_decode", [&, i]() -> bool
 		{
-			image_ptr = cv_bridge::toCvCopy(req.image_list[i], sensor_msgs::image_encodings::BGR8);
-		}
-		catch(cv_bridge::Exception& e)
+			if(deadlinePassed())
+				return false;
+			int compression_ratio = compression_ratios[i];
+			// ------ Set up CV Object ------
+			cv_bridge::CvImageConstPtr image_ptr; 
+			// Raster-space compression still to be applied after decoding
+			int remaining_ratio = compression_ratio;
+			if(image_is_compressed[i])
+			{
+				// Decode straight to a reduced resolution where possible, so full-size pixels are never materialized
+				cv_bridge::CvImagePtr decoded_image_ptr(new cv_bridge::CvImage);
+				if(!decodeCompressedImage(decoded_image_ptr, req.compressed_image_list[i], compression_ratio, remaining_ratio))
+					return false;
+				image_ptr = decoded_image_ptr;
+			}
+			else
+			{
+				try
+				{
+					// Where the pixel layout can be read directly, wrap the request buffer without copying or converting it
+					//   (req outlives image_ptr, so no tracked object is needed to keep the data alive)
+					if(painterPixelFormat(req.image_list[i].encoding) != PAINTER_PIXEL_UNSUPPORTED)
+						image_ptr = cv_bridge::toCvShare(req.image_list[i], boost::shared_ptr<void const>());
+					else
+						image_ptr = cv_bridge::toCvCopy(req.image_list[i], sensor_msgs::image_encodings::BGR8);
+				}
+				catch(cv_bridge::Exception& e)
+				{
+					ROS_ERROR_STREAM("[PointcloudPainter] cv_bridge exception: " << e.what());
+					return false; 
+				}
+			}
+			ROS_DEBUG_STREAM("converted ros image of name " << req.image_names[i] << " to CV objects " << ros::Time::now() - start_time);
+
+			// ------ Transform, Populate Spherical Cloud ------
+			// Size of the raster actually given (all of the image, or just a region of it - see image_regions)
+			int region_hgt = image_ptr->image.rows / remaining_ratio;
+			int region_wdt = image_ptr->image.cols / remaining_ratio;
+			image_heights[i] = region_hgt;
+			image_widths[i] = region_wdt;
+			int row_offset = 0;
+			int col_offset = 0;
+			if(req.image_regions.size() >= 4*(i+1) && req.image_regions[4*i+2] > 0 && req.image_regions[4*i+3] > 0)
+			{
+				row_offset = req.image_regions[4*i] / compression_ratio;
+				col_offset = req.image_regions[4*i+1] / compression_ratio;
+				image_heights[i] = req.image_regions[4*i+2] / compression_ratio;
+				image_widths[i] = req.image_regions[4*i+3] / compression_ratio;
+			}
+			else if(req.image_crops.size() >= 4*(i+1) && req.image_crops[4*i+2] > 0 && req.image_crops[4*i+3] > 0)
+			{
+				// Crop the whole image to the part used (a view, not a copy), in whole compressed pixels - from here on it is
+				//   handled just as if only that region had been given
+				row_offset = std::min(req.image_crops[4*i] / compression_ratio, image_heights[i]);
+				col_offset = std::min(req.image_crops[4*i+1] / compression_ratio, image_widths[i]);
+				int row_end = std::min((req.image_crops[4*i] + req.image_crops[4*i+2] + compression_ratio - 1) / compression_ratio, image_heights[i]);
+				int col_end = std::min((req.image_crops[4*i+1] + req.image_crops[4*i+3] + compression_ratio - 1) / compression_ratio, image_widths[i]);
+				region_hgt = std::max(row_end - row_offset, 0);
+				region_wdt = std::max(col_end - col_offset, 0);
+				cv::Rect crop(col_offset*remaining_ratio, row_offset*remaining_ratio, region_wdt*remaining_ratio, region_hgt*remaining_ratio);
+				cv_bridge::CvImagePtr cropped_image_ptr(new cv_bridge::CvImage(image_ptr->header, image_ptr->encoding, image_ptr->image(crop)));
+				image_ptr = cropped_image_ptr;
+			}
+			if(remaining_ratio > 1)
+			{
+				cv_bridge::CvImagePtr resized_image_ptr(new cv_bridge::CvImage);
+				downsampleImage(resized_image_ptr, image_ptr, region_hgt, region_wdt, remaining_ratio, remaining_ratio);
+				image_ptr = resized_image_ptr;
+				ROS_DEBUG_STREAM("resized CV objects " << ros::Time::now() - start_time);
+			}
+			image_ptrs[i] = image_ptr;
+			lens_params[i].max_angle = req.max_image_angles[i];
+			lens_params[i].image_hgt = image_heights[i];
+			lens_params[i].image_wdt = image_widths[i];
+			lens_params[i].pixel_scale = 1.0 / compression_ratio;
+			lens_params[i].row_offset = row_offset;
+			lens_params[i].col_offset = col_offset;
+			lens_params[i].region_hgt = region_hgt;
+			lens_params[i].region_wdt = region_wdt;
+			lens_params[i].coefficients.assign(PAINTER_LENS_PARAMETER_COUNT, 0);
+			for(int n=0; n<PAINTER_LENS_PARAMETER_COUNT && PAINTER_LENS_PARAMETER_COUNT*i+n < req.lens_parameters.size(); n++)
+				lens_params[i].coefficients[n] = req.lens_parameters[PAINTER_LENS_PARAMETER_COUNT*i+n];
+			return true;
+		});
+
+		image_tasks.push_back(preprocessing.addTask(req.image_names[i] + "_clouds", [&, i]() -> bool
 		{
-			ROS_ERROR_STREAM("[PointcloudPainter] cv_bridge exception: " << e.what());
-			return false; 
-		}
-		time_elapsed = ros::Time::now() - start_time;
-		ROS_DEBUG_STREAM("converted ros image of name " << req.image_names[i] << " to CV objects " << time_elapsed);
+			if(deadlinePassed())
+				return false;
+			PainterImageBuffers &buffers = buffer_pool_.images[i];
+			pcl::PointCloud<pcl::PointXYZRGB>::Ptr image_flat_pcl = buffers.flat.acquire();
+			pcl::PointCloud<pcl::PointXYZRGB>::Ptr image_spherical_lobed_pcl = buffers.spherical_lobed.acquire();
+			pcl::PointCloud<pcl::PointXYZRGB>::Ptr image_spherical_pcl = buffers.spherical.acquire();
+			buildImageClouds(image_flat_pcl, image_spherical_lobed_pcl, image_spherical_pcl, image_ptrs[i], req.camera_frames[i], req.target_frame, req.projections[i], lens_params[i], active_roi, i);
+			image_ptrs[i].reset();
+			ros::Duration image_time = ros::Time::now() - start_time;
+			ROS_DEBUG_STREAM("created image clouds " << image_time);
+			res.image_preprocessing_times[i] = image_time.toSec();
+			return true;
+		}, std::vector<int>(1, decode_task)));
+	}
 
-		// ------ Transform, Populate Spherical Cloud ------
-		cv_bridge::CvImagePtr resized_image_ptr(new cv_bridge::CvImage);
-		if(req.compress_images[i])
-		{
-			downsampleImage(resized_image_ptr, image_ptr, req.image_list[i].height/req.image_compression_ratios[i], req.image_list[i].width/req.image_compression_ratios[i], req.image_compression_ratios[i], req.image_compression_ratios[i]);
-			buildImageClouds(flat_image_pcl, spherical_image_lobed_pcl, spherical_image_pcl, resized_image_ptr, req.camera_frames[i], req.target_frame, req.projections[i], req.max_image_angles[i], req.image_list[i].height/req.image_compression_ratios[i], req.image_list[i].width/req.image_compression_ratios[i], i);
-		}
+	// ------ Run Preprocessing ------
+	bool preprocessing_succeeded = preprocessing.run();
+	std::vector<int> critical_path;
+	res.critical_path_time = preprocessing.criticalPath(critical_path);
+	for(int t=0; t<critical_path.size(); t++)
+		res.critical_path.push_back(preprocessing.taskName(critical_path[t]));
+	time_elapsed = ros::Time::now() - start_time;
+	res.preprocessing_time = time_elapsed.toSec();
+	ROS_DEBUG_STREAM("preprocessed depth cloud and " << image_count << " images in " << time_elapsed << " - critical path " << res.critical_path_time << " s");
+	if(!preprocessing_succeeded)
+	{
+		if(deadlinePassed())
+			ROS_WARN_STREAM("[PointcloudPainter] Preprocessing stopped at the anytime deadline.");
 		else
-		{	
-			time_elapsed = ros::Time::now() - start_time;
-			ROS_DEBUG_STREAM("resized CV objects " << time_elapsed);
-			buildImageClouds(flat_image_pcl, spherical_image_lobed_pcl, spherical_image_pcl, image_ptr, req.camera_frames[i], req.target_frame, req.projections[i], req.max_image_angles[i], req.image_list[i].height/req.image_compression_ratios[i], req.image_list[i].width/req.image_compression_ratios[i], i);
+			ROS_ERROR_STREAM("[PointcloudPainter] Preprocessing failed - rejecting paint request.");
+		releaseBuffers(low_footprint);
+		return false;
+	}
+
+	// ------ Merge Image Clouds ------
+	//   In image order, so the result doesn't depend on which branch finished first. Each image's clouds are given back as
+	//   soon as they are merged, so image points are never held twice over. The flat and lobed clouds are only merged for
+	//   debug output; painting color onto depth without voxelization, each image's spherical points are encoded straight
+	//   into the searched color sphere, and no merged float copy is kept unless it is published.
+	PainterSphereIndex<PainterSphereColor> &color_sphere = buffer_pool_.color_sphere;
+	color_sphere.clear();
+	bool encode_images_directly = req.color_onto_depth && !req.voxelize_rgb_images;
+	for(int i=0; i<image_count; i++)
+	{
+		PainterImageBuffers &buffers = buffer_pool_.images[i];
+		if(!low_footprint)
+		{
+			flat_image_pcl->points.insert(flat_image_pcl->points.end(), buffers.flat.cloud->points.begin(), buffers.flat.cloud->points.end());
+			spherical_image_lobed_pcl->points.insert(spherical_image_lobed_pcl->points.end(), buffers.spherical_lobed.cloud->points.begin(), buffers.spherical_lobed.cloud->points.end());
 		}
-		time_elapsed = ros::Time::now() - start_time;
-		ROS_DEBUG_STREAM("created image clouds " << time_elapsed);
-		res.image_preprocessing_times.push_back(time_elapsed.toSec());
+		if(encode_images_directly)
+			painterAppendColorSphere(*buffers.spherical.cloud, color_sphere.points);
+		if(!encode_images_directly || !low_footprint)
+			spherical_image_pcl->points.insert(spherical_image_pcl->points.end(), buffers.spherical.cloud->points.begin(), buffers.spherical.cloud->points.end());
+		buffers.flat.discard();
+		buffers.spherical_lobed.discard();
+		buffers.spherical.discard();
 	}
 
 	// ------ Voxelization of Clouds ------
 	ROS_DEBUG_STREAM("[PointcloudPainter] RGB clouds built. Flat Size: " << flat_image_pcl->points.size() << "   Spherical Size: " << spherical_image_pcl->points.size());
 	if(req.voxelize_rgb_images)
 	{
-		// Voxelize Flat Cloud
+		// Voxelize Flat Cloud (only kept for debug output)
 		int start_size = flat_image_pcl->points.size();
 		pcl::VoxelGrid<pcl::PointXYZRGB> vg;
-		vg.setInputCloud(flat_image_pcl);
-		vg.setLeafSize(req.flat_voxel_size, req.flat_voxel_size, req.flat_voxel_size);
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr temp_pcp = pcl::PointCloud<pcl::PointXYZRGB>::Ptr(new pcl::PointCloud<pcl::PointXYZRGB>());
-		vg.filter(*temp_pcp);
-		*flat_image_pcl = *temp_pcp;
-		// Time Debugging
-		time_elapsed = ros::Time::now() - start_time;
-		ROS_DEBUG_STREAM("voxelized flat image cloud from " << start_size << " to " << flat_image_pcl->points.size() << " in " << time_elapsed << " time.");
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr temp_pcp = buffer_pool_.image_voxel_temp.acquire();
+		if(!low_footprint)
+		{
+			vg.setInputCloud(flat_image_pcl);
+			vg.setLeafSize(req.flat_voxel_size, req.flat_voxel_size, req.flat_voxel_size);
+			vg.filter(*temp_pcp);
+			flat_image_pcl->swap(*temp_pcp);
+			// Time Debugging
+			time_elapsed = ros::Time::now() - start_time;
+			ROS_DEBUG_STREAM("voxelized flat image cloud from " << start_size << " to " << flat_image_pcl->points.size() << " in " << time_elapsed << " time.");
+		}
 
 		// Voxelize Spherical Cloud (Collapsed)
 		start_size = spherical_image_pcl->points.size(); 
 		vg.setInputCloud(spherical_image_pcl);
 		vg.setLeafSize(req.spherical_voxel_size, req.spherical_voxel_size, req.spherical_voxel_size);
-		temp_pcp->points.clear();
 		vg.filter(*temp_pcp);
-		*spherical_image_pcl = *temp_pcp;
+		spherical_image_pcl->swap(*temp_pcp);
 		// Time Debugging
 		time_elapsed = ros::Time::now() - start_time;
 		ROS_DEBUG_STREAM("voxelized spherical image cloud from " << start_size << " to " << spherical_image_pcl->points.size() << " in " << time_elapsed << " time.");
@@ -183,6 +647,12 @@ bool PointcloudPainter::paintPointcloud(pointcloud_painter::pointcloud_painter_s
 
 	res.image_voxelizing_time = time_elapsed.toSec();
 	ROS_DEBUG_STREAM("[PointcloudPainter] RGB Cloud Size following Voxelization: " << spherical_image_pcl->points.size());
+	if(deadlinePassed())
+	{
+		ROS_WARN_STREAM("[PointcloudPainter] Stopped before painting at the anytime deadline.");
+		releaseBuffers(low_footprint);
+		return false;
+	}
 
 
 
@@ -190,62 +660,332 @@ bool PointcloudPainter::paintPointcloud(pointcloud_painter::pointcloud_painter_s
 	// ------------------------------------- PAINT --------------------------------------
 	// ----------------------------------------------------------------------------------
 
-	// Create Flat Image Message (sensor_msgs/PointCloud2)
-	sensor_msgs::PointCloud2 image_flat_out;
-	pcl::toROSMsg(*flat_image_pcl, image_flat_out);
-	image_flat_out.header.frame_id = "map";
-	ros::Publisher pub_flat = nh_.advertise<sensor_msgs::PointCloud2>("image_out_flat", 1, this);
-	pub_flat.publish(image_flat_out);
-
-	// Create Spherical Lobed Image Message (sensor_msgs/PointCloud2)
-	sensor_msgs::PointCloud2 image_sphere_lobed_out;
-	pcl::toROSMsg(*spherical_image_lobed_pcl, image_sphere_lobed_out);
-	image_sphere_lobed_out.header.frame_id = "map";
-	ros::Publisher pub_sphere_lobed = nh_.advertise<sensor_msgs::PointCloud2>("image_out_sphere_lobed", 1, this);
-	pub_sphere_lobed.publish(image_sphere_lobed_out);
-
-	// Create Spherical Image Message (sensor_msgs/PointCloud2)
-	sensor_msgs::PointCloud2 image_sphere_out;
-	pcl::toROSMsg(*spherical_image_pcl, image_sphere_out);
-	image_sphere_out.header.frame_id = req.target_frame;
-	ros::Publisher pub_sphere = nh_.advertise<sensor_msgs::PointCloud2>("image_out_sphere", 1, this);
-	pub_sphere.publish(image_sphere_out);
-
-	// Find Time Now
-	time_elapsed = ros::Time::now() - start_time;
-	ROS_INFO_STREAM("published image clouds " << time_elapsed);
+	// Debug image clouds are skipped in low-footprint mode (each is another full-size copy)
+	if(!low_footprint)
+	{
+		// Create Flat Image Message (sensor_msgs/PointCloud2)
+		sensor_msgs::PointCloud2 image_flat_out;
+		pcl::toROSMsg(*flat_image_pcl, image_flat_out);
+		image_flat_out.header.frame_id = "map";
+		ros::Publisher pub_flat = nh_.advertise<sensor_msgs::PointCloud2>("image_out_flat", 1, this);
+		pub_flat.publish(image_flat_out);
+
+		// Create Spherical Lobed Image Message (sensor_msgs/PointCloud2)
+		sensor_msgs::PointCloud2 image_sphere_lobed_out;
+		pcl::toROSMsg(*spherical_image_lobed_pcl, image_sphere_lobed_out);
+		image_sphere_lobed_out.header.frame_id = "map";
+		ros::Publisher pub_sphere_lobed = nh_.advertise<sensor_msgs::PointCloud2>("image_out_sphere_lobed", 1, this);
+		pub_sphere_lobed.publish(image_sphere_lobed_out);
+
+		// Create Spherical Image Message (sensor_msgs/PointCloud2)
+		sensor_msgs::PointCloud2 image_sphere_out;
+		pcl::toROSMsg(*spherical_image_pcl, image_sphere_out);
+		image_sphere_out.header.frame_id = req.target_frame;
+		ros::Publisher pub_sphere = nh_.advertise<sensor_msgs::PointCloud2>("image_out_sphere", 1, this);
+		pub_sphere.publish(image_sphere_out);
+
+		// Find Time Now
+		time_elapsed = ros::Time::now() - start_time;
+		ROS_INFO_STREAM("published image clouds " << time_elapsed);
+	}
 	// ***********************
 	// ***** Run Painter *****
 	// ***********************
+	bool painted;
 	if(req.color_onto_depth)
-		projectColorOntoDepth(output_pcl, input_pcl_projected, input_depth_pcl, spherical_image_pcl, req.image_list[0].height, req.image_list[0].width, req.neighbor_search_count);
+	{
+		// Searched color sphere, as octahedral-encoded directions with packed colors (already encoded while merging, unless
+		//   the images were voxelized) - the float image clouds aren't needed past here
+		if(!encode_images_directly)
+			painterAppendColorSphere(*spherical_image_pcl, color_sphere.points);
+		buffer_pool_.image_flat.discard();
+		buffer_pool_.image_spherical_lobed.discard();
+		buffer_pool_.image_spherical.discard();
+		buffer_pool_.image_voxel_temp.discard();
+		color_sphere.build();
+		color_sphere.setApproximation(req.neighbor_search_epsilon, req.neighbor_search_max_checks);
+		painted = projectColorOntoDepth(output_pcl, input_depth_pcl, color_sphere, image_heights[0], image_widths[0], req.neighbor_search_count, req.preserve_point_order);
+	}
 	else
-		projectDepthOntoColor(output_pcl, input_pcl_projected, input_depth_pcl, spherical_image_pcl, req.image_list[0].height, req.image_list[0].width, req.neighbor_search_count);
+	{
+		depth_sphere.setApproximation(req.neighbor_search_epsilon, req.neighbor_search_max_checks);
+		painted = projectDepthOntoColor(output_pcl, depth_sphere, spherical_image_pcl, image_heights[0], image_widths[0], req.neighbor_search_count, req.preserve_point_order);
+	}
+	if(!painted)
+	{
+		ROS_WARN_STREAM("[PointcloudPainter] Painting stopped at the anytime deadline.");
+		releaseBuffers(low_footprint);
+		return false;
+	}
 	// Find Elapsed Time
 	time_elapsed = ros::Time::now() - start_time;
+	res.painting_time = time_elapsed.toSec();
 	ROS_INFO_STREAM("performed color neighbor search in " << time_elapsed << " seconds. Final colored depth cloud size: " << output_pcl->points.size());
+
+	// ------ Approximate Search Validation ------
+	//   (after painting_time is taken, so the exact searches don't count against the approximate ones)
+	if(req.neighbor_validation_samples > 0)
+	{
+		if(req.color_onto_depth)
+			validateNeighborSearch(buffer_pool_.color_sphere, *input_depth_pcl, req.neighbor_search_count, PAINTER_COLOR_MAX_SQR_DISTANCE, req.neighbor_validation_samples, res.neighbor_recall, res.neighbor_deviation);
+		else
+			validateNeighborSearch(depth_sphere, *spherical_image_pcl, req.neighbor_search_count, PAINTER_DEPTH_MAX_SQR_DISTANCE, req.neighbor_validation_samples, res.neighbor_recall, res.neighbor_deviation);
+		ROS_INFO_STREAM("[PointcloudPainter] neighbor search (epsilon " << req.neighbor_search_epsilon << ", max checks " << req.neighbor_search_max_checks << ") recall " << res.neighbor_recall << ", painted value deviation " << res.neighbor_deviation << " over " << req.neighbor_validation_samples << " samples");
+	}
 	
 	// Cteate Final RGBXYZ Cloud Message (sensor_msgs/PointCloud2)
-	sensor_msgs::PointCloud2 final_cloud;
-	pcl::toROSMsg(*output_pcl, final_cloud);
-	final_cloud.header.frame_id = req.target_frame;
 	ros::Publisher pub_final = nh_.advertise<sensor_msgs::PointCloud2>("final_cloud", 1, this);
-	pub_final.publish(final_cloud);
+	res.output_point_count = output_pcl->points.size();
+	if(req.output_cloud_path.size() > 0)
+	{
+		// Written straight from output_pcl into the mapped output, so only the path and metadata go back over the 
+		//   service - the message is only serialized if someone is listening on final_cloud
+		sensor_msgs::PointCloud2 layout;
+		pcl::PointCloud<pcl::PointXYZRGB> layout_pcl;
+		layout_pcl.header = output_pcl->header;
+		pcl::toROSMsg(layout_pcl, layout);
+		layout.header.frame_id = req.target_frame;
+		layout.height = (output_pcl->height > 0) ? output_pcl->height : 1;
+		layout.width = output_pcl->points.size() / layout.height;
+		layout.row_step = layout.width * layout.point_step;
+		const uint8_t *points = output_pcl->points.empty() ? NULL : reinterpret_cast<const uint8_t *>(output_pcl->points.data());
+		if(!painterWriteCloud(req.output_cloud_path, layout, points))
+		{
+			ROS_ERROR_STREAM("[PointcloudPainter] Failed to write painted cloud to " << req.output_cloud_path << " - rejecting paint request.");
+			releaseBuffers(low_footprint);
+			return false;
+		}
+		res.output_cloud_path = req.output_cloud_path;
+		res.output_cloud.header = layout.header;
+		res.output_cloud.fields = layout.fields;
+		res.output_cloud.point_step = layout.point_step;
+		ROS_INFO_STREAM("[PointcloudPainter] wrote painted cloud to " << req.output_cloud_path);
+		if(pub_final.getNumSubscribers() > 0)
+		{
+			sensor_msgs::PointCloud2 &final_cloud = buffer_pool_.final_msg;
+			pcl::toROSMsg(*output_pcl, final_cloud);
+			final_cloud.header.frame_id = req.target_frame;
+			pub_final.publish(final_cloud);
+		}
+	}
+	else
+	{
+		sensor_msgs::PointCloud2 &final_cloud = buffer_pool_.final_msg;
+		pcl::toROSMsg(*output_pcl, final_cloud);
+		final_cloud.header.frame_id = req.target_frame;
+		pub_final.publish(final_cloud);
+		res.output_cloud = final_cloud;
+	}
+
+	// ------ Persistent Voxel Map Fusion ------
+	if(req.fuse_into_voxel_map)
+	{
+		fuseIntoVoxelMap(output_pcl, req.target_frame);
+		res.voxel_map_size = voxel_map_.size();
+		time_elapsed = ros::Time::now() - start_time;
+		ROS_INFO_STREAM("[PointcloudPainter] fused painted cloud into voxel map, now " << voxel_map_.size() << " voxels " << time_elapsed);
+	}
+
+	// ------ Painted Map Store ------
+	if(req.store_in_map)
+	{
+		storePaintedCloud(output_pcl, req.target_frame, req.input_cloud.header.stamp);
+		res.map_store_point_count = map_store_.pointCount();
+		time_elapsed = ros::Time::now() - start_time;
+		ROS_INFO_STREAM("[PointcloudPainter] archived painted cloud in map store, now " << map_store_.pointCount() << " points in " << map_store_.tileCount() << " tiles " << time_elapsed);
+	}
+
+	// ------ Organized Panorama ------
+	//   Gives consumers O(1) grid adjacency rather than needing to rebuild neighborhoods from the unorganized cloud
+	if(req.output_panorama)
+	{
+		int panorama_width = (req.panorama_width > 0) ? req.panorama_width : 2048;
+		// (the height is half the width, so it needs at least two columns to have a row)
+		if(panorama_width < 2)
+		{
+			ROS_WARN_STREAM("[PointcloudPainter] Panorama width of " << panorama_width << " is too small - rendering it 2 pixels wide.");
+			panorama_width = 2;
+		}
+		cv_bridge::CvImage panorama_rgb, panorama_range;
+		pcl::PointCloud<pcl::PointXYZRGB> panorama_pcl;
+		renderPanorama(panorama_rgb.image, panorama_range.image, panorama_pcl, output_pcl, panorama_width);
+		panorama_rgb.header.frame_id = req.target_frame;
+		panorama_rgb.header.stamp = req.input_cloud.header.stamp;
+		panorama_rgb.encoding = sensor_msgs::image_encodings::BGR8;
+		panorama_range.header = panorama_rgb.header;
+		panorama_range.encoding = sensor_msgs::image_encodings::TYPE_32FC1;
+		panorama_rgb.toImageMsg(res.panorama_rgb);
+		panorama_range.toImageMsg(res.panorama_range);
+		pcl::toROSMsg(panorama_pcl, res.panorama_cloud);
+		res.panorama_cloud.header = panorama_rgb.header;
+
+		ros::Publisher pub_panorama_rgb = nh_.advertise<sensor_msgs::Image>("panorama/rgb", 1, this);
+		pub_panorama_rgb.publish(res.panorama_rgb);
+		ros::Publisher pub_panorama_range = nh_.advertise<sensor_msgs::Image>("panorama/range", 1, this);
+		pub_panorama_range.publish(res.panorama_range);
+		ros::Publisher pub_panorama_cloud = nh_.advertise<sensor_msgs::PointCloud2>("panorama/cloud", 1, this);
+		pub_panorama_cloud.publish(res.panorama_cloud);
+		time_elapsed = ros::Time::now() - start_time;
+		ROS_INFO_STREAM("[PointcloudPainter] rendered " << panorama_width << " by " << panorama_width/2 << " RGB-D panorama " << time_elapsed);
+	}
+
+	// ------ Level-of-Detail Octree ------
+	//   Viewers can show the coarse levels almost immediately and swap in finer ones as they arrive
+	if(req.build_lod)
+	{
+		std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> lod_clouds;
+		std::vector<float> lod_voxel_sizes;
+		buildOctreeLOD(lod_clouds, lod_voxel_sizes, output_pcl, req.lod_depth);
+		ros::Publisher pub_lod = nh_.advertise<sensor_msgs::PointCloud2>("final_cloud_lod", lod_clouds.size(), this);
+		for(int i=0; i<lod_clouds.size(); i++)
+		{
+			// Levels are ordered coarse to fine, so stop at the first one which exceeds the point budget
+			if(req.lod_point_budget > 0 && lod_clouds[i]->points.size() > req.lod_point_budget)
+				break;
+			sensor_msgs::PointCloud2 lod_cloud;
+			pcl::toROSMsg(*lod_clouds[i], lod_cloud);
+			lod_cloud.header.frame_id = req.target_frame;
+			pub_lod.publish(lod_cloud);
+			res.lod_clouds.push_back(lod_cloud);
+			res.lod_voxel_sizes.push_back(lod_voxel_sizes[i]);
+		}
+		time_elapsed = ros::Time::now() - start_time;
+		ROS_INFO_STREAM("[PointcloudPainter] built " << lod_clouds.size() << " level octree LOD, returning " << res.lod_clouds.size() << " levels " << time_elapsed);
+	}
 
 	// Publish the Input Depth Cloud (projected to sphere) (sensor_msgs/PointCloud2)
-	sensor_msgs::PointCloud2 input_depth_projected;
-	pcl::toROSMsg(*input_pcl_projected_intensity, input_depth_projected);
-	input_depth_projected.header.frame_id = req.target_frame;
-	ros::Publisher pub_depth_projected = nh_.advertise<sensor_msgs::PointCloud2>("input_depth_projected", 1, this);
-	pub_depth_projected.publish(input_depth_projected);
+	if(!low_footprint)
+	{
+		sensor_msgs::PointCloud2 input_depth_projected;
+		pcl::toROSMsg(*input_pcl_projected_intensity, input_depth_projected);
+		input_depth_projected.header.frame_id = req.target_frame;
+		ros::Publisher pub_depth_projected = nh_.advertise<sensor_msgs::PointCloud2>("input_depth_projected", 1, this);
+		pub_depth_projected.publish(input_depth_projected);
+	}
 
-	ros::Duration(2).sleep();
+	time_elapsed = ros::Time::now() - start_time;
+	res.total_time = time_elapsed.toSec();
+	res.peak_memory_mb = peakMemoryMB();
+
+	// (no pause when racing a deadline)
+	if(req.deadline <= 0)
+		ros::Duration(2).sleep();
+
+	releaseBuffers(low_footprint);
 
 	return true;
 }
 
-bool PointcloudPainter::downsampleImage(cv_bridge::CvImagePtr image_out, cv_bridge::CvImagePtr image_in, int height, int width, int height_mult, int width_mult)
+/* estimateMemoryMB - rough estimate of the peak working memory a paint request will need
+ 	Counts the main full-size copies made of the depth cloud and of each (post-compression) image, as the pipeline
+ 	is currently laid out. Compressed images are sized from their headers (or, in a format whose header can't be
+ 	read, from their byte count, assuming ~10:1 compression).
+*/
+double PointcloudPainter::estimateMemoryMB(pointcloud_painter::pointcloud_painter_srv::Request &req, std::vector<int> &compression_ratios, bool low_footprint)
+{
+	double bytes = 0;
+
+	// ------ Depth ------
+	double depth_points = double(req.input_cloud.width) * req.input_cloud.height;
+	PainterDepthInput depth_layout;
+	if(!painterDepthLayout(req.input_cloud, depth_layout, input_cloud_points_))
+		bytes += depth_points * req.input_cloud.point_step; 		// transformed message (unless read directly by the fused kernel)
+	bytes += depth_points * sizeof(pcl::PointXYZI); 				// input_depth_pcl
+	if(req.voxelize_depth_cloud)
+		bytes += depth_points * sizeof(pcl::PointXYZI); 			// voxelization temp
+	if(!req.color_onto_depth)
+		bytes += depth_points * (2*sizeof(PainterSphereDepth) + 4); 	// searched depth sphere (points, sorting scratch, grid)
+	bytes += depth_points * sizeof(pcl::PointXYZRGB) * 2; 			// output_pcl and final message
+	if(!low_footprint)
+		bytes += depth_points * sizeof(pcl::PointXYZI) * 2; 		// debug projected depth cloud and its message
+
+	// ------ Images ------
+	int image_count = std::max(req.image_list.size(), req.compressed_image_list.size());
+	for(int i=0; i<image_count; i++)
+	{
+		double raw_pixels;
+		int encoded_rows, encoded_cols;
+		if(i < req.compressed_image_list.size() && req.compressed_image_list[i].data.size() > 0)
+		{
+			if(painterEncodedImageSize(req.compressed_image_list[i].data, encoded_rows, encoded_cols))
+				raw_pixels = double(encoded_rows) * encoded_cols;
+			else
+				raw_pixels = req.compressed_image_list[i].data.size() * 10.0 / 3;
+		}
+		else
+			raw_pixels = double(req.image_list[i].height) * req.image_list[i].width;
+		double pixels = raw_pixels / (compression_ratios[i] * compression_ratios[i]);
+		bytes += pixels * 3; 										// decoded / downsampled raster
+		// flat, lobed, spherical and untransformed clouds, plus two messages used to transform each image cloud - each
+		//   image's clouds are given back as they are merged, so the merged (or encoded) clouds fit in the same space
+		bytes += pixels * sizeof(pcl::PointXYZRGB) * 6;
+		if(req.voxelize_rgb_images)
+			bytes += pixels * sizeof(pcl::PointXYZRGB); 			// voxelization temp
+		if(req.color_onto_depth)
+			bytes += pixels * (2*sizeof(PainterSphereColor) + 4); 	// searched color sphere (points, sorting scratch, grid)
+		if(!low_footprint)
+			bytes += pixels * sizeof(pcl::PointXYZRGB) * 3; 		// debug image messages
+	}
+
+	return bytes / (1024.0*1024.0);
+}
+
+// resetPeakMemory - resets the kernel's peak resident set size (VmHWM) counter for this process, so that peakMemoryMB covers just this call
+void PointcloudPainter::resetPeakMemory()
+{
+	std::ofstream clear_refs("/proc/self/clear_refs");
+	if(clear_refs.is_open())
+		clear_refs << "5";
+}
+
+// peakMemoryMB - peak resident set size (VmHWM) of this process since the last resetPeakMemory, or -1 if unavailable
+double PointcloudPainter::peakMemoryMB()
+{
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while(std::getline(status, line))
+	{
+		if(line.compare(0, 6, "VmHWM:") == 0)
+			return atof(line.c_str() + 6) / 1024.0; 	// reported in kB
+	}
+	return -1;
+}
+
+// releaseBuffers - end of a paint call; trims the pooled buffers back toward their recent high-water marks
+void PointcloudPainter::releaseBuffers(bool free_memory)
 {
+	buffer_pool_.input_depth.release(free_memory);
+	buffer_pool_.depth_voxel_temp.release(free_memory);
+	buffer_pool_.depth_projected_intensity.release(free_memory);
+	buffer_pool_.depth_sphere.release(free_memory);
+	buffer_pool_.color_sphere.release(free_memory);
+	if(free_memory)
+	{
+		std::vector<uint32_t>().swap(buffer_pool_.query_order);
+		std::vector<uint32_t>().swap(buffer_pool_.output_origins);
+	}
+	for(size_t i=0; i<buffer_pool_.images.size(); i++)
+	{
+		buffer_pool_.images[i].flat.release(free_memory);
+		buffer_pool_.images[i].spherical_lobed.release(free_memory);
+		buffer_pool_.images[i].spherical.release(free_memory);
+	}
+	buffer_pool_.image_flat.release(free_memory);
+	buffer_pool_.image_spherical_lobed.release(free_memory);
+	buffer_pool_.image_spherical.release(free_memory);
+	buffer_pool_.image_voxel_temp.release(free_memory);
+	buffer_pool_.output.release(free_memory);
+	if(free_memory)
+	{
+		std::vector<uint8_t>().swap(buffer_pool_.transformed_depth_msg.data);
+		std::vector<uint8_t>().swap(buffer_pool_.final_msg.data);
+	}
+}
+
+// downsampleImage - block-averages image_in by height_mult x width_mult; image_in may be in any PAINTER_PIXEL_* layout, output is BGR8
+bool PointcloudPainter::downsampleImage(cv_bridge::CvImagePtr image_out, cv_bridge::CvImageConstPtr image_in, int height, int width, int height_mult, int width_mult)
+{
+	int pixel_format = painterPixelFormat(image_in->encoding);
 	// Initialize the new (downsampled) image
 	cv::Mat img(height,width,CV_8UC3,cv::Scalar(0,0,0));
 
@@ -260,9 +1000,11 @@ bool PointcloudPainter::downsampleImage(cv_bridge::CvImagePtr image_out, cv_brid
 			{
 				for(int m=0; m<width_mult; m++)
 				{
-					r += image_in->image.at<cv::Vec3b>(i*height_mult+k,j*width_mult+m)[2];
-					g += image_in->image.at<cv::Vec3b>(i*height_mult+k,j*width_mult+m)[1];
-					b += image_in->image.at<cv::Vec3b>(i*height_mult+k,j*width_mult+m)[0];
+					uint8_t r_px, g_px, b_px;
+					painterReadPixel(image_in->image, pixel_format, i*height_mult+k, j*width_mult+m, r_px, g_px, b_px);
+					r += r_px;
+					g += g_px;
+					b += b_px;
 				}
 			}
 			r /= height_mult*width_mult;
@@ -276,53 +1018,576 @@ bool PointcloudPainter::downsampleImage(cv_bridge::CvImagePtr image_out, cv_brid
 	}
 
 	img.copyTo(image_out->image);
-	image_out->encoding = image_in->encoding;
+	image_out->header = image_in->header;
+	image_out->encoding = sensor_msgs::image_encodings::BGR8;
+	return true;
 }
 
-bool PointcloudPainter::buildImageClouds(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_flat, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical_lobed, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical, cv_bridge::CvImagePtr cv_image, std::string camera_frame, std::string target_frame, int projection, float max_angle, int image_hgt, int image_wdt, int image_number)
+/* renderPanorama - renders a painted cloud (in target_frame) into an organized equirectangular RGB-D panorama
+ 	Pixel columns span azimuth (atan2(y,x)) from -pi to pi, and rows span elevation from +pi/2 (top) to -pi/2.
+ 	Where several points fall in one pixel, the nearest one is kept (z-buffering), so the result is what a 
+ 	spherical camera at the target_frame origin would see. Empty pixels are black / zero range / NaN.
+*/
+bool PointcloudPainter::renderPanorama(cv::Mat &rgb_image, cv::Mat &range_image, pcl::PointCloud<pcl::PointXYZRGB> &organized_cloud, pcl::PointCloud<pcl::PointXYZRGB>::Ptr painted_cloud, int width)
 {
-	pcl::PointCloud<pcl::PointXYZRGB> untransformed_sphere_pcl;
+	int height = width/2;
+	rgb_image = cv::Mat(height, width, CV_8UC3, cv::Scalar(0,0,0));
+	range_image = cv::Mat(height, width, CV_32FC1, cv::Scalar(0));
+
+	pcl::PointXYZRGB empty_point;
+	empty_point.x = empty_point.y = empty_point.z = std::numeric_limits<float>::quiet_NaN();
+	empty_point.r = empty_point.g = empty_point.b = 0;
+	organized_cloud.points.assign(width*height, empty_point);
+	organized_cloud.width = width;
+	organized_cloud.height = height;
+	organized_cloud.is_dense = false;
+
+	for(int i=0; i<painted_cloud->points.size(); i++)
+	{
+		const pcl::PointXYZRGB &point = painted_cloud->points[i];
+		float range = sqrt( pow(point.x,2) + pow(point.y,2) + pow(point.z,2) );
+		if(!(range > 0))
+			continue;
+		float azimuth = atan2(point.y, point.x);
+		float elevation = asin(point.z / range);
+		int col = std::min( int((azimuth + M_PI) / (2*M_PI) * width), width-1 );
+		int row = std::min( int((M_PI/2 - elevation) / M_PI * height), height-1 );
+
+		// Keep only the nearest point in each pixel
+		float &pixel_range = range_image.at<float>(row, col);
+		if(pixel_range > 0 && pixel_range <= range)
+			continue;
+		pixel_range = range;
+		cv::Vec3b &pixel = rgb_image.at<cv::Vec3b>(row, col);
+		pixel[0] = point.b;
+		pixel[1] = point.g;
+		pixel[2] = point.r;
+		organized_cloud.points[row*width + col] = point;
+	}
 
-	// Determine real image dimensions (to project properly to a R=1m sphere)
-	float plane_width, X_max_dist, Z_max_dist;
-	float flat_image_distance;
-	bool cut_corners = true;
-	switch(projection)
-	{
-		case PAINTER_PROJ_EQUA_STEREO:
-			// X position on the sphere where the highest angle allowed by the lens penetrates it from the origin:
-			X_max_dist = cos( (max_angle-180)/2 *3.14159/180 ); 	
-			Z_max_dist = sin( (max_angle-180)/2 *3.14159/180 );
-			// maximum width of planar projection such that it will wrap properly to a R=1m sphere (since lenses do not have a 360 FOV, and blank areas are omitted from file)
-			plane_width = X_max_dist/(1 - Z_max_dist) * 2;
-			break;
-		case PAINTER_PROJ_POLE_STEREO:
-			// X position on the sphere where the highest angle allowed by the lens penetrates it from the origin:
-			X_max_dist = cos( (max_angle-180)/2 *3.14159/180 );
-			Z_max_dist = sin( (max_angle-180)/2 *3.14159/180 );
-			// maximum width of planar projection such that it will wrap properly to a R=1m sphere (since lenses do not have a 360 FOV, and blank areas are omitted from file)
-			plane_width = X_max_dist/(1 - Z_max_dist) * 4;
-			break;
-		case PAINTER_PROJ_EQUAL_AREA:
-			// X and Z position on the sphere where the highest angle allowed by the lens penetrates it from the origin:
-			X_max_dist = cos( (max_angle-180)/2 *3.14159/180 );
-			Z_max_dist = sin( (max_angle-180)/2 *3.14159/180 );
-			//X_max_dist = cos( (-90 + (max_angle-180)) *3.14159/180);
-			//Z_max_dist = 1 - sin( (-90 + (max_angle-180)) *3.14159/180);
-			// maximum width of planar projection such that it will wrap properly to a R=1m sphere (since lenses do not have a 360 FOV, and blank areas are omitted from file)
-			plane_width = sqrt(2/(1-Z_max_dist)) * X_max_dist * 2;
-			break;
-		case PAINTER_PROJ_FLAT:
-			plane_width = 2*sin( max_angle/2 *3.14159/180 );
-			flat_image_distance = cos( max_angle/2 *3.14159/180 );
-			cut_corners = false;
-			break;
+	return true;
+}
+
+/* fuseIntoVoxelMap - accumulates a newly painted cloud into the persistent voxel color map
+ 	Points are moved into voxel_map_frame_ so that shots taken from different positions land in the same voxels.
+ 	Each point's color is weighted by how well it was seen: cos(incidence angle) between the viewing ray and the 
+ 	local surface normal, over the squared range from the viewpoint (target_frame origin). Previously fused voxels
+ 	are only ever updated, never recomputed, so the cost of a call depends only on the size of the new cloud.
+*/
+bool PointcloudPainter::fuseIntoVoxelMap(pcl::PointCloud<pcl::PointXYZRGB>::Ptr painted_cloud, std::string target_frame)
+{
+	if(painted_cloud->points.size() == 0)
+		return false;
+
+	// ------ Surface Normals (in target_frame, where the viewpoint is the origin) ------
+	pcl::PointCloud<pcl::Normal> normals;
+	pcl::NormalEstimation<pcl::PointXYZRGB, pcl::Normal> normal_estimator;
+	pcl::search::KdTree<pcl::PointXYZRGB>::Ptr normal_tree(new pcl::search::KdTree<pcl::PointXYZRGB>());
+	normal_estimator.setInputCloud(painted_cloud);
+	normal_estimator.setSearchMethod(normal_tree);
+	normal_estimator.setKSearch(10);
+	normal_estimator.setViewPoint(0, 0, 0);
+	normal_estimator.compute(normals);
+
+	// ------ Transform to Map Frame ------
+	tf::StampedTransform transform;
+	transform.setIdentity();
+	if(camera_frame_listener_.waitForTransform(voxel_map_frame_, target_frame, ros::Time(0), ros::Duration(0.5)))
+		camera_frame_listener_.lookupTransform(voxel_map_frame_, target_frame, ros::Time(0), transform);
+	else
+		ROS_WARN_STREAM("[PointcloudPainter] Warning - failed to find transform from " << target_frame << " to voxel map frame " << voxel_map_frame_ << ". Fusing untransformed.");
+	pcl::PointCloud<pcl::PointXYZRGB> map_frame_cloud;
+	pcl_ros::transformPointCloud(*painted_cloud, map_frame_cloud, transform);
+
+	// ------ Fuse ------
+	for(int i=0; i<painted_cloud->points.size(); i++)
+	{
+		const pcl::PointXYZRGB &view_point = painted_cloud->points[i];
+		const pcl::PointXYZRGB &map_point = map_frame_cloud.points[i];
+		if(!pcl::isFinite(map_point))
+			continue;
+		// Weight by view angle and distance
+		float range = sqrt( pow(view_point.x,2) + pow(view_point.y,2) + pow(view_point.z,2) );
+		if(range <= 0)
+			continue;
+		float cos_incidence = 1.0;
+		if(pcl_isfinite(normals.points[i].normal_x))
+			cos_incidence = fabs( normals.points[i].normal_x*view_point.x + normals.points[i].normal_y*view_point.y + normals.points[i].normal_z*view_point.z ) / range;
+		float weight = std::max(cos_incidence, float(0.05)) / std::max(range*range, float(0.01));
+
+		// Voxel key - 21 bits per signed axis index
+		int64_t ix = int64_t(floor(map_point.x / voxel_map_size_)) + (1 << 20);
+		int64_t iy = int64_t(floor(map_point.y / voxel_map_size_)) + (1 << 20);
+		int64_t iz = int64_t(floor(map_point.z / voxel_map_size_)) + (1 << 20);
+		uint64_t key = (uint64_t(ix & 0x1FFFFF) << 42) | (uint64_t(iy & 0x1FFFFF) << 21) | uint64_t(iz & 0x1FFFFF);
+
+		std::unordered_map<uint64_t, PainterVoxel>::iterator it = voxel_map_.find(key);
+		if(it == voxel_map_.end())
+		{
+			PainterVoxel new_voxel = {0, 0, 0, 0, 0, 0, 0, 0, 0, -1};
+			it = voxel_map_.insert(std::make_pair(key, new_voxel)).first;
+		}
+		PainterVoxel &voxel = it->second;
+		voxel.x += map_point.x;
+		voxel.y += map_point.y;
+		voxel.z += map_point.z;
+		voxel.r += weight * map_point.r;
+		voxel.g += weight * map_point.g;
+		voxel.b += weight * map_point.b;
+		voxel.weight += weight;
+		voxel.point_count++;
+		if(voxel.last_shot != voxel_map_shots_)
+		{
+			voxel.observation_count++;
+			voxel.last_shot = voxel_map_shots_;
+		}
+	}
+	voxel_map_shots_++;
+
+	return true;
+}
+
+/* queryVoxelMap - exports the current fused voxel map as a cloud (and optionally a .pcd file) */
+bool PointcloudPainter::queryVoxelMap(pointcloud_painter::voxel_map_srv::Request &req, pointcloud_painter::voxel_map_srv::Response &res)
+{
+	pcl::PointCloud<pcl::PointXYZRGB> map_cloud;
+	map_cloud.points.reserve(voxel_map_.size());
+	for(std::unordered_map<uint64_t, PainterVoxel>::const_iterator it = voxel_map_.begin(); it != voxel_map_.end(); it++)
+	{
+		const PainterVoxel &voxel = it->second;
+		if(voxel.observation_count < req.min_observations || voxel.weight <= 0)
+			continue;
+		pcl::PointXYZRGB point;
+		point.x = voxel.x / voxel.point_count;
+		point.y = voxel.y / voxel.point_count;
+		point.z = voxel.z / voxel.point_count;
+		point.r = int(round(voxel.r / voxel.weight));
+		point.g = int(round(voxel.g / voxel.weight));
+		point.b = int(round(voxel.b / voxel.weight));
+		map_cloud.points.push_back(point);
+	}
+	map_cloud.width = map_cloud.points.size();
+	map_cloud.height = 1;
+
+	pcl::toROSMsg(map_cloud, res.map_cloud);
+	res.map_cloud.header.frame_id = voxel_map_frame_;
+	res.map_cloud.header.stamp = ros::Time::now();
+	res.voxel_count = map_cloud.points.size();
+	res.fused_shot_count = voxel_map_shots_;
+
+	if(req.pcd_file.size() > 0 && map_cloud.points.size() > 0)
+	{
+		if(pcl::io::savePCDFileBinary(req.pcd_file, map_cloud) != 0)
+			ROS_ERROR_STREAM("[PointcloudPainter] failed to write voxel map to " << req.pcd_file);
+	}
+	ROS_INFO_STREAM("[PointcloudPainter] Exported voxel map of " << res.voxel_count << " voxels from " << voxel_map_shots_ << " fused shots.");
+
+	if(req.clear)
+	{
+		voxel_map_.clear();
+		voxel_map_shots_ = 0;
+	}
+	return true;
+}
+
+/* storePaintedCloud - archives a painted cloud in the tiled on-disk map store, in map_store_frame_
+ 	Points keep the time of the scan they were painted from, so the store holds the history of each place.
+*/
+bool PointcloudPainter::storePaintedCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr painted_cloud, std::string target_frame, ros::Time stamp)
+{
+	if(!map_store_.isOpen())
+	{
+		ROS_WARN_STREAM("[PointcloudPainter] No map store is open (set map_store_directory) - not archiving painted cloud.");
+		return false;
+	}
+	tf::StampedTransform transform;
+	transform.setIdentity();
+	if(camera_frame_listener_.waitForTransform(map_store_frame_, target_frame, ros::Time(0), ros::Duration(0.5)))
+		camera_frame_listener_.lookupTransform(map_store_frame_, target_frame, ros::Time(0), transform);
+	else
+		ROS_WARN_STREAM("[PointcloudPainter] Warning - failed to find transform from " << target_frame << " to map store frame " << map_store_frame_ << ". Archiving untransformed.");
+	pcl::PointCloud<pcl::PointXYZRGB> map_frame_cloud;
+	pcl_ros::transformPointCloud(*painted_cloud, map_frame_cloud, transform);
+
+	std::vector<PainterStoredPoint> points(map_frame_cloud.points.size());
+	for(size_t i=0; i<map_frame_cloud.points.size(); i++)
+	{
+		const pcl::PointXYZRGB &point = map_frame_cloud.points[i];
+		points[i].x = point.x;
+		points[i].y = point.y;
+		points[i].z = point.z;
+		points[i].r = point.r;
+		points[i].g = point.g;
+		points[i].b = point.b;
+		points[i].a = 0;
+		points[i].stamp = stamp.sec;
+	}
+	size_t stored = map_store_.append(points);
+	if(stored == 0 && points.size() > 0)
+	{
+		ROS_ERROR_STREAM("[PointcloudPainter] Failed to archive painted cloud in the map store.");
+		return false;
+	}
+	return true;
+}
+
+/* queryMapStore - returns the archived points within a box or view frustum, reading only the tiles which overlap it */
+bool PointcloudPainter::queryMapStore(pointcloud_painter::map_store_srv::Request &req, pointcloud_painter::map_store_srv::Response &res)
+{
+	ros::WallTime start_time = ros::WallTime::now();
+	if(!map_store_.isOpen())
+	{
+		ROS_ERROR_STREAM("[PointcloudPainter] No map store is open (set map_store_directory) - rejecting map store query.");
+		return false;
+	}
+	if(req.box.size() > 0 && req.frustum_frame.size() > 0)
+	{
+		ROS_ERROR_STREAM("[PointcloudPainter] Map store queries take a box or a frustum, not both - rejecting map store query.");
+		return false;
+	}
+	uint32_t stamp_min = req.start_time.sec;
+	uint32_t stamp_max = req.end_time.isZero() ? std::numeric_limits<uint32_t>::max() : req.end_time.sec;
+
+	std::vector<PainterStoredPoint> points;
+	if(req.frustum_frame.size() > 0)
+	{
+		tf::StampedTransform tf_transform;
+		if(!camera_frame_listener_.waitForTransform(map_store_frame_, req.frustum_frame, ros::Time(0), ros::Duration(0.5)))
+		{
+			ROS_ERROR_STREAM("[PointcloudPainter] Failed to find transform from " << req.frustum_frame << " to map store frame " << map_store_frame_ << " - rejecting map store query.");
+			return false;
+		}
+		camera_frame_listener_.lookupTransform(map_store_frame_, req.frustum_frame, ros::Time(0), tf_transform);
+		float transform[12];
+		for(int r=0; r<3; r++)
+		{
+			for(int c=0; c<3; c++)
+				transform[4*r+c] = tf_transform.getBasis()[r][c];
+			transform[4*r+3] = tf_transform.getOrigin()[r];
+		}
+		PainterFrustum frustum;
+		if(!frustum.setup(transform, req.frustum_horizontal_fov*M_PI/180, req.frustum_vertical_fov*M_PI/180, req.frustum_near, req.frustum_far))
+		{
+			ROS_ERROR_STREAM("[PointcloudPainter] Invalid frustum (fields of view must be within 0..180 degrees, and far beyond near) - rejecting map store query.");
+			return false;
+		}
+		res.tiles_read = map_store_.query(frustum, stamp_min, stamp_max, req.voxel_size, points);
+	}
+	else
+	{
+		PainterRegionOfInterest region;
+		if(!region.setup(req.box, std::vector<float>()))
+		{
+			ROS_ERROR_STREAM("[PointcloudPainter] Map store query box needs 10 values (center, half sizes, quaternion); got " << req.box.size() << " - rejecting map store query.");
+			return false;
+		}
+		res.tiles_read = map_store_.query(region, stamp_min, stamp_max, req.voxel_size, points);
+	}
+
+	pcl::PointCloud<pcl::PointXYZRGB> cloud;
+	cloud.points.resize(points.size());
+	for(size_t i=0; i<points.size(); i++)
+	{
+		pcl::PointXYZRGB &point = cloud.points[i];
+		point.x = points[i].x;
+		point.y = points[i].y;
+		point.z = points[i].z;
+		point.r = points[i].r;
+		point.g = points[i].g;
+		point.b = points[i].b;
+	}
+	cloud.width = cloud.points.size();
+	cloud.height = 1;
+	pcl::toROSMsg(cloud, res.cloud);
+	res.cloud.header.frame_id = map_store_frame_;
+	res.cloud.header.stamp = ros::Time::now();
+	res.point_count = cloud.points.size();
+	res.tile_count = map_store_.tileCount();
+	res.stored_point_count = map_store_.pointCount();
+	res.query_time = (ros::WallTime::now() - start_time).toSec();
+	ROS_INFO_STREAM("[PointcloudPainter] Map store query returned " << res.point_count << " points from " << res.tiles_read << " of " << res.tile_count << " tiles in " << res.query_time << " s.");
+	return true;
+}
+
+/* buildOctreeLOD - builds a color-averaged octree level-of-detail hierarchy over a painted cloud
+ 	Each level holds one point per occupied octree cell, at the centroid (and mean color) of the input points within it.
+ 	Levels are returned coarse to fine: lod_clouds[0] has a cell size of half the bounding cube, and each following level 
+ 	halves it again, down to bounding cube / 2^depth. Points are sorted once by Morton key at the finest level, so every 
+ 	cell is a contiguous run; coarser levels are then merged from the finer level's sums rather than from the raw points.
+*/
+bool PointcloudPainter::buildOctreeLOD(std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> &lod_clouds, std::vector<float> &lod_voxel_sizes, pcl::PointCloud<pcl::PointXYZRGB>::Ptr painted_cloud, int depth)
+{
+	lod_clouds.clear();
+	lod_voxel_sizes.clear();
+	if(painted_cloud->points.size() == 0 || depth < 1)
+		return false;
+	depth = std::min(depth, 21); 	// 63-bit Morton keys
+
+	// ------ Bounding Cube ------
+	Eigen::Vector4f min_pt, max_pt;
+	pcl::getMinMax3D(*painted_cloud, min_pt, max_pt);
+	float root_size = std::max( max_pt[0]-min_pt[0], std::max(max_pt[1]-min_pt[1], max_pt[2]-min_pt[2]) );
+	if(root_size <= 0)
+		root_size = 1e-3;
+	uint32_t cells_per_side = uint32_t(1) << depth;
+	float cell_scale = cells_per_side / root_size;
+
+	// ------ Sort by Finest-Level Key ------
+	std::vector<std::pair<uint64_t, int> > keyed_points;
+	keyed_points.reserve(painted_cloud->points.size());
+	for(int i=0; i<painted_cloud->points.size(); i++)
+	{
+		const pcl::PointXYZRGB &point = painted_cloud->points[i];
+		if(!pcl::isFinite(point))
+			continue;
+		uint32_t ix = std::min( uint32_t((point.x - min_pt[0]) * cell_scale), cells_per_side-1 );
+		uint32_t iy = std::min( uint32_t((point.y - min_pt[1]) * cell_scale), cells_per_side-1 );
+		uint32_t iz = std::min( uint32_t((point.z - min_pt[2]) * cell_scale), cells_per_side-1 );
+		keyed_points.push_back(std::make_pair(painterMortonEncode(ix, iy, iz), i));
 	}
-	ROS_INFO_STREAM(X_max_dist << " " << Z_max_dist << " " << plane_width);
+	std::sort(keyed_points.begin(), keyed_points.end());
+
+	// ------ Finest Level Cells ------
+	// Running sums per cell, so that coarser levels can be merged exactly
+	struct LODCell
+	{
+		uint64_t key;
+		double x, y, z;
+		double r, g, b;
+		int count;
+	};
+	std::vector<LODCell> cells;
+	for(int i=0; i<keyed_points.size(); i++)
+	{
+		const pcl::PointXYZRGB &point = painted_cloud->points[keyed_points[i].second];
+		if(cells.size() == 0 || cells.back().key != keyed_points[i].first)
+		{
+			LODCell cell = {keyed_points[i].first, 0, 0, 0, 0, 0, 0, 0};
+			cells.push_back(cell);
+		}
+		LODCell &cell = cells.back();
+		cell.x += point.x; 	cell.y += point.y; 	cell.z += point.z;
+		cell.r += point.r; 	cell.g += point.g; 	cell.b += point.b;
+		cell.count++;
+	}
+
+	// ------ Build Levels, Fine to Coarse ------
+	lod_clouds.resize(depth);
+	lod_voxel_sizes.resize(depth);
+	for(int level=depth; level>=1; level--)
+	{
+		// Output the current cells as this level
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr level_cloud(new pcl::PointCloud<pcl::PointXYZRGB>());
+		level_cloud->points.reserve(cells.size());
+		for(int i=0; i<cells.size(); i++)
+		{
+			pcl::PointXYZRGB point;
+			point.x = cells[i].x / cells[i].count;
+			point.y = cells[i].y / cells[i].count;
+			point.z = cells[i].z / cells[i].count;
+			point.r = int(round(cells[i].r / cells[i].count));
+			point.g = int(round(cells[i].g / cells[i].count));
+			point.b = int(round(cells[i].b / cells[i].count));
+			level_cloud->points.push_back(point);
+		}
+		level_cloud->width = level_cloud->points.size();
+		level_cloud->height = 1;
+		lod_clouds[level-1] = level_cloud;
+		lod_voxel_sizes[level-1] = root_size / (uint32_t(1) << level);
+
+		// Merge sibling cells into their parents (still sorted, since parent key is a prefix of child key)
+		int merged_count = 0;
+		for(int i=0; i<cells.size(); i++)
+		{
+			uint64_t parent_key = cells[i].key >> 3;
+			if(merged_count > 0 && cells[merged_count-1].key == parent_key)
+			{
+				LODCell &parent = cells[merged_count-1];
+				parent.x += cells[i].x; 	parent.y += cells[i].y; 	parent.z += cells[i].z;
+				parent.r += cells[i].r; 	parent.g += cells[i].g; 	parent.b += cells[i].b;
+				parent.count += cells[i].count;
+			}
+			else
+			{
+				cells[merged_count] = cells[i];
+				cells[merged_count].key = parent_key;
+				merged_count++;
+			}
+		}
+		cells.resize(merged_count);
+	}
+
+	return true;
+}
+
+/* loadReferencedInputs - replaces any inputs given by path (input_cloud_path, image_paths) with their data
+ 	Files and shared memory segments are mapped (see mapped_io.h). An input cloud the fused depth kernel can read
+ 	is left in the mapping, which is held open (input_cloud_points_) until releaseReferencedInputs at the end of the
+ 	call; any other cloud, and the images, are copied once into the request. Images stay encoded, so they are 
+ 	decoded at reduced resolution like any other compressed image.
+*/
+bool PointcloudPainter::loadReferencedInputs(pointcloud_painter::pointcloud_painter_srv::Request &req)
+{
+	releaseReferencedInputs();
+	if(req.input_cloud_path.size() > 0)
+	{
+		if(!painterMapCloud(req.input_cloud_path, input_cloud_file_, req.input_cloud, input_cloud_points_))
+		{
+			ROS_ERROR_STREAM("[PointcloudPainter] Failed to read input cloud from " << req.input_cloud_path << " - it must be a binary PCD or binary little-endian PLY.");
+			input_cloud_points_ = NULL;
+			return false;
+		}
+		// The fused depth kernel reads the points in place; any other layout goes through PCL, so is copied out
+		PainterDepthInput depth_layout;
+		if(painterDepthLayout(req.input_cloud, depth_layout, input_cloud_points_))
+			ROS_INFO_STREAM("[PointcloudPainter]   mapped input cloud from " << req.input_cloud_path);
+		else
+		{
+			req.input_cloud.data.assign(input_cloud_points_, input_cloud_points_ + size_t(req.input_cloud.row_step) * req.input_cloud.height);
+			releaseReferencedInputs();
+			ROS_INFO_STREAM("[PointcloudPainter]   read input cloud from " << req.input_cloud_path);
+		}
+	}
+	if(req.compressed_image_list.size() < req.image_paths.size())
+		req.compressed_image_list.resize(req.image_paths.size());
+	for(int i=0; i<req.image_paths.size(); i++)
+	{
+		if(req.image_paths[i].size() == 0)
+			continue;
+		if(!painterReadImage(req.image_paths[i], req.compressed_image_list[i]))
+		{
+			ROS_ERROR_STREAM("[PointcloudPainter] Failed to read image from " << req.image_paths[i]);
+			return false;
+		}
+		if(i < req.image_list.size())
+			req.compressed_image_list[i].header = req.image_list[i].header;
+	}
+	return true;
+}
+
+/* releaseReferencedInputs - unmaps the input cloud left mapped by loadReferencedInputs, if any
+*/
+void PointcloudPainter::releaseReferencedInputs()
+{
+	input_cloud_file_.close();
+	input_cloud_points_ = NULL;
+}
+
+/* decodeCompressedImage - decodes a sensor_msgs/CompressedImage directly to BGR8 at reduced resolution
+ 	The JPEG decoder can apply DCT scaling of 1/2, 1/4 or 1/8 while decoding, which is much cheaper than decoding
+ 	the full raster and then averaging it down. The largest of those factors which evenly divides compression_ratio 
+ 	is applied here; remaining_ratio returns whatever is left over, to be handled by downsampleImage.
+ 	Non-JPEG formats (png, etc.) are still decoded correctly, just without the decode-time savings.
+*/
+bool PointcloudPainter::decodeCompressedImage(cv_bridge::CvImagePtr image_out, const sensor_msgs::CompressedImage &image_in, int compression_ratio, int &remaining_ratio)
+{
+	int decode_scale = 1;
+	int decode_flag = cv::IMREAD_COLOR;
+	if(compression_ratio % 8 == 0)
+	{
+		decode_scale = 8;
+		decode_flag = cv::IMREAD_REDUCED_COLOR_8;
+	}
+	else if(compression_ratio % 4 == 0)
+	{
+		decode_scale = 4;
+		decode_flag = cv::IMREAD_REDUCED_COLOR_4;
+	}
+	else if(compression_ratio % 2 == 0)
+	{
+		decode_scale = 2;
+		decode_flag = cv::IMREAD_REDUCED_COLOR_2;
+	}
+
+	// cv::imdecode does not modify the buffer, so wrap the message data rather than copying it
+	cv::Mat raw_data(1, image_in.data.size(), CV_8UC1, const_cast<unsigned char*>(&image_in.data[0]));
+	try
+	{
+		image_out->image = cv::imdecode(raw_data, decode_flag);
+	}
+	catch(cv::Exception& e)
+	{
+		ROS_ERROR_STREAM("[PointcloudPainter] failed to decode compressed image: " << e.what());
+		return false;
+	}
+	if(image_out->image.empty())
+	{
+		ROS_ERROR_STREAM("[PointcloudPainter] failed to decode compressed image with format " << image_in.format);
+		return false;
+	}
+	image_out->header = image_in.header;
+	image_out->encoding = sensor_msgs::image_encodings::BGR8;
+
+	remaining_ratio = compression_ratio / decode_scale;
+	ROS_DEBUG_STREAM("[PointcloudPainter] decoded compressed image at 1/" << decode_scale << " scale to " << image_out->image.rows << " by " << image_out->image.cols);
+	return true;
+}
+
+/* buildImageClouds - looks up the lens model for this image in the registry, and runs its specialized kernel */
+bool PointcloudPainter::buildImageClouds(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_flat, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical_lobed, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical, cv_bridge::CvImageConstPtr cv_image, std::string camera_frame, std::string target_frame, int projection, const PainterLensParams &lens_params, const PainterRegionOfInterest *roi, int image_number)
+{
+	std::map<int, ImageCloudKernel>::iterator kernel = lens_kernels_.find(projection);
+	if(kernel == lens_kernels_.end())
+	{
+		ROS_ERROR_STREAM("[PointcloudPainter] No lens model registered for projection type " << projection << " - skipping image " << image_number);
+		return false;
+	}
+	return (this->*(kernel->second))(pcl_flat, pcl_spherical_lobed, pcl_spherical, cv_image, camera_frame, target_frame, lens_params, roi, image_number);
+}
+
+/* buildImageCloudsKernel - builds the flat and spherical RGB clouds for one image, specialized on its lens model
+ 	Lens is one of the policies in lens_models.h; since it is a template parameter, its projection is inlined into
+ 	the pixel loop and the cut_corners test is resolved at compile time, so there is no per-pixel switch.
+ 	roi - if not NULL, pixels whose rays (from target_frame's origin) miss the region are dropped before they are read
+*/
+template<typename Lens>
+bool PointcloudPainter::buildImageCloudsKernel(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_flat, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical_lobed, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &pcl_spherical, cv_bridge::CvImageConstPtr cv_image, std::string camera_frame, std::string target_frame, const PainterLensParams &lens_params, const PainterRegionOfInterest *roi, int image_number)
+{
+	pcl::PointCloud<pcl::PointXYZRGB> untransformed_sphere_pcl;
+	int pixel_format = painterPixelFormat(cv_image->encoding);
+	int image_hgt = lens_params.image_hgt;
+	int image_wdt = lens_params.image_wdt;
+	// Only the pixels within the region of the image which was actually given are visited
+	int row_offset = lens_params.row_offset;
+	int col_offset = lens_params.col_offset;
+	int row_end = std::min(row_offset + lens_params.region_hgt, image_hgt);
+	int col_end = std::min(col_offset + lens_params.region_wdt, image_wdt);
+
+	// Precompute everything which is constant over the image (real image dimensions, to project properly to a R=1m sphere)
+	Lens lens;
+	if(!lens.setup(lens_params))
+	{
+		ROS_ERROR_STREAM("[PointcloudPainter] Invalid lens parameters for image " << image_number << " - skipping it");
+		return false;
+	}
+	// Rotation and translation from camera_frame to target_frame, to test each pixel's ray against the region of interest
+	float roi_transform[12];
+	if(roi != NULL)
+	{
+		tf::StampedTransform camera_to_target;
+		if(camera_frame_listener_.waitForTransform(target_frame, camera_frame, ros::Time(0), ros::Duration(0.5)))
+		{
+			camera_frame_listener_.lookupTransform(target_frame, camera_frame, ros::Time(0), camera_to_target);
+			for(int r=0; r<3; r++)
+			{
+				for(int c=0; c<3; c++)
+					roi_transform[4*r+c] = camera_to_target.getBasis()[r][c];
+				roi_transform[4*r+3] = camera_to_target.getOrigin()[r];
+			}
+		}
+		else
+		{
+			ROS_WARN_STREAM("[PointcloudPainter] Warning - no transform from frame " << camera_frame << " to frame " << target_frame << " for the region of interest - keeping every pixel of image " << image_number);
+			roi = NULL;
+		}
+	}
+	untransformed_sphere_pcl.points.reserve(lens_params.region_hgt*lens_params.region_wdt);
+	pcl_flat->points.reserve(pcl_flat->points.size() + lens_params.region_hgt*lens_params.region_wdt);
+
 	// ------------------ Process Cloud ------------------
-	for(int i=0; i<image_hgt; i++)
+	for(int i=row_offset; i<row_end; i++)
 	{
-		for(int j=0; j<image_wdt; j++)
+		for(int j=col_offset; j<col_end; j++)
 		{
 			// ------------------ Create point for flat RGB image cloud ------------------
 			// ----- Create point and set XYZ -----
@@ -331,82 +1596,34 @@ bool PointcloudPainter::buildImageClouds(pcl::PointCloud<pcl::PointXYZRGB>::Ptr
 			point_flat.x = float(i-image_hgt/2) / image_hgt;
 			point_flat.y = float(j-image_wdt/2) / image_wdt;
 			point_flat.z = 0;
-			// ----- Set RGB -----
-			// cv_bridge::CVImagePtr->image returns a cv::Mat, which allows pixelwise access
-			//   https://answers.ros.org/question/187649/pointer-image-multi-channel-access/
-			//   NOTE - data is saved in BGR format (not RGB)
-			point_flat.b = cv_image->image.at<cv::Vec3b>(i,j)[0];
-			point_flat.g = cv_image->image.at<cv::Vec3b>(i,j)[1];
-			point_flat.r = cv_image->image.at<cv::Vec3b>(i,j)[2];
 
 			// ------------------ Check Image Bounds ------------------
 			// Ignore points which are outside of curvilinear images 
 			//   (in the extra black padding space used to make the projected flat elliptical image rectangular)
-			if(cut_corners)
-				if( sqrt(pow(point_flat.x,2) + pow(point_flat.y,2)) > 0.5)
+			if(Lens::cut_corners)
+				if( point_flat.x*point_flat.x + point_flat.y*point_flat.y > 0.25 )
 					continue;
 
 			// ------------------ Create point for spherical RGB image cloud ------------------
 			pcl::PointXYZRGB point_sphere;
+			if(!lens.inverse(i, j, point_flat.x, point_flat.y, point_sphere))
+				continue;
+			if(roi != NULL)
+			{
+				float x = roi_transform[0]*point_sphere.x + roi_transform[1]*point_sphere.y + roi_transform[2]*point_sphere.z + roi_transform[3];
+				float y = roi_transform[4]*point_sphere.x + roi_transform[5]*point_sphere.y + roi_transform[6]*point_sphere.z + roi_transform[7];
+				float z = roi_transform[8]*point_sphere.x + roi_transform[9]*point_sphere.y + roi_transform[10]*point_sphere.z + roi_transform[11];
+				if(!roi->containsDirection(x, y, z, PAINTER_ROI_PIXEL_MARGIN))
+					continue;
+			}
+
 			// ----- Set RGB -----
+			// Read straight from the (possibly shared) image buffer in its native encoding
+			//   Only done for pixels inside the valid image region, so padding pixels are never converted
+			painterReadPixel(cv_image->image, pixel_format, i-row_offset, j-col_offset, point_flat.r, point_flat.g, point_flat.b);
 			point_sphere.r = point_flat.r;
 			point_sphere.g = point_flat.g;
 			point_sphere.b = point_flat.b;
-			// ----- Set XYZ -----
-			bool cut_corners = true;
-			switch(projection)
-			{
-				float xs, ys;
-				case PAINTER_PROJ_EQUA_STEREO:
-					// Account for FOV lens angle being less than 360 degrees
-					xs = point_flat.x * plane_width;
-					ys = point_flat.y * plane_width;
-					// Perform projection
-					point_sphere.x = ( 2*xs/(1 + pow(xs,2) + pow(ys,2)) );
-					point_sphere.y = ( 2*ys/(1 + pow(xs,2) + pow(ys,2)) );
-					point_sphere.z = ( (-1 + pow(xs,2) + pow(ys,2))/(1 + pow(xs,2) + pow(ys,2)) );
-					break;
-				case PAINTER_PROJ_POLE_STEREO:
-					// Account for FOV lens angle being less than 360 degrees
-					xs = point_flat.x * plane_width;
-					ys = point_flat.y * plane_width;
-					// Perform projection
-					point_sphere.x = ( 2*xs/(1 + pow(xs,2) + pow(ys,2)) );
-					point_sphere.y = ( 2*ys/(1 + pow(xs,2) + pow(ys,2)) );
-					point_sphere.z = ( (-1 + pow(xs,2) + pow(ys,2))/(1 + pow(xs,2) + pow(ys,2)) );
-					break;
-				case PAINTER_PROJ_EQUAL_AREA:
-					// Account for FOV lens angle being less than 360 degrees
-					xs = point_flat.x * plane_width;
-					ys = point_flat.y * plane_width;
-					// Perform projection
-					point_sphere.x = sqrt( 1 - (pow(xs,2) + pow(ys,2))/4 ) * xs;
-					point_sphere.y = sqrt( 1 - (pow(xs,2) + pow(ys,2))/4 ) * ys;
-					point_sphere.z = ( -1 + (pow(xs,2) + pow(ys,2))/2 );
-					break;
-				case PAINTER_PROJ_FLAT:
-					//float point_distance = sqrt( pow(point_flat.x/image_hgt*plane_width,2) + pow(point_flat.y/image_hgt*plane_width,2) + pow(flat_image_distance,2) );
-					//point_sphere.x = point_flat.x/point_distance;
-					//point_sphere.y = point_flat.y/point_distance;
-					//point_sphere.z = -flat_image_distance/point_distance;
-					float alpha = atan((1-2*float(i)/float(image_wdt))*tan(max_angle/2));
-					float max_angle_off = max_angle * float(image_hgt) / float(image_wdt);
-					float beta = atan((1-2*float(j)/float(image_hgt))*tan(max_angle_off/2));
-					point_sphere.x = cos(beta)*cos(alpha);//sin(alpha);
-					point_sphere.y = cos(beta)*sin(alpha);//sin(beta);
-					point_sphere.z = cos(beta);//sqrt(1 - pow(point_sphere.x,2) - pow(point_sphere.y,2));
-
-					break;
-			}
-
-			//float angle_from_zenith = asin(point_sphere.z);
-			//float angular_upset = 5*(3.14159/360) * (exp(angle_from_zenith/1.57*1)-1);
-			//float horizontal_reduction = cos(angle_from_zenith + angular_upset) / cos(angle_from_zenith);
-			//float vertical_increase = sin(angle_from_zenith + angular_upset) / sin(angle_from_zenith);
-			//point_sphere.x *= horizontal_reduction;
-			//point_sphere.y *= horizontal_reduction;
-			//point_sphere.z *= vertical_increase;
-			//ROS_INFO_STREAM("Offsets... " << point_sphere.x << " " << point_sphere.y << " " << point_sphere.z << " | " << angle_from_zenith << " " << angular_upset << " | " << horizontal_reduction << " " << vertical_increase);
 
 			// ------------------ Add to cloud ------------------
 			point_flat.x += image_number;
@@ -417,6 +1634,7 @@ bool PointcloudPainter::buildImageClouds(pcl::PointCloud<pcl::PointXYZRGB>::Ptr
 	}
 
 	// Transform output cloud to target_frame from camera_frame
+	size_t first_new_point = pcl_spherical_lobed->points.size();
 	if(camera_frame_listener_.waitForTransform(camera_frame, target_frame, ros::Time::now(), ros::Duration(0.5)))  
 	{
 		// Input message
@@ -428,14 +1646,15 @@ bool PointcloudPainter::buildImageClouds(pcl::PointCloud<pcl::PointXYZRGB>::Ptr
 		pcl_ros::transformPointCloud (target_frame, untransformed_sphere, transformed_sphere, camera_frame_listener_);  	// transforms input_pc2 into process_message
 		// Output PCL data type 
 		pcl::fromROSMsg(transformed_sphere, untransformed_sphere_pcl);
-		for(int i=0; i<untransformed_sphere_pcl.points.size(); i++)
-			pcl_spherical_lobed->points.push_back(untransformed_sphere_pcl.points[i]);
+		pcl_spherical_lobed->points.insert(pcl_spherical_lobed->points.end(), untransformed_sphere_pcl.points.begin(), untransformed_sphere_pcl.points.end());
 	}
 	else
 		ROS_WARN_STREAM("[PointcloudPainter] Warning - failed to transform cloud from frame " << camera_frame << " to frame " << target_frame);
 
 	// Actually perform projection: 
-	for(int i=0; i<pcl_spherical_lobed->points.size(); i++)
+	//   Only this image's points - earlier images' lobed points have already been added to pcl_spherical
+	pcl_spherical->points.reserve(pcl_spherical_lobed->points.size());
+	for(size_t i=first_new_point; i<pcl_spherical_lobed->points.size(); i++)
 	{
 		float distance = sqrt( pow(pcl_spherical_lobed->points[i].x,2) + pow(pcl_spherical_lobed->points[i].y,2) + pow(pcl_spherical_lobed->points[i].z,2) );
 		pcl::PointXYZRGB point;
@@ -499,52 +1718,157 @@ bool PointcloudPainter::interpolateColors(pcl::PointCloud<pcl::PointXYZRGB>::Ptr
 	}
 }
 
+/* blendNeighbors - the painted value for one query point, from its neighbors on the color sphere
+ 	Inverse-distance weighted average of the neighbor colors (value = r, g, b); false if even the nearest neighbor
+ 	is too far away for the point to be colored.
+*/
+bool PointcloudPainter::blendNeighbors(PainterSphereIndex<PainterSphereColor> &color_sphere, const std::vector<int> &nearest_indices, const std::vector<float> &nearest_dist_squareds, float *value)
+{
+	if(nearest_indices.size() == 0 || nearest_dist_squareds[0] >= PAINTER_COLOR_MAX_SQR_DISTANCE)
+		return false;
+	// Currently, just assign colors as inverse-distance weighted average of neighbor colors
+	float total_inverse_dist = 0;
+	float r_temp = 0;
+	float g_temp = 0;
+	float b_temp = 0;
+	// Iterate over each neighbor
+	for(int j=0; j<nearest_indices.size(); j++)
+	{
+		// For each neighbor, add its weighted color to the total for the target point
+		float dist = pow(nearest_dist_squareds[j],0.5);
+		r_temp += float(color_sphere.points[nearest_indices[j]].r) / dist;
+		g_temp += float(color_sphere.points[nearest_indices[j]].g) / dist;
+		b_temp += float(color_sphere.points[nearest_indices[j]].b) / dist;
+		// Increment the total distance by the distance to this neighbor
+		total_inverse_dist += 1/dist;
+	}
+	// Correct for distance weights!
+	value[0] = r_temp / total_inverse_dist;
+	value[1] = g_temp / total_inverse_dist;
+	value[2] = b_temp / total_inverse_dist;
+	return true;
+}
+
+/* blendNeighbors - the painted value for one query point, from its neighbors on the depth sphere
+ 	Inverse-distance weighted average of the neighbor ranges (value = range), skipping neighbors across a depth 
+ 	edge; false if even the nearest neighbor is too far away for the point to be given a depth.
+*/
+bool PointcloudPainter::blendNeighbors(PainterSphereIndex<PainterSphereDepth> &depth_sphere, const std::vector<int> &nearest_indices, const std::vector<float> &nearest_dist_squareds, float *value)
+{
+	if(nearest_indices.size() == 0 || nearest_dist_squareds[0] > PAINTER_DEPTH_MAX_SQR_DISTANCE)
+		return false;
+	float total_inverse_dist = 0;
+	float depth = 0;
+	float previous_depth;
+	// Iterate over each neighbor
+	for(int j=0; j<nearest_indices.size(); j++)
+	{
+		// For each neighbor, add its weighted depth to the total for the target point
+		float dist = pow(nearest_dist_squareds[j],0.5);
+		float new_depth = depth_sphere.points[nearest_indices[j]].range;
+		// If a further neighbor is more than threshold distance from previous neighbor, ignore it (at object edges)
+		if(j > 0 && fabs(new_depth-previous_depth) > 0.2)
+			continue;
+		previous_depth = new_depth;
+		// Update total depth estimate
+		depth += new_depth / dist;
+		// Increment the total distance by the distance to this neighbor
+		total_inverse_dist += 1/dist;
+	}
+	// Correct for distance weights!
+	value[0] = depth / total_inverse_dist;
+	return true;
+}
+
+/* validateNeighborSearch - measures what an approximate neighbor search costs in accuracy
+ 	Searches an evenly spaced sample of the query points both with the sphere's current (approximate) settings and 
+ 	exactly. recall is the mean fraction of the exact k neighbors which the approximate search also found, and
+ 	deviation the mean difference between the values painted from each (RGB distance for colors, meters for ranges).
+ 	Both searches are limited to max_sqr_distance, as the painter's own. The sphere's approximation settings are left
+ 	as they were.
+*/
+template<typename SphereT, typename QueryT>
+void PointcloudPainter::validateNeighborSearch(PainterSphereIndex<SphereT> &sphere, const pcl::PointCloud<QueryT> &queries, int k, float max_sqr_distance, int samples, float &recall, float &deviation)
+{
+	recall = 1;
+	deviation = 0;
+	if(samples <= 0 || queries.points.size() == 0 || k <= 0)
+		return;
+	float epsilon = sphere.epsilon();
+	int max_checks = sphere.maxChecks();
+	size_t stride = std::max<size_t>(1, queries.points.size() / samples);
+	std::vector<int> approximate_indices, exact_indices;
+	std::vector<float> approximate_dists, exact_dists;
+	double recall_sum = 0;
+	double deviation_sum = 0;
+	int searched = 0;
+	int painted = 0;
+	for(size_t i=0; i<queries.points.size() && searched<samples; i+=stride)
+	{
+		const QueryT &query = queries.points[i];
+		sphere.setApproximation(epsilon, max_checks);
+		sphere.nearestKSearch(query.x, query.y, query.z, k, approximate_indices, approximate_dists, max_sqr_distance);
+		sphere.setApproximation(0, 0);
+		if(sphere.nearestKSearch(query.x, query.y, query.z, k, exact_indices, exact_dists, max_sqr_distance) == 0)
+			continue;
+		searched++;
+		int found = 0;
+		for(size_t a=0; a<approximate_indices.size(); a++)
+			if(std::find(exact_indices.begin(), exact_indices.end(), approximate_indices[a]) != exact_indices.end())
+				found++;
+		recall_sum += double(found) / exact_indices.size();
+
+		float approximate_value[3] = {0, 0, 0};
+		float exact_value[3] = {0, 0, 0};
+		bool approximate_painted = blendNeighbors(sphere, approximate_indices, approximate_dists, approximate_value);
+		bool exact_painted = blendNeighbors(sphere, exact_indices, exact_dists, exact_value);
+		if(approximate_painted && exact_painted)
+		{
+			deviation_sum += sqrt( pow(approximate_value[0]-exact_value[0],2) + pow(approximate_value[1]-exact_value[1],2) + pow(approximate_value[2]-exact_value[2],2) );
+			painted++;
+		}
+	}
+	sphere.setApproximation(epsilon, max_checks);
+	if(searched > 0)
+		recall = recall_sum / searched;
+	if(painted > 0)
+		deviation = deviation_sum / painted;
+}
+
+
 // ------------------ SECOND METHOD ------------------
 // K Nearest Neighbor search for color determination 
 // This version projects color onto the depth cloud; see next function for inverse
-bool PointcloudPainter::projectColorOntoDepth(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr spherical_depth_cloud, pcl::PointCloud<pcl::PointXYZI>::Ptr &depth_cloud, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &rgb_cloud, int ver_res, int hor_res, int k)
+//   The color sphere is searched directly in its octahedral encoding, by the direction of each depth point
+//   Depth points are visited along a Morton curve over the sphere, so that consecutive searches hit the same cells
+bool PointcloudPainter::projectColorOntoDepth(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, pcl::PointCloud<pcl::PointXYZI>::Ptr &depth_cloud, PainterSphereIndex<PainterSphereColor> &color_sphere, int ver_res, int hor_res, int k, bool preserve_order)
 {
-	ROS_ERROR_STREAM("neighbor_count " << k << " depth size: " << spherical_depth_cloud->points.size() << " " << depth_cloud->points.size());
-	pcl::KdTreeFLANN<pcl::PointXYZRGB> kdtree;
-	kdtree.setInputCloud(rgb_cloud);
+	ROS_ERROR_STREAM("neighbor_count " << k << " depth size: " << depth_cloud->points.size() << " color size: " << color_sphere.points.size());
 
 	int num_points_colored = 0;
-
-	for(int i=0; i<spherical_depth_cloud->points.size(); i++)
+	std::vector<int> nearest_indices(k); 			// Indices (within color sphere) of neighbors to target point
+	std::vector<float> nearest_dist_squareds(k);	// Distances (within color sphere) of neighbors to target point
+	std::vector<uint32_t> &query_order = buffer_pool_.query_order;
+	std::vector<uint32_t> &output_origins = buffer_pool_.output_origins;
+	painterSphereMortonOrder(depth_cloud->points, query_order);
+	output_origins.clear();
+
+	for(int n=0; n<query_order.size(); n++)
 	{
-		// Create a new point, assign the XYZ positions from spherical_depth_cloud
+		// Anytime painting gives up on this level once its deadline passes
+		if(n % PAINTER_DEADLINE_CHECK_STRIDE == 0 && deadlinePassed())
+			return false;
+		int i = query_order[n];
 		pcl::PointXYZRGB point;
-		point.x = spherical_depth_cloud->points[i].x;
-		point.y = spherical_depth_cloud->points[i].y;
-		point.z = spherical_depth_cloud->points[i].z;
-
-		std::vector<int> nearest_indices(k); 			// Indices (within RGB cloud) of neighbors to target point
-		std::vector<float> nearest_dist_squareds(k);	// Distances (within RGB cloud) of neighbors to target point
 
-		if ( kdtree.nearestKSearch (point, k, nearest_indices, nearest_dist_squareds) > 0 )
+		if ( color_sphere.nearestKSearch (depth_cloud->points[i].x, depth_cloud->points[i].y, depth_cloud->points[i].z, k, nearest_indices, nearest_dist_squareds, PAINTER_COLOR_MAX_SQR_DISTANCE) > 0 )
 		{
-			if(nearest_dist_squareds[0] < .05)
+			float color[3];
+			if(blendNeighbors(color_sphere, nearest_indices, nearest_dist_squareds, color))
 			{
-				// Currently, just assign colors as inverse-distance weighted average of neighbor colors
-				float total_inverse_dist = 0;
-				float r_temp = 0;
-				float g_temp = 0;
-				float b_temp = 0;
-				// Iterate over each neighbor
-				for(int j=0; j<nearest_indices.size(); j++)
-				{
-					// For each neighbor, add its weighted color to the total for the target point
-					float dist = pow(nearest_dist_squareds[j],0.5);
-					r_temp += float(rgb_cloud->points[nearest_indices[j]].r) / dist;
-					g_temp += float(rgb_cloud->points[nearest_indices[j]].g) / dist;
-					b_temp += float(rgb_cloud->points[nearest_indices[j]].b) / dist;
-					// Increment the total distance by the distance to this neighbor
-					total_inverse_dist += 1/dist;
-				}
-				// Correct for distance weights!
-				point.r = int(round(r_temp / total_inverse_dist));
-				point.g = int(round(g_temp / total_inverse_dist));
-				point.b = int(round(b_temp / total_inverse_dist));
+				point.r = int(round(color[0]));
+				point.g = int(round(color[1]));
+				point.b = int(round(color[2]));
 				// Increment point counter
 				num_points_colored++;
 			} 
@@ -554,7 +1878,7 @@ bool PointcloudPainter::projectColorOntoDepth(pcl::PointCloud<pcl::PointXYZRGB>:
 				point.g = 0;
 				point.b = 0;
 			}
-			// Correct XYZ values for projected depth cloud back to original values
+			// XYZ values from the original depth cloud
 			point.x = depth_cloud->points[i].x;
 			point.y = depth_cloud->points[i].y;
 			point.z = depth_cloud->points[i].z;
@@ -562,27 +1886,39 @@ bool PointcloudPainter::projectColorOntoDepth(pcl::PointCloud<pcl::PointXYZRGB>:
 			if(point.r + point.g + point.b == 0)
 				continue;
 			output_cloud->points.push_back(point);
+			if(preserve_order)
+				output_origins.push_back(i);
 		}
-		else 
-			ROS_ERROR_STREAM_THROTTLE(0.1, "[PointcloudPainter] KdTree Nearest Neighbor search failed! Unable to find neighbors for point " << i << "with XYZ values " << depth_cloud->points[i].x << " " << depth_cloud->points[i].y << " " << depth_cloud->points[i].z << ". This message is throttled...");
+		// Otherwise no color lies within reach of this point (outside the cameras' coverage) - it is left unpainted
 	}
 			
-	ROS_INFO_STREAM("[PointcloudPainter] Finished color projection onto depth cloud. Out of " << spherical_depth_cloud->points.size() << " depth points, " << num_points_colored << " were assigned color values.");
-
+	if(preserve_order)
+		restorePointOrder(output_cloud, output_origins, depth_cloud->points.size());
+	ROS_INFO_STREAM("[PointcloudPainter] Finished color projection onto depth cloud. Out of " << depth_cloud->points.size() << " depth points, " << num_points_colored << " were assigned color values.");
+	return true;
 }
 
 
 // ------------------ SECOND METHOD ------------------
 // K Nearest Neighbor search for color determination 
 // This version projects color onto the depth cloud; see next function for inverse
-bool PointcloudPainter::projectDepthOntoColor(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr spherical_depth_cloud, pcl::PointCloud<pcl::PointXYZI>::Ptr &depth_cloud, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &rgb_cloud, int ver_res, int hor_res, int k)
+//   The depth sphere is searched directly in its octahedral encoding, and holds each point's range
+//   Color points are visited along a Morton curve over the sphere rather than image by image, in raster order
+bool PointcloudPainter::projectDepthOntoColor(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &output_cloud, PainterSphereIndex<PainterSphereDepth> &depth_sphere, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &rgb_cloud, int ver_res, int hor_res, int k, bool preserve_order)
 {
-	ROS_ERROR_STREAM("neighbor_count " << k << " depth size: " << spherical_depth_cloud->points.size() << " " << depth_cloud->points.size() << " color size: " << rgb_cloud->points.size());
-	pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-	kdtree.setInputCloud(spherical_depth_cloud);
-
-	for(int i=0; i<rgb_cloud->points.size(); i++)
+	ROS_ERROR_STREAM("neighbor_count " << k << " depth size: " << depth_sphere.points.size() << " color size: " << rgb_cloud->points.size());
+	std::vector<int> nearest_indices(k); 			// Indices (within depth sphere) of neighbors to target point
+	std::vector<float> nearest_dist_squareds(k);	// Distances (within depth sphere) of neighbors to target point
+	std::vector<uint32_t> &query_order = buffer_pool_.query_order;
+	std::vector<uint32_t> &output_origins = buffer_pool_.output_origins;
+	painterSphereMortonOrder(rgb_cloud->points, query_order);
+	output_origins.clear();
+
+	for(int n=0; n<query_order.size(); n++)
 	{
+		if(n % PAINTER_DEADLINE_CHECK_STRIDE == 0 && deadlinePassed())
+			return false;
+		int i = query_order[n];
 		// Create the output color point
 		pcl::PointXYZRGB point;
 		point.r = rgb_cloud->points[i].r;
@@ -597,38 +1933,12 @@ bool PointcloudPainter::projectDepthOntoColor(pcl::PointCloud<pcl::PointXYZRGB>:
 		float horizontal_dist = sqrt( pow(xyz_point.x,2) + pow(xyz_point.y,2) ); 	// If point were projected onto XY plane, its distance from (0,0,0)
 		float altitude = atan2(xyz_point.z, horizontal_dist); 						// Vertical angle of vector to point away from its projection onto XY plane
 
-		std::vector<int> nearest_indices(k); 			// Indices (within RGB cloud) of neighbors to target point
-		std::vector<float> nearest_dist_squareds(k);	// Distances (within RGB cloud) of neighbors to target point
-
-		if ( kdtree.nearestKSearch (xyz_point, k, nearest_indices, nearest_dist_squareds) > 0 )
+		if ( depth_sphere.nearestKSearch (xyz_point.x, xyz_point.y, xyz_point.z, k, nearest_indices, nearest_dist_squareds, PAINTER_DEPTH_MAX_SQR_DISTANCE) > 0 )
 		{
-			if(pow(nearest_dist_squareds[0],0.5) > .02)
+			float depth;
+			if(!blendNeighbors(depth_sphere, nearest_indices, nearest_dist_squareds, &depth))
 				continue;
 
-			// Currently, just assign colors as inverse-distance weighted average of neighbor colors
-			float total_inverse_dist = 0;
-			float depth = 0;
-			float previous_depth;
-			// Iterate over each neighbor
-			for(int j=0; j<nearest_indices.size(); j++)
-			{
-				// For each neighbor, add its weighted color to the total for the target point
-				float dist = pow(nearest_dist_squareds[j],0.5);
-				float new_depth = sqrt(  pow(depth_cloud->points[nearest_indices[j]].x, 2) +
-								   	     pow(depth_cloud->points[nearest_indices[j]].y, 2) + 
-								         pow(depth_cloud->points[nearest_indices[j]].z, 2) );
-				// If a further neighbor is more than threshold distance from previous neighbor, ignore it (at object edges)
-				if(j > 0 && fabs(new_depth-previous_depth) > 0.2)
-					continue;
-				previous_depth = new_depth;
-				// Update total depth estimate
-				depth += new_depth / dist;
-				// Increment the total distance by the distance to this neighbor
-				total_inverse_dist += 1/dist;
-			}
-			// Correct for distance weights!
-			depth /= total_inverse_dist;
-
 			// Determine XYZ based on Azimuth, Altitude, and Depth
 			point.z = depth * sin(altitude);
 			float xy_distance = depth * cos(altitude);  // Distance projected onto XY plane
@@ -637,14 +1947,32 @@ bool PointcloudPainter::projectDepthOntoColor(pcl::PointCloud<pcl::PointXYZRGB>:
 
 			// Add new point to output cloud
 			output_cloud->points.push_back(point);
+			if(preserve_order)
+				output_origins.push_back(i);
 		}
-		else 
-			ROS_ERROR_STREAM_THROTTLE(0.1, "[PointcloudPainter] KdTree Nearest Neighbor search failed! Unable to find neighbors for point " << i << "with XYZ values " << depth_cloud->points[i].x << " " << depth_cloud->points[i].y << " " << depth_cloud->points[i].z << ". This message is throttled...");
-		ROS_DEBUG_STREAM_THROTTLE(3.0, "[PointcloudPainter] Made it through " << i << " out of " << rgb_cloud->points.size() << " points in projection so far.");
+		// Otherwise no depth lies within reach of this pixel (outside the depth sensor's coverage) - it is left unpainted
+		ROS_DEBUG_STREAM_THROTTLE(3.0, "[PointcloudPainter] Made it through " << n << " out of " << rgb_cloud->points.size() << " points in projection so far.");
 	}
 
+	if(preserve_order)
+		restorePointOrder(output_cloud, output_origins, rgb_cloud->points.size());
 	ROS_INFO_STREAM("[PointcloudPainter] Finished depth projection onto color cloud. Out of " << rgb_cloud->points.size() << " color points, " << output_cloud->points.size() << " were assigned depth values.");
-			
+	return true;
+}
+
+// restorePointOrder - puts painted points back in the order of the query points they came from (origins[m] for output point m)
+void PointcloudPainter::restorePointOrder(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud, const std::vector<uint32_t> &origins, size_t query_count)
+{
+	// Each query point gives at most one output point, so a slot per query point is enough to invert the permutation
+	std::vector<int> slots(query_count, -1);
+	for(size_t m=0; m<origins.size(); m++)
+		slots[origins[m]] = m;
+	pcl::PointCloud<pcl::PointXYZRGB>::VectorType ordered_points;
+	ordered_points.reserve(cloud->points.size());
+	for(size_t q=0; q<query_count; q++)
+		if(slots[q] >= 0)
+			ordered_points.push_back(cloud->points[slots[q]]);
+	cloud->points.swap(ordered_points);
 }
 
 